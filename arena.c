@@ -0,0 +1,133 @@
+#include "cscshell.h"
+
+/*
+** Bump allocator for everything built while running a single line.
+**
+** Allocations are carved out of a chain of blocks and are never freed
+** individually; arena_reset() releases the whole line at once. When a
+** line needed more than one block, the reset replaces the chain with a
+** single block big enough for all of it, so a shell reusing one arena
+** across lines stops calling malloc once it has seen its largest line.
+**
+** arena_stats totals the allocations and blocks of every arena, for the
+** `stats` builtin.
+*/
+
+#define ARENA_ALIGN 16
+#define ARENA_MIN_BLOCK 4096
+
+ArenaStats arena_stats = {0, 0, 0, 0};
+
+struct ArenaBlock {
+    struct ArenaBlock *next;
+    size_t cap;
+    size_t used;
+    char data[];
+};
+
+
+void arena_init(Arena *arena){
+    arena->head = NULL;
+    arena->total_cap = 0;
+    arena->allocs = 0;
+    arena->bytes = 0;
+}
+
+
+static ArenaBlock *arena_new_block(size_t cap){
+    ArenaBlock *block = malloc(sizeof(ArenaBlock) + cap);
+    if (block == NULL){
+        perror("arena");
+        return NULL;
+    }
+    block->next = NULL;
+    block->cap = cap;
+    block->used = 0;
+    arena_stats.blocks++;
+    arena_stats.block_bytes += cap;
+    return block;
+}
+
+
+/*
+** Returns size bytes of ARENA_ALIGN-aligned memory that stay valid until
+** the next arena_reset(), or NULL if memory could not be allocated.
+*/
+void *arena_alloc(Arena *arena, size_t size){
+    size = (size + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1);
+
+    ArenaBlock *block = arena->head;
+    if (block == NULL || block->cap - block->used < size){
+        size_t cap = arena->total_cap > ARENA_MIN_BLOCK ?
+            arena->total_cap : ARENA_MIN_BLOCK;
+        while (cap < size) cap *= 2;
+
+        block = arena_new_block(cap);
+        if (block == NULL) return NULL;
+        block->next = arena->head;
+        arena->head = block;
+        arena->total_cap += cap;
+    }
+
+    void *mem = block->data + block->used;
+    block->used += size;
+    arena->allocs++;
+    arena->bytes += size;
+    arena_stats.allocs++;
+    arena_stats.bytes += size;
+    return mem;
+}
+
+
+/*
+** Copies the first len bytes of str into the arena, NUL terminated.
+** If arena is NULL the copy is made on the heap instead.
+*/
+char *arena_strndup(Arena *arena, const char *str, size_t len){
+    char *copy = arena ? arena_alloc(arena, len + 1) : malloc(len + 1);
+    if (copy == NULL){
+        if (arena == NULL) perror("malloc");
+        return NULL;
+    }
+    memcpy(copy, str, len);
+    copy[len] = '\0';
+    return copy;
+}
+
+
+char *arena_strdup(Arena *arena, const char *str){
+    return arena_strndup(arena, str, strlen(str));
+}
+
+
+/*
+** Releases every allocation at once, keeping a single block that is
+** large enough to hold everything the arena has needed so far.
+*/
+void arena_reset(Arena *arena){
+    ArenaBlock *block = arena->head;
+    if (block == NULL) return;
+
+    if (block->next != NULL){
+        arena_free(arena);
+        block = arena_new_block(arena->total_cap);
+        if (block == NULL) return;
+        arena->head = block;
+        arena->total_cap = block->cap;
+    }
+    block->used = 0;
+}
+
+
+void arena_free(Arena *arena){
+    ArenaBlock *block = arena->head;
+    size_t total_cap = arena->total_cap;
+    while (block != NULL){
+        ArenaBlock *next = block->next;
+        free(block);
+        block = next;
+    }
+    arena->head = NULL;
+    // remembered so a following reset can size its single block
+    arena->total_cap = total_cap;
+}
@@ -0,0 +1,63 @@
+#include "cscshell.h"
+#include <time.h>
+
+/*
+** Lexer and expansion throughput on long lines.
+**
+** Builds a command line of many long file-name arguments (the shape of
+** our generated scripts) and measures lex_line() and word expansion via
+** replace_variables_mk_line() over it. Run with CSCSHELL_SCAN=scalar or
+** CSCSHELL_SCAN=sse2 to compare against the vectorized default.
+*/
+
+#define BENCH_ITERS 20000
+#define LINE_ARGS 200
+
+static double now_ns(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+
+int main(void){
+    static char line[LINE_ARGS * 64];
+    static char work[LINE_ARGS * 64];
+    size_t len = snprintf(line, sizeof(line), "cat");
+    for (int i = 0; i < LINE_ARGS; i++){
+        len += snprintf(line + len, sizeof(line) - len,
+                        " /var/log/build/output/artifact_%06d_part.log", i);
+    }
+    len += snprintf(line + len, sizeof(line) - len, " > $OUT");
+
+    VarTable variables;
+    var_table_init(&variables);
+    var_set(&variables, "OUT", 3, "result.txt");
+    Arena arena;
+    arena_init(&arena);
+
+    double start = now_ns();
+    for (int i = 0; i < BENCH_ITERS; i++){
+        Token *tokens;
+        memcpy(work, line, len + 1);
+        if (lex_line(work, &arena, &tokens) != LINE_ARGS + 3) return 1;
+        arena_reset(&arena);
+    }
+    double lex_ns = (now_ns() - start) / BENCH_ITERS;
+
+    start = now_ns();
+    for (int i = 0; i < BENCH_ITERS; i++){
+        char *expanded = replace_variables_mk_line(line, &variables, &arena);
+        if (expanded == NULL || expanded == (char *) -1) return 1;
+        arena_reset(&arena);
+    }
+    double expand_ns = (now_ns() - start) / BENCH_ITERS;
+
+    printf("line_bytes\tlex_ns\tlex_MB/s\texpand_ns\texpand_MB/s\n");
+    printf("%zu\t%.0f\t%.0f\t%.0f\t%.0f\n", len, lex_ns, len * 1e3 / lex_ns,
+           expand_ns, len * 1e3 / expand_ns);
+
+    arena_free(&arena);
+    var_table_free(&variables);
+    return 0;
+}
@@ -0,0 +1,294 @@
+#include "cscshell.h"
+#include <time.h>
+#include <ftw.h>
+
+/*
+** Microbenchmarks of the line-building hot paths, one row per operation:
+**
+**   lex_line                     splitting a line into tokens
+**   build_commands               lexing, expanding and resolving a line
+**   parse_line                   the same through the line cache
+**   replace_variables_mk_line    expanding a line's variable usages
+**   handle_variable_assignment   an assignment with an expanded value
+**   resolve_hit                  resolve_executable from the hash table
+**   resolve_index                ... from the mmap'd exec index
+**   resolve_scan                 ... by reading every PATH directory
+**                                (given relative, which can't be indexed)
+**   run_command_spawn            starting /bin/true (to its wait) with
+**   run_command_fork             posix_spawn and fork + exec
+**
+** PATH is a synthetic one of BENCH_PATH_DIRS directories (default 32) of
+** BENCH_PATH_FILES executables each (default 256), taken from the
+** environment, with the command looked up only in the last directory.
+**
+** Each operation is timed in batches; ns_op is the mean over all of
+** them and the percentiles are of the per-batch means. allocs_op and
+** bytes_op are the arena allocations made per operation. Output is
+** tab-separated with a header line, so two builds can be compared by
+** joining their outputs on the op column.
+*/
+
+#define BENCH_SAMPLES 1000
+#define BENCH_CMD "benchtool"
+
+typedef struct BenchOp {
+    const char *name;
+    int (*run)(void);
+    int batch;
+    int samples;
+} BenchOp;
+
+static VarTable variables;
+static Arena arena;
+static char path_root[] = "/tmp/cscbench-XXXXXX";
+static char cache_home[MAX_PATH_STR];
+static char *relative_path = NULL;
+
+static const char line[] =
+    BENCH_CMD " -o $OUT/result_$NAME.txt --level=${LEVEL} input.txt";
+static char work[sizeof(line)];
+
+static double now_ns(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+
+static int cmp_double(const void *a, const void *b){
+    double x = *(const double *) a;
+    double y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+
+static long env_long(const char *name, long fallback){
+    const char *value = getenv(name);
+    long n = value != NULL ? strtol(value, NULL, 10) : 0;
+    return n > 0 ? n : fallback;
+}
+
+
+static int op_lex_line(void){
+    Token *tokens;
+    memcpy(work, line, sizeof(line));
+    int count = lex_line(work, &arena, &tokens);
+    arena_reset(&arena);
+    return count > 0 ? 0 : -1;
+}
+
+
+static int op_build_commands(void){
+    uint8_t assigned = 0;
+    memcpy(work, line, sizeof(line));
+    Command *command = build_commands(work, &variables, &arena, NULL,
+                                      &assigned);
+    arena_reset(&arena);
+    return command != NULL && command != (Command *) -1 ? 0 : -1;
+}
+
+
+static int op_parse_line(void){
+    memcpy(work, line, sizeof(line));
+    Command *command = parse_line(work, &variables, &arena);
+    if (command == NULL || command == (Command *) -1) return -1;
+    free_command(command);
+    arena_reset(&arena);
+    return 0;
+}
+
+
+static int op_replace_variables(void){
+    char *expanded = replace_variables_mk_line(line, &variables, &arena);
+    arena_reset(&arena);
+    return expanded != NULL && expanded != (char *) -1 ? 0 : -1;
+}
+
+
+static int op_assignment(void){
+    int ret = handle_variable_assignment("DEST=$OUT/result_$NAME.txt",
+                                         &variables, &arena);
+    arena_reset(&arena);
+    return ret == 0 ? 0 : -1;
+}
+
+
+static int resolve(void){
+    char *exec_path = resolve_executable(BENCH_CMD, variables.path, &arena);
+    arena_reset(&arena);
+    return exec_path != NULL ? 0 : -1;
+}
+
+
+static int op_resolve_miss(void){
+    exec_cache_flush();
+    return resolve();
+}
+
+
+static int run_true(SpawnMode mode){
+    char *args[] = {"/bin/true", NULL};
+    Command command = {
+        .exec_path = "/bin/true",
+        .args = args,
+        .next = NULL,
+        .stdin_fd = STDIN_FILENO,
+        .stdout_fd = STDOUT_FILENO,
+    };
+    shell_options.spawn_mode = mode;
+    pid_t pid = run_command(&command);
+    return pid >= 0 && waitpid(pid, NULL, 0) == pid ? 0 : -1;
+}
+
+static int op_spawn(void){
+    return run_true(SPAWN_POSIX);
+}
+
+static int op_fork(void){
+    return run_true(SPAWN_FORK);
+}
+
+
+/*
+** Times op and prints its row. Returns 0, or -1 if an operation failed.
+*/
+static int bench_op(const BenchOp *op){
+    static double samples[BENCH_SAMPLES];
+
+    // the first run warms whichever cache the operation goes through
+    if (op->run() < 0) return -1;
+
+    ArenaStats before = arena_stats;
+    double total = 0;
+    for (int s = 0; s < op->samples; s++){
+        double start = now_ns();
+        for (int i = 0; i < op->batch; i++){
+            if (op->run() < 0) return -1;
+        }
+        samples[s] = (now_ns() - start) / op->batch;
+        total += samples[s];
+    }
+
+    double ops = (double) op->samples * op->batch;
+    qsort(samples, op->samples, sizeof(double), cmp_double);
+    printf("%s\t%.0f\t%.1f\t%.2f\t%.1f\t%.1f\t%.1f\t%.1f\n", op->name, ops,
+           total / op->samples, (arena_stats.allocs - before.allocs) / ops,
+           (arena_stats.bytes - before.bytes) / ops,
+           samples[op->samples / 2], samples[op->samples * 9 / 10],
+           samples[op->samples * 99 / 100]);
+    fflush(stdout);
+    return 0;
+}
+
+
+/*
+** Creates dirs directories of files executables each under path_root,
+** with BENCH_CMD in the last, and sets PATH to them. The same PATH
+** relative to path_root is kept in relative_path.
+*/
+static int make_path(long dirs, long files){
+    if (mkdtemp(path_root) == NULL) return -1;
+
+    size_t cap = dirs * (strlen(path_root) + 16) + 1;
+    char *path = malloc(cap);
+    relative_path = malloc(cap);
+    if (path == NULL || relative_path == NULL) return -1;
+    size_t len = 0;
+    size_t relative_len = 0;
+    path[0] = '\0';
+
+    char name[MAX_PATH_STR];
+    for (long d = 0; d < dirs; d++){
+        snprintf(name, sizeof(name), "%s/d%ld", path_root, d);
+        if (mkdir(name, 0755) < 0) return -1;
+        len += snprintf(path + len, cap - len, "%s%s", d ? ":" : "", name);
+        relative_len += snprintf(relative_path + relative_len,
+                                 cap - relative_len, "%sd%ld", d ? ":" : "", d);
+
+        for (long f = 0; f <= files; f++){
+            if (f == files && d != dirs - 1) break;
+            if (f == files){
+                snprintf(name, sizeof(name), "%s/d%ld/" BENCH_CMD, path_root, d);
+            }
+            else {
+                snprintf(name, sizeof(name), "%s/d%ld/tool%ld", path_root, d, f);
+            }
+            int fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0755);
+            if (fd < 0) return -1;
+            close(fd);
+        }
+    }
+    Variable *var = var_set(&variables, PATH_VAR_NAME, strlen(PATH_VAR_NAME),
+                            path);
+    free(path);
+    return var != NULL ? 0 : -1;
+}
+
+
+static int remove_entry(const char *file_path, const struct stat *st,
+                        int flag, struct FTW *ftw){
+    (void) st;
+    (void) flag;
+    (void) ftw;
+    return remove(file_path);
+}
+
+
+int main(void){
+    long dirs = env_long("BENCH_PATH_DIRS", 32);
+    long files = env_long("BENCH_PATH_FILES", 256);
+
+    var_table_init(&variables);
+    arena_init(&arena);
+    var_set(&variables, "OUT", 3, "/var/tmp/bench");
+    var_set(&variables, "NAME", 4, "nightly");
+    var_set(&variables, "LEVEL", 5, "3");
+    if (make_path(dirs, files) < 0){
+        perror("bench_micro");
+        return 1;
+    }
+
+    // keep the exec index this run builds out of the real cache
+    snprintf(cache_home, sizeof(cache_home), "%s/cache", path_root);
+    setenv("XDG_CACHE_HOME", cache_home, 1);
+
+    static const BenchOp ops[] = {
+        {"lex_line", op_lex_line, 1000, BENCH_SAMPLES},
+        {"build_commands", op_build_commands, 1000, BENCH_SAMPLES},
+        {"parse_line", op_parse_line, 1000, BENCH_SAMPLES},
+        {"replace_variables_mk_line", op_replace_variables, 1000, BENCH_SAMPLES},
+        {"handle_variable_assignment", op_assignment, 1000, BENCH_SAMPLES},
+        {"resolve_hit", resolve, 1000, BENCH_SAMPLES},
+        {"resolve_index", op_resolve_miss, 100, BENCH_SAMPLES},
+    };
+    static const BenchOp scan = {"resolve_scan", op_resolve_miss, 1, 200};
+    static const BenchOp spawns[] = {
+        {"run_command_spawn", op_spawn, 1, 500},
+        {"run_command_fork", op_fork, 1, 500},
+    };
+
+    printf("# PATH: %ld dirs x %ld files\n", dirs, files);
+    printf("op\titers\tns_op\tallocs_op\tbytes_op\tp50_ns\tp90_ns\tp99_ns\n");
+    int ret = 0;
+    for (size_t i = 0; ret == 0 && i < sizeof(ops) / sizeof(ops[0]); i++){
+        ret = bench_op(&ops[i]);
+    }
+
+    // relative PATH entries can't be indexed, so every directory is read
+    if (ret == 0){
+        ret = chdir(path_root) == 0 &&
+            var_set(&variables, PATH_VAR_NAME, strlen(PATH_VAR_NAME),
+                    relative_path) != NULL ? bench_op(&scan) : -1;
+    }
+    for (size_t i = 0; ret == 0 && i < sizeof(spawns) / sizeof(spawns[0]); i++){
+        ret = bench_op(&spawns[i]);
+    }
+    if (ret < 0) perror("bench_micro");
+
+    exec_index_close();
+    free(relative_path);
+    nftw(path_root, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+    arena_free(&arena);
+    var_table_free(&variables);
+    return ret < 0 ? 1 : 0;
+}
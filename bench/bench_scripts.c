@@ -0,0 +1,421 @@
+#include "cscshell.h"
+#include <time.h>
+#include <ftw.h>
+#include <signal.h>
+#include <limits.h>
+#include <sys/ptrace.h>
+
+/*
+** End-to-end script throughput, against the reference shells.
+**
+** Generates a corpus of scripts in a scratch directory and runs each one
+** under every shell given on the command line (by default ./cscshell and
+** whichever of /bin/dash and /bin/bash exist):
+**
+**   simple        thousands of builtin commands (echo)
+**   external      hundreds of external commands (cat)
+**   pipelines     six-stage pipelines
+**   expansion     assignments and words built from many ${NAME}s
+**   redirections  >, >> and < on a rotating set of files
+**   bigpath       commands found in the last of 200 PATH directories
+**
+** Each script is run once to warm up (cscshell compiles it into its
+** cache then) and then RUNS times (-n, default 5). The row reports the
+** median wall time and the commands per second it gives, a command being
+** an assignment or one stage of a pipeline; the peak RSS of the shell
+** and its children (from wait4); and, unless -S is given, the syscalls
+** made by the shell process itself and by the whole tree, counted in one
+** further run under ptrace. Output is tab-separated with a header line.
+**
+** usage: bench_scripts [-n RUNS] [-S] [SHELL...]
+*/
+
+#define DEFAULT_RUNS 5
+#define MAX_RUNS 101
+#define MAX_SHELLS 16
+#define MAX_TRACED 1024
+
+#define SIMPLE_LINES 3000
+#define EXTERNAL_LINES 500
+#define PIPELINE_LINES 200
+#define PIPELINE_STAGES 6
+#define EXPANSION_LINES 1000
+#define REDIRECTION_LINES 1000
+#define BIGPATH_DIRS 200
+#define BIGPATH_FILES 100
+#define BIGPATH_TOOLS 20
+#define BIGPATH_LINES 500
+
+typedef struct Workload {
+    const char *name;
+    long commands;
+} Workload;
+
+typedef struct RunResult {
+    double wall_ms;
+    long maxrss_kb;
+} RunResult;
+
+static char work_dir[] = "/tmp/cscscripts-XXXXXX";
+
+static double now_ms(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+
+static int cmp_double(const void *a, const void *b){
+    double x = *(const double *) a;
+    double y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+
+// variable names may not contain digits, so spell the index in letters
+static void mk_name(char *buf, size_t buflen, long i){
+    snprintf(buf, buflen, "V_%ld", i);
+    for (char *p = buf + 2; *p; p++) *p = 'a' + (*p - '0');
+}
+
+
+static FILE *open_script(const char *name){
+    FILE *script = fopen(name, "w");
+    if (script == NULL) perror(name);
+    return script;
+}
+
+
+/*
+** Writes every workload's script (and the files they read) into the
+** current directory, filling in the commands each one runs. Returns 0,
+** or -1 on error.
+*/
+static int make_corpus(Workload *workloads){
+    FILE *f;
+    char name[64];
+
+    if ((f = open_script("data.txt")) == NULL) return -1;
+    for (int i = 0; i < 2000; i++){
+        fprintf(f, "host%d.example.com GET /api/v1/items/%d %d\n", i % 37,
+                i % 113, 200 + (i % 5) * 100);
+    }
+    fclose(f);
+    if ((f = open_script("small.txt")) == NULL) return -1;
+    fprintf(f, "one line of input\n");
+    fclose(f);
+    if ((f = open_script("init")) == NULL) return -1;
+    fprintf(f, "PATH=/usr/local/bin:/usr/bin:/bin\n");
+    fclose(f);
+
+    if ((f = open_script("simple.sh")) == NULL) return -1;
+    for (int i = 0; i < SIMPLE_LINES; i++){
+        fprintf(f, "echo step %d of the build\n", i);
+    }
+    fclose(f);
+    workloads[0] = (Workload) {"simple", SIMPLE_LINES};
+
+    if ((f = open_script("external.sh")) == NULL) return -1;
+    for (int i = 0; i < EXTERNAL_LINES; i++){
+        fprintf(f, "cat small.txt\n");
+    }
+    fclose(f);
+    workloads[1] = (Workload) {"external", EXTERNAL_LINES};
+
+    if ((f = open_script("pipelines.sh")) == NULL) return -1;
+    for (int i = 0; i < PIPELINE_LINES; i++){
+        fprintf(f, "cat data.txt | sort | uniq -c | sort -rn | tail -n 3 | "
+                "wc -l\n");
+    }
+    fclose(f);
+    workloads[2] = (Workload) {"pipelines", PIPELINE_LINES * PIPELINE_STAGES};
+
+    if ((f = open_script("expansion.sh")) == NULL) return -1;
+    fprintf(f, "ROOT=/srv/builds\nPROJ=cscshell\nBRANCH=main\n");
+    for (int i = 0; i < EXPANSION_LINES; i++){
+        mk_name(name, sizeof(name), i % 50);
+        fprintf(f, "%s=${ROOT}/${PROJ}/${BRANCH}/artifact_%d.log\n", name, i);
+        fprintf(f, "echo ${%s} ${ROOT}/${PROJ} ${BRANCH}-${PROJ}-${%s}\n",
+                name, name);
+    }
+    fclose(f);
+    workloads[3] = (Workload) {"expansion", 3 + 2 * EXPANSION_LINES};
+
+    if ((f = open_script("redirections.sh")) == NULL) return -1;
+    for (int i = 0; i < REDIRECTION_LINES; i++){
+        switch (i % 3){
+        case 0:
+            fprintf(f, "echo line %d > out_%d.txt\n", i, i % 10);
+            break;
+        case 1:
+            fprintf(f, "echo line %d >> log.txt\n", i);
+            break;
+        default:
+            fprintf(f, "cat < small.txt > copy_%d.txt\n", i % 10);
+        }
+    }
+    fclose(f);
+    workloads[4] = (Workload) {"redirections", REDIRECTION_LINES};
+
+    // BIGPATH_DIRS directories of BIGPATH_FILES entries; the tools the
+    // script runs are only in the last one
+    if (mkdir("path", 0755) < 0) return -1;
+    if ((f = open_script("bigpath.sh")) == NULL) return -1;
+    fprintf(f, "PATH=");
+    for (int d = 0; d < BIGPATH_DIRS; d++){
+        char dir[PATH_MAX];
+        snprintf(dir, sizeof(dir), "%s/path/d%d", work_dir, d);
+        fprintf(f, "%s%s", d ? ":" : "", dir);
+        if (mkdir(dir, 0755) < 0){
+            perror(dir);
+            fclose(f);
+            return -1;
+        }
+        for (int i = 0; i < BIGPATH_FILES; i++){
+            char entry[PATH_MAX + 32];
+            if (d == BIGPATH_DIRS - 1 && i < BIGPATH_TOOLS){
+                snprintf(entry, sizeof(entry), "%s/tool%d", dir, i);
+                if (symlink("/bin/true", entry) < 0) return -1;
+                continue;
+            }
+            snprintf(entry, sizeof(entry), "%s/other%d", dir, i);
+            int fd = open(entry, O_WRONLY | O_CREAT | O_TRUNC, 0755);
+            if (fd < 0) return -1;
+            close(fd);
+        }
+    }
+    fprintf(f, "\n");
+    for (int i = 0; i < BIGPATH_LINES; i++){
+        fprintf(f, "tool%d --input data.txt --seed %d\n", i % BIGPATH_TOOLS, i);
+    }
+    fclose(f);
+    workloads[5] = (Workload) {"bigpath", 1 + BIGPATH_LINES};
+    return 0;
+}
+
+
+static int is_cscshell(const char *shell){
+    const char *base = strrchr(shell, '/');
+    return strstr(base ? base + 1 : shell, "cscshell") != NULL;
+}
+
+
+// Runs in the child: execs shell on script with stdio on /dev/null
+static void exec_shell(const char *shell, const char *script){
+    int null = open("/dev/null", O_RDWR);
+    if (null >= 0){
+        dup2(null, STDIN_FILENO);
+        dup2(null, STDOUT_FILENO);
+        close(null);
+    }
+    if (is_cscshell(shell)){
+        execl(shell, shell, "-i", "init", script, (char *) NULL);
+    }
+    else {
+        execl(shell, shell, script, (char *) NULL);
+    }
+    perror(shell);
+    _exit(127);
+}
+
+
+/*
+** Runs shell on script once. Returns 0 with the result filled in, or -1
+** if it could not be run or failed.
+*/
+static int run_once(const char *shell, const char *script, RunResult *result){
+    double start = now_ms();
+    pid_t pid = fork();
+    if (pid < 0){
+        perror("fork");
+        return -1;
+    }
+    if (pid == 0) exec_shell(shell, script);
+
+    int status;
+    struct rusage usage;
+    if (wait4(pid, &status, 0, &usage) < 0){
+        perror("wait4");
+        return -1;
+    }
+    result->wall_ms = now_ms() - start;
+    result->maxrss_kb = usage.ru_maxrss;
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0 ? 0 : -1;
+}
+
+
+/*
+** Runs shell on script under ptrace, counting the syscalls of the shell
+** process (into *own) and of every process it starts (into *total).
+** Returns 0, or -1 if the run could not be traced or failed.
+*/
+static int count_syscalls(const char *shell, const char *script, long *own,
+                          long *total){
+    pid_t pid = fork();
+    if (pid < 0) return -1;
+    if (pid == 0){
+        if (ptrace(PTRACE_TRACEME, 0, NULL, NULL) < 0) _exit(127);
+        raise(SIGSTOP);
+        exec_shell(shell, script);
+    }
+
+    int status;
+    if (waitpid(pid, &status, 0) < 0 || !WIFSTOPPED(status)) return -1;
+    ptrace(PTRACE_SETOPTIONS, pid, NULL, PTRACE_O_TRACESYSGOOD |
+           PTRACE_O_TRACEFORK | PTRACE_O_TRACEVFORK | PTRACE_O_TRACECLONE |
+           PTRACE_O_EXITKILL);
+    ptrace(PTRACE_SYSCALL, pid, NULL, NULL);
+
+    // every traced process, and whether it is inside a syscall
+    static pid_t traced[MAX_TRACED];
+    static uint8_t in_syscall[MAX_TRACED];
+    int ntraced = 1;
+    traced[0] = pid;
+    in_syscall[0] = 0;
+    *own = 0;
+    *total = 0;
+    int root_status = -1;
+
+    pid_t w;
+    while ((w = waitpid(-1, &status, __WALL)) > 0){
+        if (WIFEXITED(status) || WIFSIGNALED(status)){
+            if (w == pid) root_status = status;
+            continue;
+        }
+        int i = 0;
+        while (i < ntraced && traced[i] != w) i++;
+        int sig = WSTOPSIG(status);
+        if (i == ntraced){
+            // a new child, stopped before its first instruction
+            if (ntraced < MAX_TRACED){
+                traced[ntraced] = w;
+                in_syscall[ntraced++] = 0;
+            }
+            sig = 0;
+        }
+        else if (sig == (SIGTRAP | 0x80)){
+            in_syscall[i] = !in_syscall[i];
+            if (in_syscall[i]){
+                (*total)++;
+                if (w == pid) (*own)++;
+            }
+            sig = 0;
+        }
+        else if (sig == SIGTRAP || status >> 16 != 0){
+            // exec and fork events
+            sig = 0;
+        }
+        ptrace(PTRACE_SYSCALL, w, NULL, (void *) (intptr_t) sig);
+    }
+    return root_status >= 0 && WIFEXITED(root_status) &&
+        WEXITSTATUS(root_status) == 0 ? 0 : -1;
+}
+
+
+static void bench_script(const Workload *workload, const char *shell,
+                         int runs, int syscalls){
+    char script[64];
+    static double walls[MAX_RUNS];
+    RunResult result;
+    long maxrss = 0;
+    snprintf(script, sizeof(script), "%s.sh", workload->name);
+
+    int ok = run_once(shell, script, &result) == 0;
+    for (int i = 0; ok && i < runs; i++){
+        ok = run_once(shell, script, &result) == 0;
+        walls[i] = result.wall_ms;
+        if (result.maxrss_kb > maxrss) maxrss = result.maxrss_kb;
+    }
+    if (!ok){
+        printf("%s\t%s\tFAILED\n", workload->name, shell);
+        return;
+    }
+    qsort(walls, runs, sizeof(double), cmp_double);
+    double wall = walls[runs / 2];
+    printf("%s\t%s\t%ld\t%.1f\t%.0f\t%ld", workload->name, shell,
+           workload->commands, wall, workload->commands / (wall / 1e3),
+           maxrss);
+
+    long own, total;
+    if (syscalls && count_syscalls(shell, script, &own, &total) == 0){
+        printf("\t%ld\t%ld\n", own, total);
+    }
+    else {
+        printf("\t-\t-\n");
+    }
+    fflush(stdout);
+}
+
+
+static int remove_entry(const char *file_path, const struct stat *st,
+                        int flag, struct FTW *ftw){
+    (void) st;
+    (void) flag;
+    (void) ftw;
+    return remove(file_path);
+}
+
+
+int main(int argc, char *argv[]){
+    int runs = DEFAULT_RUNS;
+    int syscalls = 1;
+    static char shells[MAX_SHELLS][PATH_MAX];
+    int nshells = 0;
+
+    for (int i = 1; i < argc; i++){
+        if (strcmp(argv[i], "-n") == 0 && i + 1 < argc){
+            runs = atoi(argv[++i]);
+            if (runs < 1 || runs > MAX_RUNS){
+                fprintf(stderr, "bench_scripts: runs must be 1..%d\n", MAX_RUNS);
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "-S") == 0){
+            syscalls = 0;
+        }
+        else if (nshells < MAX_SHELLS){
+            // shells are run from the scratch directory
+            if (realpath(argv[i], shells[nshells]) == NULL){
+                perror(argv[i]);
+                return 1;
+            }
+            nshells++;
+        }
+    }
+    if (nshells == 0){
+        const char *defaults[] = {"./cscshell", "/bin/dash", "/bin/bash"};
+        for (size_t i = 0; i < sizeof(defaults) / sizeof(defaults[0]); i++){
+            if (access(defaults[i], X_OK) == 0 &&
+                realpath(defaults[i], shells[nshells]) != NULL){
+                nshells++;
+            }
+        }
+    }
+
+    if (mkdtemp(work_dir) == NULL || chdir(work_dir) < 0){
+        perror(work_dir);
+        return 1;
+    }
+    // cscshell's caches (compiled scripts, exec index) go in here too
+    char cache[PATH_MAX];
+    snprintf(cache, sizeof(cache), "%s/cache", work_dir);
+    setenv("XDG_CACHE_HOME", cache, 1);
+
+    Workload workloads[6];
+    int ret = 0;
+    if (make_corpus(workloads) < 0){
+        ret = 1;
+    }
+    else {
+        printf("workload\tshell\tcommands\twall_ms\tcommands_per_s\t"
+               "maxrss_kb\tshell_syscalls\ttotal_syscalls\n");
+        for (size_t w = 0; w < sizeof(workloads) / sizeof(workloads[0]); w++){
+            for (int s = 0; s < nshells; s++){
+                bench_script(&workloads[w], shells[s], runs, syscalls);
+            }
+        }
+    }
+
+    nftw(work_dir, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+    return ret;
+}
@@ -0,0 +1,84 @@
+#include "cscshell.h"
+#include <time.h>
+#include <sys/mman.h>
+
+/*
+** Spawn latency benchmark.
+**
+** Measures run_command() starting /bin/true (through to its waitpid) with
+** the posix_spawn and fork backends, first from a small process and then
+** after touching a large heap. fork has to copy the page tables of the
+** whole address space, so its cost grows with the shell's RSS while
+** posix_spawn's should not.
+*/
+
+#define BENCH_ITERS 2000
+#define BALLAST_BYTES (256UL * 1024 * 1024)
+
+static double now_ns(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+
+static int cmp_double(const void *a, const void *b){
+    double x = *(const double *) a;
+    double y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+
+static int bench_mode(SpawnMode mode, const char *label, const char *rss){
+    static double samples[BENCH_ITERS];
+    char *args[] = {"/bin/true", NULL};
+    Command command = {
+        .exec_path = "/bin/true",
+        .args = args,
+        .next = NULL,
+        .stdin_fd = STDIN_FILENO,
+        .stdout_fd = STDOUT_FILENO,
+    };
+
+    shell_options.spawn_mode = mode;
+    double total = 0;
+    for (int i = 0; i < BENCH_ITERS; i++){
+        double start = now_ns();
+        pid_t pid = run_command(&command);
+        if (pid < 0 || waitpid(pid, NULL, 0) < 0) return -1;
+        samples[i] = now_ns() - start;
+        total += samples[i];
+    }
+
+    qsort(samples, BENCH_ITERS, sizeof(double), cmp_double);
+    printf("%s\t%s\t%.1f\t%.1f\t%.1f\n", label, rss,
+           total / BENCH_ITERS / 1e3, samples[BENCH_ITERS / 2] / 1e3,
+           samples[BENCH_ITERS * 99 / 100] / 1e3);
+    return 0;
+}
+
+
+int main(void){
+    printf("backend\trss\tmean_us\tp50_us\tp99_us\n");
+    if (bench_mode(SPAWN_POSIX, "spawn", "small") < 0 ||
+        bench_mode(SPAWN_FORK, "fork", "small") < 0){
+        perror("bench_spawn");
+        return 1;
+    }
+
+    char *ballast = mmap(NULL, BALLAST_BYTES, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ballast == MAP_FAILED){
+        perror("mmap");
+        return 1;
+    }
+    memset(ballast, 1, BALLAST_BYTES);
+
+    if (bench_mode(SPAWN_POSIX, "spawn", "256M") < 0 ||
+        bench_mode(SPAWN_FORK, "fork", "256M") < 0){
+        perror("bench_spawn");
+        return 1;
+    }
+    munmap(ballast, BALLAST_BYTES);
+    return 0;
+}
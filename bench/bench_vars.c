@@ -0,0 +1,67 @@
+#include "cscshell.h"
+#include <time.h>
+
+/*
+** Variable expansion benchmark.
+**
+** Measures replace_variables_mk_line() on a token that uses three
+** variables, against tables holding an increasing number of variables.
+** With the hashed variable store the cost per expansion should stay flat
+** as the table grows.
+*/
+
+#define BENCH_ITERS 200000
+
+static double now_ns(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+
+// variable names may not contain digits, so spell the index in letters
+static int mk_name(char *buf, size_t buflen, size_t i){
+    int len = snprintf(buf, buflen, "V_%zu", i);
+    for (char *p = buf + 2; *p; p++) *p = 'a' + (*p - '0');
+    return len;
+}
+
+
+int main(void){
+    static const size_t counts[] = {1, 10, 100, 1000, 10000, 100000};
+    char name[32];
+    char mid[32];
+    char last[32];
+    char line[128];
+    Arena arena;
+    arena_init(&arena);
+
+    printf("variables\tns/expansion\n");
+    for (size_t c = 0; c < sizeof(counts) / sizeof(counts[0]); c++){
+        VarTable variables;
+        var_table_init(&variables);
+        for (size_t i = 0; i < counts[c]; i++){
+            var_set(&variables, name, mk_name(name, sizeof(name), i),
+                    "value");
+        }
+
+        // first, middle and last assigned variables
+        mk_name(mid, sizeof(mid), counts[c] / 2);
+        mk_name(last, sizeof(last), counts[c] - 1);
+        snprintf(line, sizeof(line), "$V_a/${%s}-$%s.txt", mid, last);
+
+        double start = now_ns();
+        for (int i = 0; i < BENCH_ITERS; i++){
+            char *expanded = replace_variables_mk_line(line, &variables,
+                                                       &arena);
+            if (expanded == NULL || expanded == (char *) -1) return 1;
+            arena_reset(&arena);
+        }
+        double elapsed = now_ns() - start;
+
+        printf("%zu\t%.1f\n", counts[c], elapsed / BENCH_ITERS);
+        var_table_free(&variables);
+    }
+    arena_free(&arena);
+    return 0;
+}
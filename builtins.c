@@ -0,0 +1,554 @@
+#include "cscshell.h"
+#include <ctype.h>
+
+/*
+** In-process builtin commands.
+**
+** build_commands looks every command word up in the table below before
+** searching PATH, and marks the Command with the builtin it found. A
+** builtin that is the whole line runs right here in the shell, with its
+** redirections swapped onto stdin/stdout for the duration of the call;
+** one that is a stage of a pipeline runs in a forked child with the same
+** descriptors an external command would get (see builtin_fork), so it
+** can't change the shell's own state.
+**
+** Builtins return their exit status: 0 for success, non-zero otherwise.
+*/
+
+// Set in a child of the shell (builtin_fork's, or a substitution's),
+// which must never run the shell's atexit handlers (--stats, --trace) as
+// if it were the shell
+static uint8_t in_stage = 0;
+
+static int builtin_cd(char **args, VarTable *variables){
+    (void) variables;
+    return cd_cscshell(args[1]);
+}
+
+
+static int builtin_hash(char **args, VarTable *variables){
+    (void) variables;
+    return hash_cscshell(args);
+}
+
+
+static int builtin_stats(char **args, VarTable *variables){
+    (void) variables;
+    return stats_cscshell(args);
+}
+
+
+// The options `set -o NAME` turns on and `set +o NAME` off
+static const struct {
+    const char *name;
+    uint8_t *value;
+} set_options[] = {
+    {"pipefail", &shell_options.pipefail},
+    {"failfast", &shell_options.failfast},
+};
+
+
+/*
+** set             lists the variables (see set_cscshell)
+** set -o          lists the options and whether each is on
+** set -o|+o NAME  turns an option on or off
+*/
+static int builtin_set(char **args, VarTable *variables){
+    if (args[1] == NULL){
+        return set_cscshell(variables);
+    }
+    size_t noptions = sizeof(set_options) / sizeof(set_options[0]);
+    if ((strcmp(args[1], "-o") != 0 && strcmp(args[1], "+o") != 0) ||
+        (args[2] != NULL && args[3] != NULL)){
+        ERR_PRINT(ERR_SET_USAGE);
+        return 2;
+    }
+
+    if (args[2] == NULL){
+        for (size_t i = 0; i < noptions; i++){
+            printf("%-12s%s\n", set_options[i].name,
+                   *set_options[i].value ? "on" : "off");
+        }
+        fflush(stdout);
+        return 0;
+    }
+    for (size_t i = 0; i < noptions; i++){
+        if (strcmp(args[2], set_options[i].name) == 0){
+            *set_options[i].value = args[1][0] == '-';
+            return 0;
+        }
+    }
+    ERR_PRINT(ERR_SET_OPTION, args[2]);
+    return 2;
+}
+
+
+static int builtin_jobs(char **args, VarTable *variables){
+    (void) variables;
+    return jobs_cscshell(args);
+}
+
+
+static int builtin_wait(char **args, VarTable *variables){
+    (void) variables;
+    return wait_cscshell(args);
+}
+
+
+static int builtin_parallel(char **args, VarTable *variables){
+    return parallel_cscshell(args, variables);
+}
+
+
+static int builtin_true(char **args, VarTable *variables){
+    (void) args;
+    (void) variables;
+    return 0;
+}
+
+
+static int builtin_false(char **args, VarTable *variables){
+    (void) args;
+    (void) variables;
+    return 1;
+}
+
+
+/*
+** echo [-n] [ARG]...
+*/
+static int builtin_echo(char **args, VarTable *variables){
+    (void) variables;
+    int newline = 1;
+    int i = 1;
+    if (args[1] != NULL && strcmp(args[1], "-n") == 0){
+        newline = 0;
+        i++;
+    }
+    for (int first = i; args[i] != NULL; i++){
+        if (i > first) putchar(' ');
+        fputs(args[i], stdout);
+    }
+    if (newline) putchar('\n');
+    return 0;
+}
+
+
+static int builtin_pwd(char **args, VarTable *variables){
+    (void) args;
+    (void) variables;
+    char cwd[MAX_PATH_STR];
+    if (getcwd(cwd, sizeof(cwd)) == NULL){
+        perror("pwd");
+        return 1;
+    }
+    puts(cwd);
+    return 0;
+}
+
+
+/*
+** exit [N]: leaves the shell (or, in a pipeline, just its own stage)
+** with status N, 0 by default. A resident server (--serve) stays up: exit
+** only ends the request, with status N.
+*/
+static int builtin_exit(char **args, VarTable *variables){
+    (void) variables;
+    int code = 0;
+    if (args[1] != NULL){
+        char *end;
+        code = (int) strtol(args[1], &end, 10);
+        if (*end != '\0' || args[2] != NULL){
+            ERR_PRINT(ERR_EXIT_USAGE);
+            return 2;
+        }
+    }
+    fflush(stdout);
+    if (in_stage) _exit(code & 0xff);
+    if (shell_options.serving) return code & 0xff;
+    exit(code & 0xff);
+}
+
+
+/*
+** export [NAME[=VALUE]]...
+**
+** Marks each NAME as exported (assigning VALUE first, if given), so it
+** is passed in the environment of every command started afterwards.
+** Without arguments, lists the exported variables.
+*/
+static int builtin_export(char **args, VarTable *variables){
+    if (args[1] == NULL){
+        for (Variable *var = variables->head; var != NULL; var = var->next){
+            if (var->exported) printf("export %s=%s\n", var->name, var->value);
+        }
+        return 0;
+    }
+
+    int ret = 0;
+    for (int i = 1; args[i] != NULL; i++){
+        const char *equals = strchr(args[i], '=');
+        size_t name_len = equals ? (size_t) (equals - args[i]) : strlen(args[i]);
+
+        int valid = name_len > 0;
+        for (size_t j = 0; j < name_len; j++){
+            if (!isalpha((unsigned char) args[i][j]) && args[i][j] != '_') valid = 0;
+        }
+        if (!valid){
+            ERR_PRINT(ERR_VAR_NAME, args[i]);
+            ret = 1;
+            continue;
+        }
+
+        Variable *var = equals ?
+            var_set(variables, args[i], name_len, equals + 1) :
+            var_lookup(variables, args[i], name_len);
+        if (var == NULL && !equals){
+            // exporting an unset name exports it empty
+            var = var_set(variables, args[i], name_len, "");
+        }
+        if (var == NULL || var_export(var) < 0){
+            ret = 1;
+        }
+    }
+    return ret;
+}
+
+
+/*
+** The `test` primaries, evaluated by argument count as POSIX specifies.
+** Returns 0 (true), 1 (false) or 2 (usage error).
+*/
+static int test_unary(const char *op, const char *arg){
+    struct stat st;
+    if (strcmp(op, "-n") == 0) return arg[0] == '\0';
+    if (strcmp(op, "-z") == 0) return arg[0] != '\0';
+
+    if (op[0] != '-' || op[1] == '\0' || op[2] != '\0' ||
+        strchr("edfrwxs", op[1]) == NULL){
+        ERR_PRINT(ERR_TEST_OPERATOR, op);
+        return 2;
+    }
+    switch (op[1]){
+    case 'r': return access(arg, R_OK) != 0;
+    case 'w': return access(arg, W_OK) != 0;
+    case 'x': return access(arg, X_OK) != 0;
+    }
+    if (stat(arg, &st) < 0) return 1;
+    switch (op[1]){
+    case 'd': return !S_ISDIR(st.st_mode);
+    case 'f': return !S_ISREG(st.st_mode);
+    case 's': return st.st_size == 0;
+    }
+    return 0;
+}
+
+
+static int test_integer(const char *str, long long *out){
+    char *end;
+    errno = 0;
+    *out = strtoll(str, &end, 10);
+    if (end == str || *end != '\0' || errno != 0){
+        ERR_PRINT(ERR_TEST_INTEGER, str);
+        return -1;
+    }
+    return 0;
+}
+
+
+static int test_binary(const char *lhs, const char *op, const char *rhs){
+    if (strcmp(op, "=") == 0) return strcmp(lhs, rhs) != 0;
+    if (strcmp(op, "!=") == 0) return strcmp(lhs, rhs) == 0;
+
+    static const char *ops[] = {"-eq", "-ne", "-lt", "-le", "-gt", "-ge"};
+    size_t which = 0;
+    while (which < 6 && strcmp(op, ops[which]) != 0) which++;
+    if (which == 6){
+        ERR_PRINT(ERR_TEST_OPERATOR, op);
+        return 2;
+    }
+
+    long long a, b;
+    if (test_integer(lhs, &a) < 0 || test_integer(rhs, &b) < 0) return 2;
+    switch (which){
+    case 0: return !(a == b);
+    case 1: return !(a != b);
+    case 2: return !(a < b);
+    case 3: return !(a <= b);
+    case 4: return !(a > b);
+    default: return !(a >= b);
+    }
+}
+
+
+static int test_eval(char **args, int argc){
+    int ret;
+    switch (argc){
+    case 0:
+        return 1;
+    case 1:
+        return args[0][0] == '\0';
+    case 2:
+        if (strcmp(args[0], "!") == 0) return !test_eval(args + 1, 1);
+        return test_unary(args[0], args[1]);
+    case 3:
+        if (strcmp(args[0], "!") == 0){
+            ret = test_eval(args + 1, 2);
+            return ret == 2 ? 2 : !ret;
+        }
+        return test_binary(args[0], args[1], args[2]);
+    case 4:
+        if (strcmp(args[0], "!") == 0){
+            ret = test_eval(args + 1, 3);
+            return ret == 2 ? 2 : !ret;
+        }
+        /* fall through */
+    default:
+        ERR_PRINT(ERR_TEST_ARGS);
+        return 2;
+    }
+}
+
+
+/*
+** test EXPR and [ EXPR ]
+*/
+static int builtin_test(char **args, VarTable *variables){
+    (void) variables;
+    int argc = 0;
+    while (args[argc + 1] != NULL) argc++;
+
+    if (strcmp(args[0], "[") == 0){
+        if (argc == 0 || strcmp(args[argc], "]") != 0){
+            ERR_PRINT(ERR_TEST_BRACKET);
+            return 2;
+        }
+        argc--;
+    }
+    return test_eval(args + 1, argc);
+}
+
+
+/*
+** Writes the backslash escape at *p (just past the backslash) and
+** advances *p past it.
+*/
+static void printf_escape(const char **p){
+    char c = **p;
+    switch (c){
+    case 'n': putchar('\n'); break;
+    case 't': putchar('\t'); break;
+    case 'r': putchar('\r'); break;
+    case 'a': putchar('\a'); break;
+    case '\\': putchar('\\'); break;
+    case '\0': putchar('\\'); return;
+    default: putchar('\\'); putchar(c); break;
+    }
+    (*p)++;
+}
+
+
+/*
+** printf FORMAT [ARG]...
+**
+** Supports the %s, %c, %d, %i, %u, %o, %x and %X conversions with flags,
+** width and precision, and the common backslash escapes. The format is
+** reused until every argument has been consumed.
+*/
+static int builtin_printf(char **args, VarTable *variables){
+    (void) variables;
+    if (args[1] == NULL){
+        ERR_PRINT(ERR_PRINTF_USAGE);
+        return 2;
+    }
+
+    int ret = 0;
+    char **arg = args + 2;
+    do {
+        char **before = arg;
+        for (const char *p = args[1]; *p; ){
+            if (*p == '\\'){
+                p++;
+                printf_escape(&p);
+                continue;
+            }
+            if (*p != '%'){
+                putchar(*p++);
+                continue;
+            }
+            if (p[1] == '%'){
+                putchar('%');
+                p += 2;
+                continue;
+            }
+
+            // copy the spec, leaving room to widen integers to long long
+            char spec[32];
+            size_t len = 0;
+            spec[len++] = *p++;
+            while (*p && strchr("-+ #0123456789.", *p) && len < sizeof(spec) - 4){
+                spec[len++] = *p++;
+            }
+            char conv = *p;
+            if (conv == '\0' || strchr("scdiuoxX", conv) == NULL){
+                ERR_PRINT(ERR_PRINTF_FORMAT, conv);
+                return 1;
+            }
+            p++;
+
+            const char *value = *arg ? *arg++ : "";
+            char *end;
+            switch (conv){
+            case 's':
+                spec[len++] = 's';
+                spec[len] = '\0';
+                printf(spec, value);
+                break;
+            case 'c':
+                if (value[0] != '\0') putchar(value[0]);
+                break;
+            case 'd':
+            case 'i':
+                spec[len++] = 'l';
+                spec[len++] = 'l';
+                spec[len++] = 'd';
+                spec[len] = '\0';
+                printf(spec, strtoll(value, &end, 0));
+                if (*end != '\0') ret = 1;
+                break;
+            default:
+                spec[len++] = 'l';
+                spec[len++] = 'l';
+                spec[len++] = conv;
+                spec[len] = '\0';
+                printf(spec, strtoull(value, &end, 0));
+                if (*end != '\0') ret = 1;
+                break;
+            }
+        }
+        // a format without conversions is printed only once
+        if (arg == before) break;
+    } while (*arg != NULL);
+    return ret;
+}
+
+
+// serial builtins change (or report) the shell's own state, see schedule.c
+static const Builtin builtins[] = {
+    {CD, builtin_cd, 1},
+    {HASH, builtin_hash, 1},
+    {STATS, builtin_stats, 1},
+    {SET, builtin_set, 1},
+    {"echo", builtin_echo, 0},
+    {"true", builtin_true, 0},
+    {"false", builtin_false, 0},
+    {"pwd", builtin_pwd, 0},
+    {"test", builtin_test, 0},
+    {"[", builtin_test, 0},
+    {"printf", builtin_printf, 0},
+    {"export", builtin_export, 1},
+    {"exit", builtin_exit, 1},
+    {"jobs", builtin_jobs, 1},
+    {"wait", builtin_wait, 1},
+    {"parallel", builtin_parallel, 0},
+};
+
+
+/*
+** Returns the builtin called name, or NULL if there is none.
+*/
+const Builtin *builtin_lookup(const char *name){
+    for (size_t i = 0; i < sizeof(builtins) / sizeof(builtins[0]); i++){
+        if (builtins[i].name[0] == name[0] && strcmp(builtins[i].name, name) == 0){
+            return &builtins[i];
+        }
+    }
+    return NULL;
+}
+
+
+/*
+** Runs a builtin command in the shell process. Its redirections are
+** moved onto stdin/stdout for the call and the shell's own are put back
+** afterwards.
+**
+** Returns the builtin's exit status, or -1 if the descriptors could not
+** be set up.
+*/
+int builtin_run(Command *command, VarTable *variables){
+    int saved_in = -1;
+    int saved_out = -1;
+
+    fflush(stdout);
+    if (command->stdin_fd != STDIN_FILENO){
+        saved_in = fcntl(STDIN_FILENO, F_DUPFD_CLOEXEC, 0);
+        if (saved_in < 0 || dup2(command->stdin_fd, STDIN_FILENO) < 0){
+            perror(command->exec_path);
+            if (saved_in >= 0) close(saved_in);
+            return -1;
+        }
+    }
+    if (command->stdout_fd != STDOUT_FILENO){
+        saved_out = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 0);
+        if (saved_out < 0 || dup2(command->stdout_fd, STDOUT_FILENO) < 0){
+            perror(command->exec_path);
+            if (saved_out >= 0) close(saved_out);
+            if (saved_in >= 0){
+                dup2(saved_in, STDIN_FILENO);
+                close(saved_in);
+            }
+            return -1;
+        }
+    }
+
+    int ret = command->builtin->func(command->args, variables);
+
+    fflush(stdout);
+    if (saved_out >= 0){
+        dup2(saved_out, STDOUT_FILENO);
+        close(saved_out);
+    }
+    if (saved_in >= 0){
+        dup2(saved_in, STDIN_FILENO);
+        close(saved_in);
+    }
+    return ret;
+}
+
+
+// Marks this process as a child of the shell (see in_stage)
+void builtin_child(void){
+    in_stage = 1;
+}
+
+
+/*
+** Runs a builtin command as one stage of a pipeline, in a forked child
+** wired up exactly like an external command.
+**
+** Returns the child's pid, or -1 on error.
+*/
+pid_t builtin_fork(Command *command, VarTable *variables){
+    // the child would otherwise flush the shell's pending output again
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0){
+        perror("fork");
+        return -1;
+    }
+    if (pid == 0){
+        builtin_child();
+        if (command->stdin_fd != STDIN_FILENO){
+            dup2(command->stdin_fd, STDIN_FILENO);
+            close(command->stdin_fd);
+        }
+        if (command->stdout_fd != STDOUT_FILENO){
+            dup2(command->stdout_fd, STDOUT_FILENO);
+            close(command->stdout_fd);
+        }
+        int ret = command->builtin->func(command->args, variables);
+        fflush(stdout);
+        _exit(ret & 0xff);
+    }
+    return pid;
+}
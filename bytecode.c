@@ -0,0 +1,396 @@
+#include "cscshell.h"
+#include <sys/mman.h>
+
+/*
+** Compiled scripts (.cscb files).
+**
+** A script's lines are split, lexed and checked by script_load before it
+** runs. That result is compiled into $XDG_CACHE_HOME/cscshell (or
+** ~/.cache/cscshell) as script-HASH.cscb, HASH being the hash of the
+** script's contents, so running the same contents again only has to hash
+** the file and map the compiled form.
+**
+** The compiled form of a line is its text as written (the line cache
+** key), its lexed copy with every word NUL-terminated, and its tokens:
+** words, which keep their $NAME usages as slots to expand when the line
+** runs, pipes, redirections and &. Nothing is expanded or resolved at
+** compile time, so a compiled script behaves exactly like its source.
+**
+** Layout (native endian, all offsets from the start of the file):
+**
+**   BytecodeHeader | BytecodeLine[nlines] | Token[ntokens] | strings...
+**     | source
+**
+** The hash only picks the file: the source it was compiled from is kept
+** in it and compared with the script's contents byte for byte before the
+** compiled lines are used, so two scripts whose hashes collide can never
+** run each other's commands. That costs far less than lexing.
+**
+** Files are replaced atomically, and one whose version, size or source
+** doesn't match is ignored (and rewritten on the next load).
+**
+** Every distinct script leaves a file behind, so the cache keeps only the
+** BYTECODE_MAX_FILES most recently used: a file is touched whenever it
+** is adopted, and writing a new one removes the oldest beyond the limit.
+*/
+
+#define BYTECODE_MAGIC "CSCB"
+#define BYTECODE_VERSION 4
+#define BYTECODE_SUFFIX ".cscb"
+#define BYTECODE_PREFIX "script-"
+#define BYTECODE_MAX_FILES 64
+
+typedef struct BytecodeHeader {
+    char magic[4];
+    uint32_t version;
+    uint32_t size;
+    uint32_t nlines;
+    uint32_t ntokens;
+    uint32_t source_off;
+    uint64_t hash;
+    uint64_t content_len;
+} BytecodeHeader;
+
+typedef struct BytecodeLine {
+    uint32_t number;
+    uint32_t text_off;
+    uint32_t lexed_off;
+    uint32_t first_token;
+    uint32_t count;
+    uint32_t len;
+} BytecodeLine;
+
+static const char *const token_names[] = {
+    [TOK_WORD] = "WORD",
+    [TOK_PIPE] = "PIPE",
+    [TOK_REDIR_IN] = "REDIR_IN",
+    [TOK_REDIR_OUT] = "REDIR_OUT",
+    [TOK_REDIR_APPEND] = "REDIR_APPEND",
+    [TOK_BACKGROUND] = "BACKGROUND",
+    [TOK_HEREDOC] = "HEREDOC",
+    [TOK_HERESTRING] = "HERESTRING",
+};
+
+
+int bytecode_path(uint64_t hash, char *buf, size_t buflen){
+    char dir[MAX_PATH_STR];
+    if (cache_dir_path(dir, sizeof(dir)) < 0) return -1;
+    if (snprintf(buf, buflen, "%s/" BYTECODE_PREFIX "%016llx" BYTECODE_SUFFIX,
+                 dir, (unsigned long long) hash) >= (int) buflen){
+        return -1;
+    }
+    return 0;
+}
+
+
+static const BytecodeLine *bytecode_lines(const char *base){
+    return (const BytecodeLine *) (base + sizeof(BytecodeHeader));
+}
+
+static const Token *bytecode_tokens(const char *base){
+    return (const Token *) (base + sizeof(BytecodeHeader) +
+        ((const BytecodeHeader *) base)->nlines * sizeof(BytecodeLine));
+}
+
+
+/*
+** Maps the compiled file at file_path (privately, since built lines may
+** point into it) and checks that it is whole and consistent. Returns the
+** mapping with its size in *len, or NULL.
+*/
+static char *bytecode_map(const char *file_path, size_t *len){
+    int fd = open(file_path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return NULL;
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t) st.st_size < sizeof(BytecodeHeader)){
+        close(fd);
+        return NULL;
+    }
+    char *base = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+                      fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) return NULL;
+
+    const BytecodeHeader *header = (const BytecodeHeader *) base;
+    size_t tables = sizeof(BytecodeHeader) +
+        (size_t) header->nlines * sizeof(BytecodeLine) +
+        (size_t) header->ntokens * sizeof(Token);
+    uint8_t ok = memcmp(header->magic, BYTECODE_MAGIC, 4) == 0 &&
+        header->version == BYTECODE_VERSION &&
+        header->size == (size_t) st.st_size && tables <= header->size &&
+        header->source_off >= tables &&
+        header->content_len <= header->size - header->source_off;
+
+    const BytecodeLine *lines = bytecode_lines(base);
+    for (uint32_t i = 0; ok && i < header->nlines; i++){
+        ok = lines[i].text_off >= tables && lines[i].lexed_off >= tables &&
+            lines[i].text_off + (size_t) lines[i].len < header->size &&
+            lines[i].lexed_off + (size_t) lines[i].len < header->size &&
+            base[lines[i].text_off + lines[i].len] == '\0' &&
+            base[lines[i].lexed_off + lines[i].len] == '\0' &&
+            (size_t) lines[i].first_token + lines[i].count <= header->ntokens;
+
+        // every token has to lie within its line
+        for (uint32_t t = 0; ok && t < lines[i].count; t++){
+            const Token *token = &bytecode_tokens(base)[lines[i].first_token + t];
+            ok = (size_t) token->start + token->len <= lines[i].len;
+        }
+    }
+    if (!ok){
+        munmap(base, st.st_size);
+        return NULL;
+    }
+    *len = st.st_size;
+    return base;
+}
+
+
+/*
+** Adopts the compiled form of script's contents (script->hash and
+** script->data_len must be set), pointing its lines into it. Returns 0
+** on success, -1 if there is no usable compiled form.
+*/
+int bytecode_load(Script *script){
+    char file_path[MAX_PATH_STR];
+    size_t len;
+    if (bytecode_path(script->hash, file_path, sizeof(file_path)) < 0) return -1;
+    char *base = bytecode_map(file_path, &len);
+    if (base == NULL) return -1;
+
+    const BytecodeHeader *header = (const BytecodeHeader *) base;
+    LexedLine *lines = header->nlines ?
+        malloc(header->nlines * sizeof(LexedLine)) : NULL;
+    if (header->hash != script->hash ||
+        header->content_len != script->data_len ||
+        memcmp(base + header->source_off, script->data,
+               script->data_len) != 0 ||
+        (header->nlines && lines == NULL)){
+        munmap(base, len);
+        free(lines);
+        return -1;
+    }
+
+    const BytecodeLine *src = bytecode_lines(base);
+    Token *tokens = (Token *) bytecode_tokens(base);
+    for (uint32_t i = 0; i < header->nlines; i++){
+        lines[i].text = base + src[i].text_off;
+        lines[i].lexed = base + src[i].lexed_off;
+        lines[i].tokens = tokens + src[i].first_token;
+        lines[i].count = src[i].count;
+        lines[i].number = src[i].number;
+    }
+    script->code = base;
+    script->code_len = len;
+    script->lines = lines;
+    script->nlines = header->nlines;
+    // marks it recently used (see bytecode_prune)
+    utimensat(AT_FDCWD, file_path, NULL, 0);
+    return 0;
+}
+
+
+typedef struct BytecodeFile {
+    char name[NAME_MAX + 1];
+    struct timespec mtime;
+} BytecodeFile;
+
+
+// Returns 1 if name is that of a compiled script
+static int is_bytecode_name(const char *name){
+    size_t len = strlen(name);
+    size_t prefix = strlen(BYTECODE_PREFIX);
+    size_t suffix = strlen(BYTECODE_SUFFIX);
+    return len > prefix + suffix && strncmp(name, BYTECODE_PREFIX, prefix) == 0 &&
+        strcmp(name + len - suffix, BYTECODE_SUFFIX) == 0;
+}
+
+
+static int older_first(const void *a, const void *b){
+    const struct timespec *x = &((const BytecodeFile *) a)->mtime;
+    const struct timespec *y = &((const BytecodeFile *) b)->mtime;
+    if (x->tv_sec != y->tv_sec) return x->tv_sec < y->tv_sec ? -1 : 1;
+    if (x->tv_nsec != y->tv_nsec) return x->tv_nsec < y->tv_nsec ? -1 : 1;
+    return 0;
+}
+
+
+/*
+** Removes the least recently used compiled scripts from the cache
+** directory until at most BYTECODE_MAX_FILES are left. Like saving,
+** this is best effort.
+*/
+static void bytecode_prune(void){
+    char dir_path[MAX_PATH_STR];
+    if (cache_dir_path(dir_path, sizeof(dir_path)) < 0) return;
+    DIR *dir = opendir(dir_path);
+    if (dir == NULL) return;
+
+    BytecodeFile *files = NULL;
+    size_t count = 0;
+    size_t cap = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL){
+        if (!is_bytecode_name(entry->d_name)) continue;
+        if (count == cap){
+            size_t new_cap = cap ? cap * 2 : BYTECODE_MAX_FILES * 2;
+            BytecodeFile *grown = realloc(files, new_cap * sizeof(BytecodeFile));
+            if (grown == NULL) break;
+            files = grown;
+            cap = new_cap;
+        }
+        struct stat st;
+        if (fstatat(dirfd(dir), entry->d_name, &st, 0) < 0) continue;
+        strcpy(files[count].name, entry->d_name);
+        files[count].mtime = st.st_mtim;
+        count++;
+    }
+
+    if (count > BYTECODE_MAX_FILES){
+        qsort(files, count, sizeof(BytecodeFile), older_first);
+        for (size_t i = 0; i < count - BYTECODE_MAX_FILES; i++){
+            unlinkat(dirfd(dir), files[i].name, 0);
+        }
+    }
+    closedir(dir);
+    free(files);
+}
+
+
+/*
+** Compiles a freshly loaded script into the cache. Failure is not an
+** error: the script just gets lexed again next time.
+*/
+void bytecode_save(const Script *script){
+    char file_path[MAX_PATH_STR];
+    if (bytecode_path(script->hash, file_path, sizeof(file_path)) < 0) return;
+
+    size_t ntokens = 0;
+    size_t strings = 0;
+    for (size_t i = 0; i < script->nlines; i++){
+        ntokens += script->lines[i].count;
+        strings += 2 * (strlen(script->lines[i].text) + 1);
+    }
+    size_t tables = sizeof(BytecodeHeader) +
+        script->nlines * sizeof(BytecodeLine) + ntokens * sizeof(Token);
+    size_t size = tables + strings + script->data_len;
+    if (size > UINT32_MAX) return;
+
+    char *buf = calloc(1, size);
+    if (buf == NULL) return;
+
+    BytecodeHeader *header = (BytecodeHeader *) buf;
+    memcpy(header->magic, BYTECODE_MAGIC, 4);
+    header->version = BYTECODE_VERSION;
+    header->size = size;
+    header->nlines = script->nlines;
+    header->ntokens = ntokens;
+    header->hash = script->hash;
+    header->content_len = script->data_len;
+
+    BytecodeLine *lines = (BytecodeLine *) (buf + sizeof(BytecodeHeader));
+    Token *tokens = (Token *) bytecode_tokens(buf);
+    size_t token_i = 0;
+    size_t off = tables;
+    for (size_t i = 0; i < script->nlines; i++){
+        const LexedLine *line = &script->lines[i];
+        size_t len = strlen(line->text);
+        lines[i].number = line->number;
+        lines[i].len = len;
+        lines[i].first_token = token_i;
+        lines[i].count = line->count;
+        memcpy(tokens + token_i, line->tokens, line->count * sizeof(Token));
+        token_i += line->count;
+
+        // the lexed copy has NULs inside it, so it is copied by length
+        lines[i].text_off = off;
+        memcpy(buf + off, line->text, len + 1);
+        off += len + 1;
+        lines[i].lexed_off = off;
+        memcpy(buf + off, line->lexed, len + 1);
+        off += len + 1;
+    }
+
+    // script_load has cut the source into lines: put its newlines back
+    header->source_off = off;
+    memcpy(buf + off, script->data, script->data_len);
+    for (char *p = buf + off; (p = memchr(p, '\0', buf + size - p)) != NULL; p++){
+        *p = '\n';
+    }
+
+    cache_file_write(file_path, buf, size);
+    free(buf);
+    bytecode_prune();
+}
+
+
+/*
+** Implements --compile: loads file_path, which compiles it, and prints
+** the path of its compiled form.
+*/
+int compile_script(const char *file_path){
+    Script script;
+    if (script_load(file_path, &script) < 0) return -1;
+
+    char code_path[MAX_PATH_STR];
+    int ret = 0;
+    if (bytecode_path(script.hash, code_path, sizeof(code_path)) < 0 ||
+        access(code_path, R_OK) < 0){
+        ERR_PRINT(ERR_BYTECODE_CACHE, file_path);
+        ret = -1;
+    }
+    else {
+        printf("%s\n", code_path);
+    }
+    script_free(&script);
+    return ret;
+}
+
+
+/*
+** Implements --disassemble: prints every line of the compiled script at
+** file_path with its tokens, one per line. Words are shown as written,
+** flagged if they hold quotes or variable slots.
+*/
+int bytecode_disassemble(const char *file_path){
+    size_t len;
+    char *base = bytecode_map(file_path, &len);
+    if (base == NULL){
+        ERR_PRINT(ERR_BYTECODE_FILE, file_path);
+        return -1;
+    }
+
+    const BytecodeHeader *header = (const BytecodeHeader *) base;
+    const BytecodeLine *lines = bytecode_lines(base);
+    const Token *tokens = bytecode_tokens(base);
+    printf("%s: version %u, %u lines, %u tokens, source %llu bytes "
+           "(hash %016llx)\n", file_path, header->version, header->nlines,
+           header->ntokens, (unsigned long long) header->content_len,
+           (unsigned long long) header->hash);
+
+    for (uint32_t i = 0; i < header->nlines; i++){
+        const char *lexed = base + lines[i].lexed_off;
+        printf("\n%5u: %s\n", lines[i].number, base + lines[i].text_off);
+        for (uint32_t t = 0; t < lines[i].count; t++){
+            const Token *token = &tokens[lines[i].first_token + t];
+            const char *name = token->kind < sizeof(token_names) /
+                sizeof(token_names[0]) ? token_names[token->kind] : "?";
+            if (token->kind == TOK_HEREDOC){
+                printf("       %-12s %u bytes%s%s\n", name, token->len,
+                       token->flags & TOKEN_HAS_VAR ? "  [vars]" : "",
+                       token->flags & TOKEN_HAS_SUBST ? "  [subst]" : "");
+                continue;
+            }
+            if (token->kind != TOK_WORD){
+                printf("       %s\n", name);
+                continue;
+            }
+            printf("       %-12s %.*s%s%s%s\n", name, (int) token->len,
+                   lexed + token->start,
+                   token->flags & TOKEN_QUOTED ? "  [quoted]" : "",
+                   token->flags & TOKEN_HAS_VAR ? "  [vars]" : "",
+                   token->flags & TOKEN_HAS_SUBST ? "  [subst]" : "");
+        }
+    }
+    munmap(base, len);
+    return 0;
+}
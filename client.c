@@ -0,0 +1,77 @@
+#include "cscshell.h"
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/*
+** cscshell-client SOCKET COMMAND...
+**
+** Runs one command line on a resident shell started with
+** `cscshell --serve SOCKET` (see server.c). The words of COMMAND are
+** joined with spaces into the line, this process's stdin, stdout and
+** stderr are lent to the shell for it, and the client exits with the
+** line's exit status.
+*/
+
+int main(int argc, char *argv[]){
+    if (argc < 3){
+        fprintf(stderr, "usage: %s SOCKET COMMAND...\n", argv[0]);
+        return SERVE_STATUS_ERROR;
+    }
+
+    char line[SERVE_MAX_LINE];
+    size_t len = 0;
+    for (int i = 2; i < argc; i++){
+        int n = snprintf(line + len, sizeof(line) - len, "%s%s",
+                         i > 2 ? " " : "", argv[i]);
+        if (n < 0 || (size_t) n >= sizeof(line) - len){
+            fprintf(stderr, "%s: command line too long\n", argv[0]);
+            return SERVE_STATUS_ERROR;
+        }
+        len += n;
+    }
+
+    struct sockaddr_un addr = {0};
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, argv[1], sizeof(addr.sun_path) - 1);
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock < 0 || connect(sock, (struct sockaddr *) &addr, sizeof(addr)) < 0){
+        perror(argv[1]);
+        return SERVE_STATUS_ERROR;
+    }
+
+    // the length goes first, carrying our stdio descriptors with it
+    uint32_t len32 = len;
+    int fds[3] = {STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO};
+    char control[CMSG_SPACE(sizeof(fds))] = {0};
+    struct iovec iov = {&len32, sizeof(len32)};
+    struct msghdr msg = {0};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    // a server that has gone away shows up as EPIPE or a short answer
+    int32_t code;
+    ssize_t got = -1;
+    if (sendmsg(sock, &msg, MSG_NOSIGNAL) == sizeof(len32) &&
+        send(sock, line, len, MSG_NOSIGNAL) == (ssize_t) len){
+        got = recv(sock, &code, sizeof(code), MSG_WAITALL);
+    }
+    if (got < 0 && errno != EPIPE && errno != ECONNRESET){
+        perror("cscshell-client");
+        return SERVE_STATUS_ERROR;
+    }
+    if (got != sizeof(code)){
+        fprintf(stderr, "%s: %s: server closed the connection\n", argv[0],
+                argv[1]);
+        return SERVE_STATUS_ERROR;
+    }
+    close(sock);
+    return code;
+}
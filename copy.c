@@ -0,0 +1,155 @@
+#include "cscshell.h"
+#include <sys/sendfile.h>
+
+/*
+** In-process file copies.
+**
+** A line that is nothing but the system cat copying regular files (its
+** arguments, or a redirected stdin) into a redirect file is run without
+** starting cat. The shell moves the bytes itself with copy_file_range(),
+** which lets the filesystem copy or share the extents without the data
+** ever reaching user space, or with sendfile() when the files are on
+** filesystems copy_file_range can't cross.
+**
+** The output was opened by open_redirections, truncated for > or with
+** O_APPEND for >>. Neither call writes to an O_APPEND descriptor, so for
+** >> the flag is dropped and the copy starts at the end of the file; the
+** descriptor is the shell's alone until the line ends.
+**
+** Anything else goes the normal way: options, a pipe, FIFO or terminal
+** at either end (names are checked with stat() before any is opened),
+** cat reading its own output, files the kernel reports as empty (which
+** includes /proc files), or a copy refused before any byte has moved.
+*/
+
+#define COPY_CHUNK (1 << 30)
+#define COPY_MAX_FILES 16
+
+static const char *const system_cats[] = {"/bin/cat", "/usr/bin/cat"};
+
+
+static int is_system_cat(const char *exec_path){
+    for (size_t i = 0; i < sizeof(system_cats) / sizeof(system_cats[0]); i++){
+        if (strcmp(exec_path, system_cats[i]) == 0) return 1;
+    }
+    return 0;
+}
+
+
+/*
+** Copies in_fd to out_fd from their current offsets until the end of
+** in_fd, adding the bytes moved to copied. Returns 0, or -1 with errno
+** set.
+*/
+static int copy_fd(int in_fd, int out_fd, off_t *copied){
+    uint8_t ranges = 1;
+    for (;;){
+        ssize_t n = ranges ?
+            copy_file_range(in_fd, NULL, out_fd, NULL, COPY_CHUNK, 0) :
+            sendfile(out_fd, in_fd, NULL, COPY_CHUNK);
+        if (n > 0){
+            *copied += n;
+            continue;
+        }
+        if (n == 0) return 0;
+        if (errno == EINTR) continue;
+        if (ranges && (errno == EXDEV || errno == EINVAL ||
+                       errno == ENOSYS || errno == EOPNOTSUPP)){
+            // the offsets copy_file_range moved carry over to sendfile
+            ranges = 0;
+            continue;
+        }
+        return -1;
+    }
+}
+
+
+static void close_inputs(const int *fds, int count, int stdin_fd){
+    for (int i = 0; i < count; i++){
+        if (fds[i] != stdin_fd) close(fds[i]);
+    }
+}
+
+
+/*
+** Runs head in the shell if it is a lone system cat copying files into
+** a redirect file (see above). Returns cat's exit code, or -1 if head
+** has to be run the normal way.
+*/
+int copy_line(Command *head){
+    if (head->next != NULL || head->background || head->builtin != NULL ||
+        head->redir_out_path == NULL || head->exec_path == NULL ||
+        !is_system_cat(head->exec_path)){
+        return -1;
+    }
+    int out_fd = head->stdout_fd;
+    struct stat out_st;
+    if (fstat(out_fd, &out_st) < 0 || !S_ISREG(out_st.st_mode)) return -1;
+
+    int fds[COPY_MAX_FILES];
+    const char *names[COPY_MAX_FILES];
+    int count = 0;
+    for (char **arg = head->args + 1; *arg != NULL; arg++){
+        if ((*arg)[0] == '-' || count == COPY_MAX_FILES) return -1;
+        names[count++] = *arg;
+    }
+    if (count == 0){
+        // only a stdin the line redirected, not the shell's own
+        if (head->stdin_fd == STDIN_FILENO) return -1;
+        fds[0] = head->stdin_fd;
+        names[0] = "-";
+        count = 1;
+    }
+    else {
+        // nothing but regular files may be opened: opening a FIFO would
+        // take its writer's data away from the cat that runs instead
+        for (int i = 0; i < count; i++){
+            struct stat st;
+            if (stat(names[i], &st) < 0 || !S_ISREG(st.st_mode)) return -1;
+        }
+        for (int i = 0; i < count; i++){
+            // O_NONBLOCK in case a name became a FIFO since
+            fds[i] = open(names[i], O_RDONLY | O_CLOEXEC | O_NONBLOCK);
+            if (fds[i] < 0){
+                close_inputs(fds, i, head->stdin_fd);
+                return -1;
+            }
+        }
+    }
+
+    for (int i = 0; i < count; i++){
+        struct stat st;
+        if (fstat(fds[i], &st) < 0 || !S_ISREG(st.st_mode) ||
+            st.st_size == 0 ||
+            (st.st_dev == out_st.st_dev && st.st_ino == out_st.st_ino)){
+            close_inputs(fds, count, head->stdin_fd);
+            return -1;
+        }
+    }
+
+    int out_flags = fcntl(out_fd, F_GETFL);
+    if (out_flags < 0 ||
+        ((out_flags & O_APPEND) &&
+         (fcntl(out_fd, F_SETFL, out_flags & ~O_APPEND) < 0 ||
+          lseek(out_fd, 0, SEEK_END) < 0))){
+        close_inputs(fds, count, head->stdin_fd);
+        return -1;
+    }
+
+    int code = 0;
+    off_t copied = 0;
+    for (int i = 0; i < count; i++){
+        if (copy_fd(fds[i], out_fd, &copied) == 0) continue;
+        if (copied == 0 && (errno == EINVAL || errno == ENOSYS)){
+            // neither call works for these files: let cat do it
+            fcntl(out_fd, F_SETFL, out_flags);
+            close_inputs(fds, count, head->stdin_fd);
+            return -1;
+        }
+        fprintf(stderr, "%s: %s: %s\n", head->args[0], names[i],
+                strerror(errno));
+        code = 1;
+    }
+    close_inputs(fds, count, head->stdin_fd);
+    return code;
+}
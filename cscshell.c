@@ -1,4 +1,5 @@
 #include "cscshell.h"
+#include <time.h>
 
 
 void print_help(){
@@ -7,6 +8,19 @@ void print_help(){
     printf("Options:\n");
     printf("  -h, --help\t\t\tDisplay this help message\n");
     printf("  -i, --init-file=FILE\t\tUse a specific init file. Default is ~/.cscshell_init\n");
+    printf("      --spawn=MODE\t\tStart commands with fork (fork, default) or posix_spawn (spawn)\n");
+    printf("      --pipe-size=BYTES\t\tGive every pipeline pipe this capacity\n");
+    printf("      --relay\t\t\tSplice pipeline data through the shell and report throughput\n");
+    printf("  -j N\t\t\t\tRun up to N independent script lines at once\n");
+    printf("\t\t\t\t(lines naming a common file, even as an argument, stay in order;\n");
+    printf("\t\t\t\t lines already started when one fails still finish)\n");
+    printf("      --serve SOCKET\t\tServe command lines from cscshell-client on SOCKET\n");
+    printf("      --no-snapshot\t\tAlways run the init file instead of adopting its snapshot\n");
+    printf("      --startup-time\t\tReport how long the init file took to load\n");
+    printf("      --compile\t\t\tCompile SCRIPT-FILE into the cache without running it\n");
+    printf("      --disassemble FILE\tPrint a compiled script (.cscb file)\n");
+    printf("      --trace FILE\t\tWrite a timeline of the run to FILE (Chrome trace JSON)\n");
+    printf("      --stats\t\t\tPrint counters and latency histograms on exit\n");
     printf("If no script file is given, cscshell will run in interactive mode\n");
 }
 
@@ -29,9 +43,52 @@ char *prompt(char *line, size_t line_length){
 }
 
 
-int run_interactive(Variable **root){
+/*
+** Reads the rest of a line that opens here-documents: more lines, each
+** prompted with HEREDOC_PROMPT_STR, until every body has its delimiter
+** (or input ends). Returns the whole line on the heap, or NULL if memory
+** could not be allocated.
+*/
+char *read_heredocs(const char *first, Arena *arena){
+    size_t len = strlen(first);
+    size_t cap = len + MAX_SINGLE_LINE + 2;
+    char *text = malloc(cap);
+    if (text == NULL){
+        perror("malloc");
+        return NULL;
+    }
+    memcpy(text, first, len + 1);
+
+    char more[MAX_SINGLE_LINE];
+    while (heredoc_extent(text, len, arena) < 0){
+        printf(HEREDOC_PROMPT_STR);
+        if (fgets(more, sizeof(more), stdin) == NULL) break;
+        size_t more_len = strcspn(more, "\n");
+
+        if (len + more_len + 2 > cap){
+            cap = (len + more_len + 2) * 2;
+            char *grown = realloc(text, cap);
+            if (grown == NULL){
+                perror("realloc");
+                free(text);
+                return NULL;
+            }
+            text = grown;
+        }
+        text[len++] = '\n';
+        memcpy(text + len, more, more_len);
+        len += more_len;
+        text[len] = '\0';
+    }
+    return text;
+}
+
+
+int run_interactive(VarTable *variables){
     long error;
     char line[MAX_SINGLE_LINE];
+    Arena arena;
+    arena_init(&arena);
 
     #ifdef DEBUG
     printf("Interactive CSCSHELL starting...\n");
@@ -40,23 +97,43 @@ int run_interactive(Variable **root){
     while ((error = (long) prompt(line, MAX_SINGLE_LINE)) > 0) {
         // kill the newline
         line[strlen(line) - 1] = '\0';
+        jobs_reap();
 
-        Command *commands = parse_line(line, root);
+        // here-documents go on over the lines after
+        char *text = line;
+        if (heredoc_extent(line, strlen(line), &arena) < 0){
+            text = read_heredocs(line, &arena);
+            if (text == NULL){
+                arena_free(&arena);
+                return -1;
+            }
+        }
+
+        Command *commands = parse_line(text, variables, &arena);
+        if (text != line){
+            free(text);
+        }
         if (commands == (Command *) -1){
             ERR_PRINT(ERR_PARSING_LINE);
+            arena_reset(&arena);
+            continue;
+        }
+        if (commands == NULL){
+            arena_reset(&arena);
             continue;
         }
-        if (commands == NULL) continue;
 
-        int *last_ret_code_pt = execute_line(commands);
+        int *last_ret_code_pt = execute_line(commands, variables);
+        arena_reset(&arena);
         if (last_ret_code_pt == (int *) -1){
             ERR_PRINT(ERR_EXECUTE_LINE);
-            free(last_ret_code_pt);
+            arena_free(&arena);
             return -1;
         }
         free(last_ret_code_pt);
     }
     printf("\n");
+    arena_free(&arena);
 
     #ifdef DEBUG
     printf("\nInteractive CSCSHELL exiting...\n");
@@ -71,6 +148,10 @@ int main(int argc, char *argv[]){
 
     int num_args_parsed = 0;
     char *init_file = DEFAULT_INIT;
+    char *serve_socket = NULL;
+    uint8_t use_snapshot = 1;
+    uint8_t startup_time = 0;
+    uint8_t compile = 0;
 
     for (int i=1; i < argc; i++){
         if (strcmp(argv[i], "-h") == 0 ||
@@ -91,10 +172,108 @@ int main(int argc, char *argv[]){
             }
         }
 
-        else if (strncmp(argv[1], LONG_INIT_ARG,
+        else if (strncmp(argv[i], LONG_INIT_ARG,
                          strlen(LONG_INIT_ARG)) == 0){
             num_args_parsed++;
-            init_file = strchr(argv[1], '=') + 1;
+            init_file = strchr(argv[i], '=') + 1;
+        }
+
+        else if (strncmp(argv[i], LONG_SPAWN_ARG,
+                         strlen(LONG_SPAWN_ARG)) == 0){
+            num_args_parsed++;
+            const char *mode = argv[i] + strlen(LONG_SPAWN_ARG);
+            if (strcmp(mode, "spawn") == 0){
+                shell_options.spawn_mode = SPAWN_POSIX;
+            }
+            else if (strcmp(mode, "fork") == 0){
+                shell_options.spawn_mode = SPAWN_FORK;
+            }
+            else {
+                ERR_PRINT(ERR_SPAWN_MODE, mode);
+                return -1;
+            }
+        }
+
+        else if (strncmp(argv[i], LONG_PIPE_SIZE_ARG,
+                         strlen(LONG_PIPE_SIZE_ARG)) == 0){
+            num_args_parsed++;
+            const char *size = argv[i] + strlen(LONG_PIPE_SIZE_ARG);
+            char *end;
+            long bytes = strtol(size, &end, 10);
+            if (end == size || *end != '\0' || bytes <= 0 || bytes > INT32_MAX){
+                ERR_PRINT(ERR_PIPE_SIZE, size);
+                return -1;
+            }
+            shell_options.pipe_size = (int) bytes;
+        }
+
+        else if (strcmp(argv[i], LONG_SERVE_ARG) == 0){
+            if (i + 1 < argc){
+                serve_socket = argv[i + 1];
+                i++;
+                num_args_parsed += 2;
+            }
+            else{
+                fprintf(stderr, ERR_SERVE_MISSING);
+                return -1;
+            }
+        }
+
+        else if (strcmp(argv[i], JOBS_ARG) == 0){
+            char *end;
+            long jobs = i + 1 < argc ? strtol(argv[i + 1], &end, 10) : 0;
+            if (jobs <= 0 || *end != '\0' || jobs > INT32_MAX){
+                ERR_PRINT(ERR_JOBS_ARG, i + 1 < argc ? argv[i + 1] : "");
+                return -1;
+            }
+            shell_options.max_jobs = (int) jobs;
+            i++;
+            num_args_parsed += 2;
+        }
+
+        else if (strcmp(argv[i], LONG_RELAY_ARG) == 0){
+            num_args_parsed++;
+            shell_options.relay = 1;
+        }
+
+        else if (strcmp(argv[i], LONG_NO_SNAPSHOT_ARG) == 0){
+            num_args_parsed++;
+            use_snapshot = 0;
+        }
+
+        else if (strcmp(argv[i], LONG_STARTUP_TIME_ARG) == 0){
+            num_args_parsed++;
+            startup_time = 1;
+        }
+
+        else if (strcmp(argv[i], LONG_COMPILE_ARG) == 0){
+            num_args_parsed++;
+            compile = 1;
+        }
+
+        else if (strcmp(argv[i], LONG_TRACE_ARG) == 0){
+            if (i + 1 < argc){
+                if (trace_open(argv[i + 1]) < 0) return -1;
+                i++;
+                num_args_parsed += 2;
+            }
+            else{
+                fprintf(stderr, ERR_TRACE_MISSING);
+                return -1;
+            }
+        }
+
+        else if (strcmp(argv[i], LONG_STATS_ARG) == 0){
+            num_args_parsed++;
+            stats_at_exit();
+        }
+
+        else if (strcmp(argv[i], LONG_DISASSEMBLE_ARG) == 0){
+            if (i + 1 < argc){
+                return bytecode_disassemble(argv[i + 1]) < 0 ? -1 : 0;
+            }
+            fprintf(stderr, ERR_DISASSEMBLE_MISSING);
+            return -1;
         }
     }
 
@@ -102,25 +281,67 @@ int main(int argc, char *argv[]){
     printf("Using init file at: %s\n", init_file);
     #endif
 
-    Variable *start_of_vars = NULL;
-    if (run_script(init_file, &start_of_vars) < 0){
-        ERR_PRINT(ERR_INIT_SCRIPT, init_file);
+    // Compiling needs no shell state, not even the init file
+    if (compile){
+        if (num_args_parsed >= argc-1){
+            fprintf(stderr, ERR_COMPILE_MISSING);
+            return -1;
+        }
+        return compile_script(argv[argc-1]);
+    }
+
+    if (jobs_init() < 0){
         return -1;
     }
 
-    if ((start_of_vars == NULL) ||
-        strcmp(start_of_vars->name, PATH_VAR_NAME) > 0) {
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    // A fresh snapshot stands in for the init file; otherwise run it, and
+    // snapshot the result if all it did was assign variables
+    VarTable variables;
+    var_table_init(&variables);
+    uint8_t adopted = use_snapshot && snapshot_load(init_file, &variables) == 0;
+    if (!adopted){
+        unsigned long lines_before = executed_lines;
+        if (run_script(init_file, &variables) < 0){
+            ERR_PRINT(ERR_INIT_SCRIPT, init_file);
+            return -1;
+        }
+        if (use_snapshot && executed_lines == lines_before){
+            snapshot_save(init_file, &variables);
+        }
+    }
+
+    if (startup_time){
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        fprintf(stderr, STARTUP_TIME_REPORT,
+                adopted ? "snapshot" : "init file",
+                (end.tv_sec - start.tv_sec) * 1e6 +
+                (end.tv_nsec - start.tv_nsec) / 1e3);
+    }
+
+    if (variables.path == NULL) {
         ERR_PRINT(ERR_PATH_INIT, init_file);
     }
 
     int ret_code;
-    if (num_args_parsed < argc-1){
-        ret_code = run_script(argv[argc-1], &start_of_vars);
+    if (serve_socket != NULL){
+        shell_options.serving = 1;
+        ret_code = run_server(serve_socket, &variables);
+    }
+    else if (num_args_parsed < argc-1 && shell_options.max_jobs > 1){
+        ret_code = run_script_parallel(argv[argc-1], &variables,
+                                       shell_options.max_jobs);
+    }
+    else if (num_args_parsed < argc-1){
+        ret_code = run_script(argv[argc-1], &variables);
     }
     else{
-        ret_code = run_interactive(&start_of_vars);
+        shell_options.interactive = 1;
+        ret_code = run_interactive(&variables);
     }
 
-    free_variable(start_of_vars, NON_ZERO_BYTE);
+    var_table_free(&variables);
     return ret_code;
 }
@@ -1,6 +1,9 @@
 #ifndef CSCSHELL_H
 #define CSCSHELL_H
 
+// pipe2, F_SETPIPE_SZ and friends
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -10,17 +13,38 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
+#include <sys/resource.h>
 #include <fcntl.h>
 
 #include <dirent.h>
 #include <pwd.h>
 #include <errno.h>
+#include <spawn.h>
+
+extern char **environ;
 
 // Arg help
 #define LONG_HELP_ARG "--help"
 #define LONG_INIT_ARG "--init-file="
+#define LONG_SPAWN_ARG "--spawn="
+#define LONG_PIPE_SIZE_ARG "--pipe-size="
+#define LONG_RELAY_ARG "--relay"
+#define JOBS_ARG "-j"
+#define LONG_SERVE_ARG "--serve"
+#define LONG_NO_SNAPSHOT_ARG "--no-snapshot"
+#define LONG_STARTUP_TIME_ARG "--startup-time"
+#define LONG_COMPILE_ARG "--compile"
+#define LONG_TRACE_ARG "--trace"
+#define LONG_STATS_ARG "--stats"
+#define LONG_DISASSEMBLE_ARG "--disassemble"
 #define DEFAULT_INIT "~/.cscshell_init"
 
+// Cache directory, under $XDG_CACHE_HOME or ~/.cache
+#define CACHE_DIR_NAME "cscshell"
+
+// Environment variable capping the metacharacter scanner (scalar, sse2)
+#define SCAN_ENV_VAR "CSCSHELL_SCAN"
+
 // Buffer sizes
 #define MAX_USER_BUF 128
 #define MAX_PATH_STR 4096
@@ -28,10 +52,21 @@
 
 // Prompt config
 #define PROMPT_STR "<:"
+#define HEREDOC_PROMPT_STR "> "
+
+// Server mode (see server.c): longest request line, and the status
+// sent back when a line could not be run at all
+#define SERVE_MAX_LINE (1 << 16)
+#define SERVE_STATUS_ERROR 2
 
 // other strings and values
 #define PATH_VAR_NAME "PATH"
+#define PIPESTATUS_VAR_NAME "PIPESTATUS"
+#define LAST_JOB_VAR_NAME "!"
 #define CD "cd"
+#define HASH "hash"
+#define STATS "stats"
+#define SET "set"
 #define VARIABLE_PARSE_MARKER '$'
 #define PARSING_START_MARKER '<'
 #define PARSING_END_MARKER '>'
@@ -39,8 +74,16 @@
 
 // Error Strings
 #define ERR_ARGS_MISSING "Missing init file path after argument: '-i'\n"
-#define ERR_PATH_INIT "PATH not defined in init file %s, or not at the head \
-of the variable list."
+#define ERR_SPAWN_MODE "Unknown spawn mode: %s (expected fork or spawn)\n"
+#define ERR_PIPE_SIZE "Invalid pipe size: %s\n"
+#define ERR_JOBS_ARG "-j needs a number of jobs, got: %s\n"
+#define ERR_SERVE_MISSING "Missing socket path after argument: '--serve'\n"
+#define ERR_TRACE_MISSING "Missing file after argument: '--trace'\n"
+#define ERR_DISASSEMBLE_MISSING "Missing file after argument: '--disassemble'\n"
+#define ERR_COMPILE_MISSING "Missing script file for '--compile'\n"
+#define ERR_SERVE_PATH "Socket path too long: %s\n"
+#define ERR_SERVE_REQUEST "serve: malformed request, dropping client\n"
+#define ERR_PATH_INIT "PATH not defined in init file %s.\n"
 #define ERR_PARSING_LINE "Could not parse line into commands.\n"
 #define ERR_EXECUTE_LINE "Could not execute line.\n"
 #define ERR_INIT_SCRIPT "Failed to run init script: %s\n"
@@ -52,28 +95,244 @@ of the variable list."
 #define ERR_NO_EXECU "Could not resolve executable [%s]\n"
 #define ERR_VAR_USAGE "Variable could not be parsed from %s\n"
 #define ERR_VAR_NOT_FOUND "Could not find variable: <%s>\n"
+#define ERR_UNTERMINATED_QUOTE "Unterminated quote.\n"
+#define ERR_UNTERMINATED_SUBST "Unterminated command substitution.\n"
+#define ERR_HEREDOC_UNTERMINATED "Here-document not terminated by: %s\n"
+#define ERR_SCRIPT_SYNTAX "%s: line %zu: syntax error\n"
+#define ERR_BYTECODE_FILE "%s: not a compiled script\n"
+#define ERR_BYTECODE_CACHE "%s: no cache directory for the compiled script\n"
+#define ERR_HASH_USAGE "usage: hash [-r]\n"
+#define ERR_STATS_USAGE "usage: stats [-r]\n"
+#define ERR_SET_USAGE "usage: set [-o|+o [NAME]]\n"
+#define ERR_SET_OPTION "set: no such option: %s\n"
+#define ERR_EXIT_USAGE "usage: exit [N]\n"
+#define ERR_PRINTF_USAGE "usage: printf FORMAT [ARG]...\n"
+#define ERR_PRINTF_FORMAT "printf: unsupported conversion: %%%c\n"
+#define ERR_TEST_ARGS "test: too many arguments\n"
+#define ERR_TEST_BRACKET "[: missing ']'\n"
+#define ERR_TEST_OPERATOR "test: unknown operator: %s\n"
+#define ERR_TEST_INTEGER "test: integer expected: %s\n"
+#define ERR_NO_JOB "wait: no such job: %s\n"
+#define ERR_PARALLEL_USAGE "usage: parallel [-j N] [-k] TEMPLATE [::: ITEM...]\n"
+#define ERR_PARALLEL_TEMPLATE "parallel: not a command template: %s\n"
+
+#define JOB_DONE_FORMAT "[%d] Done (%d)\t%s\n"
+#define RELAY_REPORT "relay: %s -> %s: %llu bytes in %.3f s (%.1f MiB/s)\n"
+#define STARTUP_TIME_REPORT "startup: %s in %.1f us\n"
 
 #define ERR_PRINT(...) fprintf(stderr, "ERROR: ");\
     fprintf(stderr, __VA_ARGS__);
 
 /*
-** Two structures for maintaining a singly-linked list of:
+** Structures for maintaining:
 **
-** 1. Shell Variables; including PATH, which is the
-**    first item of main variable list. Consider using
-**    this list structure for replacing variables used
-**    in a shell command as well.
+** 1. Shell Variables; held in a VarTable, a hash table over
+**    Variables that are also linked in assignment order.
+**    PATH has its own slot in the table, since every
+**    executable lookup needs it.
 ** 2. Commands to execute; A single line may have only a
 **    single command, or may consist of multiple commands
-**    connected by pipes.
+**    connected by pipes. here_doc, if set, is the text a
+**    command reads on stdin (from a here-document or string).
 */
 typedef struct Variable{
     char *name;
     char *value;
     struct Variable *next;
+    uint32_t hash;
+    uint32_t generation;
+    uint8_t exported;
 } Variable;
 
+typedef struct VarTable {
+    Variable **slots;
+    size_t cap;
+    size_t count;
+    Variable *head;
+    Variable *tail;
+    Variable *path;
+} VarTable;
+
+/*
+** Bump allocator that owns everything built for a single line
+** (see arena.c). allocs/bytes count the allocations served.
+*/
+typedef struct ArenaBlock ArenaBlock;
+
+typedef struct Arena {
+    ArenaBlock *head;
+    size_t total_cap;
+    size_t allocs;
+    size_t bytes;
+} Arena;
+
+/*
+** Totals over every arena (see arena.c): the allocations served and the
+** blocks malloc'd to serve them.
+*/
+typedef struct ArenaStats {
+    unsigned long allocs;
+    unsigned long bytes;
+    unsigned long blocks;
+    unsigned long block_bytes;
+} ArenaStats;
+
+extern ArenaStats arena_stats;
+
+/*
+** A lexed token: a span of the line it came from (see lex.c).
+** Word flags record whether the word needs expanding at all, and whether
+** that runs commands ($(...)). The span of a here-document (<<) is its
+** body, which follows the command.
+*/
+typedef enum TokenKind {
+    TOK_WORD,
+    TOK_PIPE,
+    TOK_REDIR_IN,
+    TOK_REDIR_OUT,
+    TOK_REDIR_APPEND,
+    TOK_BACKGROUND,
+    TOK_HEREDOC,
+    TOK_HERESTRING
+} TokenKind;
+
+#define TOKEN_QUOTED 0x1
+#define TOKEN_HAS_VAR 0x2
+#define TOKEN_HAS_SUBST 0x4
+
+typedef struct Token {
+    uint32_t start;
+    uint32_t len;
+    uint8_t kind;
+    uint8_t flags;
+} Token;
+
+/*
+** The variables a built line read, with the generation each had then,
+** so the line cache can tell when the line must be built again.
+*/
+typedef struct VarRef {
+    Variable *var;
+    uint32_t generation;
+} VarRef;
+
+typedef struct VarRefs {
+    VarRef *refs;
+    size_t count;
+    size_t cap;
+    Arena *arena;
+} VarRefs;
+
+/*
+** A script file split into lines and lexed up front (see script.c).
+** text is the line as written (the line cache key), lexed the copy its
+** tokens refer to and number its line in the file. When the script was
+** adopted from its compiled form (see bytecode.c), the lines point into
+** code instead; hash identifies the script's contents.
+*/
+typedef struct LexedLine {
+    const char *text;
+    char *lexed;
+    Token *tokens;
+    int count;
+    uint32_t number;
+} LexedLine;
+
+typedef struct Script {
+    char *data;
+    size_t data_len;
+    uint8_t mapped;
+    char *code;
+    size_t code_len;
+    uint64_t hash;
+    LexedLine *lines;
+    size_t nlines;
+    Arena arena;
+} Script;
+
+/*
+** Shell-wide settings chosen on the command line (see cscshell.c).
+**
+** spawn_mode picks how run_command starts children: fork + exec (the
+** default) or posix_spawn. pipe_size, if non-zero, is the capacity every
+** pipeline pipe is given, and relay routes each line's data through the
+** shell's splice relay (see relay.c). interactive is set when the shell
+** reads commands from the terminal, serving when it takes them from
+** clients (see server.c). max_jobs is the number of script
+** lines that may run at once (see schedule.c). pipefail and failfast are
+** the `set -o` options of the same names (see reap.c).
+*/
+typedef enum SpawnMode {
+    SPAWN_POSIX,
+    SPAWN_FORK
+} SpawnMode;
+
+typedef struct ShellOptions {
+    SpawnMode spawn_mode;
+    int pipe_size;
+    uint8_t relay;
+    uint8_t interactive;
+    uint8_t serving;
+    int max_jobs;
+    uint8_t pipefail;
+    uint8_t failfast;
+} ShellOptions;
+
+/*
+** How each stage of the last foreground line ended (see reap.c): its
+** exit code (128+N if it was killed by signal N), the signal if any,
+** whether the shell killed it after another stage failed, and the
+** resources it used.
+*/
+typedef struct StageStatus {
+    pid_t pid;
+    int code;
+    int signal;
+    uint8_t killed;
+    struct rusage usage;
+} StageStatus;
+
+typedef struct PipelineStatus {
+    StageStatus *stages;
+    int count;
+    int cap;
+} PipelineStatus;
+
+extern PipelineStatus pipeline_status;
+
+extern ShellOptions shell_options;
+
+/*
+** One connection of a line routed through the shell (see relay.c):
+** data read from src is spliced to dst. from and to name the two ends
+** for the throughput report.
+*/
+typedef struct Relay {
+    int src;
+    int dst;
+    const char *from;
+    const char *to;
+    uint64_t bytes;
+    double seconds;
+    uint8_t copy;
+} Relay;
+
+/*
+** A command run inside the shell rather than exec'd (see builtins.c).
+** func gets the command's arguments and returns its exit status. serial
+** builtins use or change the shell's own state, so a parallel script
+** never runs them alongside other lines.
+*/
+typedef int (*BuiltinFunc)(char **args, VarTable *variables);
+
+typedef struct Builtin {
+    const char *name;
+    BuiltinFunc func;
+    uint8_t serial;
+} Builtin;
+
 typedef struct Command {
+    const Builtin *builtin;
     char *exec_path;
     char **args;
     struct Command *next;
@@ -81,7 +340,9 @@ typedef struct Command {
     uint32_t stdout_fd;
     char *redir_in_path;
     char *redir_out_path;
+    char *here_doc;
     uint8_t redir_append;
+    uint8_t background;
 } Command;
 
 
@@ -110,20 +371,122 @@ typedef struct Command {
 **       -- or updated if the variable already exists
 **
 ** 3. If there is an error, returns -1 cast as a (Command *)
+**
+** The commands, their arguments and paths are all allocated from arena
+** and remain valid until it is reset.
+*/
+Command *parse_line(char *line, VarTable *variables, Arena *arena);
+
+/*
+** The two halves of parse_line.
+**
+** build_commands lexes, expands and resolves a line (in place) into a
+** command chain in arena, recording the variables it reads in refs (may be
+** NULL) and setting *assigned if it assigned any. It returns the same
+** values as parse_line, but opens no files.
+**
+** open_redirections then opens every redirection in the chain, returning
+** 0 on success or -1 (with any opened descriptors closed) on error.
+*/
+Command *build_commands(char *line, VarTable *variables, Arena *arena,
+                        VarRefs *refs, uint8_t *assigned);
+int open_redirections(Command *head);
+
+/*
+** The steps of build_commands after lexing. check_tokens checks the
+** shape of a lexed line without expanding anything, returning 0 or -1 on
+** a syntax error; build_tokens then builds a checked line's commands.
 */
-Command *parse_line(char *line, Variable **variables);
+int check_tokens(const char *line, const Token *tokens, int count);
+Command *build_tokens(char *line, const Token *tokens, int count,
+                      VarTable *variables, Arena *arena, VarRefs *refs,
+                      uint8_t *assigned);
+
+/*
+** Returns 1 if running line would assign a variable, 0 if not, or -1 if
+** it doesn't lex (the error has been reported). line is not modified.
+*/
+int line_assigns(const char *line, Arena *arena);
+
+/*
+** Assigns a NAME=VALUE word, expanding VALUE first (the value part of
+** build_commands). Returns 0 on success, 1 on error.
+*/
+int handle_variable_assignment(const char *word, VarTable *variables,
+                               Arena *arena);
+
+/*
+** parse_line without opening redirections: returns the commands for line
+** from the line cache, or builds them afresh.
+*/
+Command *build_line(const char *line, VarTable *variables, Arena *arena);
+
+/*
+** Parsed-line cache (see line_cache.c).
+**
+** line_cache_get returns a copy of the commands cached for line in arena,
+** or NULL if there are none or they are out of date. line_cache_build
+** builds a line with build_commands and caches the result if it can be
+** reused; line_cache_build_lexed does the same for a line lexed and
+** checked beforehand. clone_commands deep copies a chain (without descriptors), and
+** returns NULL on allocation failure.
+*/
+Command *line_cache_get(const char *line, Arena *arena);
+Command *line_cache_build(const char *line, VarTable *variables,
+                          Arena *arena);
+Command *line_cache_build_lexed(const char *line, char *lexed,
+                                const Token *tokens, int count,
+                                VarTable *variables, Arena *arena);
+Command *clone_commands(const Command *head, Arena *arena);
+int var_refs_add(VarRefs *refs, Variable *var);
+void line_cache_flush(void);
+void line_cache_counts(unsigned long *hits, unsigned long *misses);
+
+/*
+** Splits line into tokens in a single pass, NUL-terminating words in
+** place. The token array is allocated from arena. A line may go on past
+** its first newline with the bodies of the here-documents it opens.
+**
+** Returns the number of tokens, or -1 on a syntax error.
+**
+** heredoc_extent returns how much of the len bytes at text make up its
+** first line, bodies included, or -1 if a body isn't finished yet.
+**
+** subst_end returns the ')' closing the $( at p, skipping quotes and
+** nested substitutions, or NULL if limit comes first.
+*/
+int lex_line(char *line, Arena *arena, Token **tokens);
+long heredoc_extent(const char *text, size_t len, Arena *arena);
+const char *subst_end(const char *p, const char *limit);
+
+/*
+** Character classes for scan_until (see scan.c).
+*/
+#define SCAN_BLANK 0x1
+#define SCAN_OPERATOR 0x2
+#define SCAN_QUOTE 0x4
+#define SCAN_DOLLAR 0x8
+
+/*
+** Returns the offset of the first of the len bytes at p that belongs to
+** one of the SCAN_* classes, or len if there is none. Uses SSE2/AVX2 when
+** the CPU has them; setting CSCSHELL_SCAN=scalar or =sse2 in the
+** environment caps the implementation, for comparison.
+*/
+size_t scan_until(const char *p, size_t len, unsigned classes);
+unsigned char_class(char c);
 
 /*
 ** WARNING: this is a challenging string parsing task.
 **
-** Creates a new line on the heap with all named variable *usages*
-** replaced with their associated values.
+** Creates a new line in arena (or on the heap if arena is NULL) with all
+** named variable *usages* replaced with their associated values.
 **
 ** Returns NULL if replacement parsing had an error, or (char *) -1 if
 ** system calls fail and the shell needs to exit.
 */
 char *replace_variables_mk_line(const char *line,
-                                Variable *variables);
+                                VarTable *variables, Arena *arena);
 
 /*
 ** This function is provided for you and should not be modified.
@@ -135,58 +498,284 @@ char *replace_variables_mk_line(const char *line,
 int cd_cscshell(const char *target_dir);
 
 /*
-** This function is provided for you and should not be modified.
-**
 ** Determines the correct path of the executable for a particular command.
 **
 ** If PATH contains non-existent directories, it prints an error to stderr
 ** and ignores this directory.
 **
 ** Returns:
-** -- A heap string with the first working path to the command_name
-**    *if* it is not already a sort of path.
-** -- Otherwise the command_name is duplicated on the heap
+** -- A string in arena (or on the heap if arena is NULL) with the first
+**    working path to the command_name *if* it is not already a sort of path.
+** -- Otherwise the command_name is duplicated the same way
 ** -- NULL if no command could be found on the path,
 **    or an error occurred.
 */
-char *resolve_executable(const char *command_name, Variable *path);
+char *resolve_executable(const char *command_name, Variable *path,
+                         Arena *arena);
+
+/*
+** Command hash table used by resolve_executable (see exec_cache.c).
+**
+** exec_cache_get returns a path owned by the cache, or NULL on a miss.
+** exec_cache_flush must be called whenever PATH changes. A flush, and any
+** entry dropped or replaced, advances exec_cache_generation.
+** exec_cache_counts reports the hits and misses of every lookup so far.
+** exec_path_usable returns non-zero if path still names an executable
+** regular file.
+*/
+uint32_t fnv1a_hash(const char *str, size_t len);
+const char *exec_cache_get(const char *command_name);
+int exec_cache_put(const char *command_name, const char *exec_path);
+void exec_cache_flush(void);
+void exec_cache_counts(unsigned long *hits, unsigned long *misses);
+uint32_t exec_cache_generation(void);
+int exec_path_usable(const char *path);
+
+/*
+** Persistent, mmap'd index of the executables on a PATH (see exec_index.c),
+** shared by every shell instance through the cache directory.
+**
+** exec_index_lookup returns 1 and sets *exec_path if the command was
+** found, 0 if it is on no PATH directory, or -1 if no index could be used.
+*/
+int cache_dir_path(char *buf, size_t buflen);
+void cache_file_write(const char *file_path, const char *buf, size_t len);
+int exec_index_lookup(const char *command_name, const char *path_value,
+                      const char **exec_path);
+void exec_index_close(void);
+
+/*
+** Startup snapshot of the state an init file leaves behind (see
+** snapshot.c). snapshot_load adopts a fresh snapshot of init_file into
+** variables, returning 0, or returns -1 if there is none to use.
+** snapshot_save records variables as the result of running init_file.
+*/
+int snapshot_load(const char *init_file, VarTable *variables);
+void snapshot_save(const char *init_file, VarTable *variables);
+
+/*
+** Implements the `hash` builtin: lists remembered command locations
+** with hit/miss counts, or forgets them all with `hash -r`.
+**
+** Returns 0 on success, -1 on a usage error.
+*/
+int hash_cscshell(char **args);
 
 /*
 ** Executes a single "line" of commands (through pipes)
 ** If a command fails, the rest of the line should not be executed.
 **
-** The error code from the last command is returned through a pointer
-** to a heap integer on success. If the line is a `cd` command, the
-** return value of `cd_cscshell` is stored by the heap int.
+** The exit code of the line is returned through a pointer to a heap
+** integer on success: that of its last command, 128+N if it was killed
+** by signal N (but see `set -o pipefail`). If the line is a single
+** builtin command (see builtins.c), it runs in the shell and its return
+** value is the exit code. Either way PIPESTATUS is set to the exit code
+** of every stage.
 ** -- If there are no commands to execute, returns NULL
 ** -- If there were any errors starting any commands,
 **    returns (pointer value) -1
 */
-int *execute_line(Command *head);
+int *execute_line(Command *head, VarTable *variables);
+
+/*
+** Returns non-zero if the line head runs in the shell itself: a lone
+** builtin, unless its output is being captured and it changes the shell,
+** in which case it runs in a child as it would in a subshell.
+*/
+int runs_in_shell(const Command *head);
 
 /*
-** Forks a new process and execs the command
-** making sure all file descriptors are set up correctly.
+** Command substitution (see subst.c).
+**
+** While a $(...) runs its line, active_capture is where that line's
+** output goes: the read end of a pipe and the growing buffer it is read
+** into. run_line drains it with capture_read (0, or -1 on a read error)
+** once the stages have started, so they never block on a full pipe.
 **
-** Parent process returns -1 on error.
+** command_output runs the len bytes at text as a line and returns its
+** output on the heap, trailing newlines removed, or NULL on error.
+*/
+typedef struct Capture {
+    int fd;
+    char *buf;
+    size_t len;
+    size_t cap;
+} Capture;
+
+extern Capture *active_capture;
+int capture_read(Capture *capture);
+char *command_output(const char *text, size_t len, VarTable *variables);
+
+// Number of lines execute_line has been given commands to run
+extern unsigned long executed_lines;
+
+/*
+** Starts a new process running the command (with posix_spawn or
+** fork + exec, per shell_options.spawn_mode), making sure all file
+** descriptors are set up correctly.
+**
+** Returns the child's pid, or -1 on error.
 ** Any child processes should not return.
 */
-int run_command(Command *command);
+pid_t run_command(Command *command);
+
+/*
+** Script loading (see script.c). script_load maps file_path and lexes and
+** checks every line before anything runs, returning 0, or -1 (after
+** printing an error) if the file can't be read or has a syntax error.
+** script_build_line builds line i like build_line; script_free releases
+** the script.
+*/
+int script_load(const char *file_path, Script *script);
+Command *script_build_line(Script *script, size_t i, VarTable *variables,
+                           Arena *arena);
+void script_free(Script *script);
+
+/*
+** Compiled scripts (see bytecode.c), cached by the hash of their contents.
+**
+** bytecode_load adopts the compiled form of script's contents, returning
+** 0, or -1 if there is none. bytecode_save compiles a loaded script into
+** the cache. bytecode_path writes the cache file for a hash into buf.
+** compile_script loads (and so compiles) a script without running it and
+** prints where its compiled form is; bytecode_disassemble prints a
+** compiled file. Both return 0 on success, -1 on error.
+*/
+int bytecode_load(Script *script);
+void bytecode_save(const Script *script);
+int bytecode_path(uint64_t hash, char *buf, size_t buflen);
+int compile_script(const char *file_path);
+int bytecode_disassemble(const char *file_path);
+
+/*
+** Reaping foreground pipelines (see reap.c).
+**
+** wait_pipeline waits for the npids processes of a line, recording how
+** each ended in pipeline_status, and returns the line's exit code.
+** pipeline_status_set records a line that ran in the shell instead;
+** pipeline_status_export puts the recorded codes in PIPESTATUS.
+** exit_code turns a raw wait status into an exit code.
+*/
+int wait_pipeline(const pid_t *pids, int npids);
+int pipeline_status_set(int code);
+int pipeline_status_export(VarTable *variables);
+int exit_code(int status);
+
+/*
+** A line reaped alongside others instead (see reap.c and schedule.c).
+** line_reap_start sets reap up for the npids stages in pids (0, or -1),
+** line_reap_poll collects the stages that have exited and returns how
+** many are still running, line_reap_code is the finished line's exit
+** code and line_reap_publish makes it the last line for PIPESTATUS.
+*/
+typedef struct LineReap {
+    const pid_t *pids;
+    StageStatus *stages;
+    uint8_t *done;
+    int npids;
+    int running;
+    int failed;
+} LineReap;
+
+int line_reap_start(LineReap *reap, const pid_t *pids, int npids);
+int line_reap_poll(LineReap *reap);
+int line_reap_code(const LineReap *reap);
+int line_reap_publish(const LineReap *reap);
+void line_reap_free(LineReap *reap);
+
+/*
+** Execution timeline (see trace.c), recorded only once trace_open has
+** been called: test trace_on before taking a start time with trace_now.
+** trace_span records a span of the shell's own work ending now (status
+** is left out if negative); trace_child_start and trace_child_end record
+** the life of a child process from the time it was started, end taking
+** its raw wait status. Those two are called whether tracing or not, since
+** they also time children for the statistics below.
+*/
+extern uint8_t trace_on;
+int trace_open(const char *path);
+uint64_t trace_now(void);
+void trace_span(const char *name, uint64_t start, const char *detail,
+                int status);
+void trace_child_start(pid_t pid, uint64_t start, const char *argv0);
+void trace_child_end(pid_t pid, int status, const struct rusage *usage);
+
+/*
+** Statistics kept at all times (see stats.c): a latency histogram per
+** phase. stats_record adds the time since start (from trace_now) to
+** phase and returns the current time. stats_print writes every phase and
+** the cache and arena counters to out; stats_at_exit (--stats) has them
+** printed on stderr when the shell exits. stats_cscshell implements the
+** `stats` builtin, returning its exit status.
+*/
+typedef enum StatPhase {
+    STAT_PARSE,
+    STAT_EXPAND,
+    STAT_RESOLVE,
+    STAT_SPAWN,
+    STAT_CHILD,
+    STAT_LINE,
+    STAT_PHASES
+} StatPhase;
+
+uint64_t stats_record(StatPhase phase, uint64_t start);
+void stats_print(FILE *out);
+void stats_at_exit(void);
+int stats_cscshell(char **args);
 
 /*
 ** Executes an entire script line-by-line.
+** The whole script is loaded and checked first (see script_load), so a
+** syntax error stops it before any line has run.
 ** Stops and indicates an error as soon as any line fails.
 **
 ** Returns 0 on success, -1 on error
 */
-int run_script(char *file_path, Variable **root);
+int run_script(char *file_path, VarTable *variables);
+
+/*
+** Executes an entire script like run_script, but runs up to max_running
+** lines that don't depend on each other at once (see schedule.c).
+** Returns 0 on success, -1 on error.
+*/
+int run_script_parallel(char *file_path, VarTable *variables,
+                        int max_running);
+
+/*
+** Keeps the shell resident, running command lines sent by clients over
+** the Unix socket at socket_path (see server.c). Only returns, with -1,
+** on error.
+*/
+int run_server(const char *socket_path, VarTable *variables);
 
 /*
-** Implement the following function that frees all the
-** heap memory associated with a particular command.
+** Starts every stage of a line without waiting for them, storing their
+** pids in pids (one per stage). If relays is not NULL the stages are
+** connected through them, relay_count counting those used.
+**
+** Returns the number of processes started, or -1 on error.
+*/
+int start_pipeline(Command *head, VarTable *variables, pid_t *pids,
+                   Relay *relays, size_t *relay_count);
+int count_commands(Command *head);
+
+/*
+** Closes any redirection file descriptors still held by a command
+** chain. Its memory belongs to the line's arena.
  */
 void free_command(Command *command);
 
+/*
+** Arena operations (see arena.c). Allocation functions return NULL
+** on failure; the strdup variants fall back to the heap if arena is NULL.
+*/
+void arena_init(Arena *arena);
+void *arena_alloc(Arena *arena, size_t size);
+char *arena_strdup(Arena *arena, const char *str);
+char *arena_strndup(Arena *arena, const char *str, size_t len);
+void arena_reset(Arena *arena);
+void arena_free(Arena *arena);
+
 /*
 ** Implement the following function that frees variable(s).
 **
@@ -194,4 +783,98 @@ void free_command(Command *command);
 ** list starting at var, else just var.
  */
 void free_variable(Variable *var, uint8_t recursive);
+
+/*
+** Variable table operations (see variables.c).
+**
+** Names are given as a pointer and length so they can be looked up
+** directly inside a command line. var_set returns NULL on allocation
+** failure; assigning PATH flushes the executable cache.
+*/
+void var_table_init(VarTable *table);
+Variable *var_lookup(VarTable *table, const char *name, size_t len);
+Variable *var_set(VarTable *table, const char *name, size_t name_len,
+                  const char *value);
+void var_table_free(VarTable *table);
+
+/*
+** Marks var as exported and puts it in the environment, where every
+** later assignment to it is mirrored. Returns 0, or -1 on error.
+*/
+int var_export(Variable *var);
+
+/*
+** Pipes and the splice relay (see relay.c).
+**
+** make_pipe creates a close-on-exec pipe of shell_options.pipe_size.
+** relay_insert sets up a relay between a producer and a consumer fd,
+** creating pipes for the ends that aren't files. relay_run moves data
+** until every relay is finished; relay_close releases what relays still
+** hold and relay_report prints their throughput. The int functions
+** return 0 on success and -1 on error.
+*/
+int make_pipe(int fds[2]);
+int relay_insert(Relay *relay, int *from_fd, uint8_t from_is_file,
+                 int *to_fd, uint8_t to_is_file,
+                 const char *from, const char *to);
+void relay_run(Relay *relays, size_t count);
+void relay_close(Relay *relays, size_t count);
+void relay_report(const Relay *relays, size_t count);
+
+/*
+** Runs a line that is a lone cat copying files into a redirect file in
+** the shell itself, with copy_file_range/sendfile (see copy.c). Returns
+** cat's exit code, or -1 if the line has to be run the normal way.
+*/
+int copy_line(Command *head);
+
+/*
+** Background jobs (see jobs.c).
+**
+** jobs_init installs the SIGCHLD handler (0 on success, -1 on error).
+** job_add turns the pids of a line started with '&' into a job, taking
+** ownership of the array, and returns its number (-1 on error).
+** jobs_reap collects background processes that have exited; it is
+** cheap to call when none have. jobs_cscshell and wait_cscshell
+** implement the `jobs` and `wait` builtins and return their exit status.
+*/
+int jobs_init(void);
+int job_add(Command *head, pid_t *pids, int npids);
+void jobs_reap(void);
+int jobs_cscshell(char **args);
+int wait_cscshell(char **args);
+
+/*
+** Implements the `parallel` builtin, which runs a command template for
+** many items at once (see parallel.c). Returns the number of items that
+** failed (at most 101), or 2 on a usage error.
+*/
+int parallel_cscshell(char **args, VarTable *variables);
+
+/*
+** Writes everything in the memfd fd (a collected output) to stdout, from
+** its start, and closes it. Used by parallel and by parallel scripts.
+*/
+void output_write(int fd);
+
+/*
+** Builtin commands (see builtins.c).
+**
+** builtin_lookup returns the builtin called name, or NULL. builtin_run
+** runs a builtin command in the shell itself, with its redirections in
+** place, and returns its exit status (-1 if they could not be applied).
+** builtin_fork runs it in a child instead, as a pipeline stage, and
+** returns the child's pid or -1. builtin_child marks any other child
+** the shell runs builtins in, so that `exit` there ends only the child.
+*/
+const Builtin *builtin_lookup(const char *name);
+int builtin_run(Command *command, VarTable *variables);
+pid_t builtin_fork(Command *command, VarTable *variables);
+void builtin_child(void);
+
+/*
+** Implements the `set` builtin: prints all variables in the order
+** they were first assigned. Returns 0.
+*/
+int set_cscshell(VarTable *table);
 #endif
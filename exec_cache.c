@@ -0,0 +1,258 @@
+#include "cscshell.h"
+
+/*
+** Command hash table, in the spirit of bash's `hash`.
+**
+** Maps a bare command name to the full path resolve_executable() found
+** for it on the PATH. Entries are added on the first successful lookup and
+** validated on every hit by a single stat() of the cached path, so a
+** removed or replaced binary falls back to a full PATH scan. Assigning
+** PATH flushes the whole table. Every flush, and every entry dropped or
+** replaced, advances the generation the line cache checks its lines
+** against.
+**
+** The table uses open addressing with linear probing; removal is done by
+** backward-shift so no tombstones are needed.
+*/
+
+#define EXEC_CACHE_INIT_CAP 64
+
+typedef struct ExecEntry {
+    char *name;
+    char *path;
+    uint32_t hash;
+    uint32_t hits;
+} ExecEntry;
+
+static ExecEntry *cache_slots = NULL;
+static size_t cache_cap = 0;
+static size_t cache_count = 0;
+static unsigned long cache_hits = 0;
+static unsigned long cache_misses = 0;
+static uint32_t cache_generation = 0;
+
+
+uint32_t fnv1a_hash(const char *str, size_t len){
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < len; i++){
+        hash ^= (unsigned char) str[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+
+static int exec_cache_grow(void){
+    size_t new_cap = cache_cap ? cache_cap * 2 : EXEC_CACHE_INIT_CAP;
+    ExecEntry *new_slots = calloc(new_cap, sizeof(ExecEntry));
+    if (new_slots == NULL){
+        perror("exec_cache");
+        return -1;
+    }
+
+    for (size_t i = 0; i < cache_cap; i++){
+        if (cache_slots[i].name == NULL) continue;
+        size_t j = cache_slots[i].hash & (new_cap - 1);
+        while (new_slots[j].name != NULL){
+            j = (j + 1) & (new_cap - 1);
+        }
+        new_slots[j] = cache_slots[i];
+    }
+
+    free(cache_slots);
+    cache_slots = new_slots;
+    cache_cap = new_cap;
+    return 0;
+}
+
+
+static ExecEntry *exec_cache_find(const char *command_name, uint32_t hash){
+    if (cache_cap == 0) return NULL;
+
+    size_t i = hash & (cache_cap - 1);
+    while (cache_slots[i].name != NULL){
+        if (cache_slots[i].hash == hash &&
+            strcmp(cache_slots[i].name, command_name) == 0){
+            return &cache_slots[i];
+        }
+        i = (i + 1) & (cache_cap - 1);
+    }
+    return NULL;
+}
+
+
+static void exec_cache_remove(ExecEntry *entry){
+    size_t i = entry - cache_slots;
+    cache_generation++;
+    free(entry->name);
+    free(entry->path);
+    entry->name = NULL;
+    entry->path = NULL;
+    cache_count--;
+
+    // shift back any entries that probed past the hole we just made
+    size_t j = i;
+    for (;;){
+        j = (j + 1) & (cache_cap - 1);
+        if (cache_slots[j].name == NULL) break;
+
+        size_t home = cache_slots[j].hash & (cache_cap - 1);
+        if (((j - home) & (cache_cap - 1)) >= ((j - i) & (cache_cap - 1))){
+            cache_slots[i] = cache_slots[j];
+            cache_slots[j].name = NULL;
+            cache_slots[j].path = NULL;
+            i = j;
+        }
+    }
+}
+
+
+int exec_path_usable(const char *path){
+    struct stat st;
+    return stat(path, &st) == 0 && S_ISREG(st.st_mode) &&
+           (st.st_mode & (S_IXUSR | S_IXGRP | S_IXOTH));
+}
+
+
+/*
+** Returns the cached full path for command_name (owned by the cache),
+** or NULL on a miss. A hit is only returned if the path still names an
+** executable regular file.
+*/
+const char *exec_cache_get(const char *command_name){
+    uint32_t hash = fnv1a_hash(command_name, strlen(command_name));
+    ExecEntry *entry = exec_cache_find(command_name, hash);
+    if (entry == NULL){
+        cache_misses++;
+        return NULL;
+    }
+
+    if (!exec_path_usable(entry->path)){
+        exec_cache_remove(entry);
+        cache_misses++;
+        return NULL;
+    }
+
+    entry->hits++;
+    cache_hits++;
+    return entry->path;
+}
+
+
+void exec_cache_counts(unsigned long *hits, unsigned long *misses){
+    *hits = cache_hits;
+    *misses = cache_misses;
+}
+
+
+/*
+** Records exec_path as the resolution of command_name.
+**
+** Returns 0 on success, -1 if memory could not be allocated (the
+** lookup itself is still valid, it just won't be cached).
+*/
+int exec_cache_put(const char *command_name, const char *exec_path){
+    uint32_t hash = fnv1a_hash(command_name, strlen(command_name));
+    ExecEntry *entry = exec_cache_find(command_name, hash);
+    if (entry != NULL){
+        char *path = strdup(exec_path);
+        if (path == NULL){
+            perror("exec_cache");
+            return -1;
+        }
+        if (strcmp(entry->path, path) != 0) cache_generation++;
+        free(entry->path);
+        entry->path = path;
+        return 0;
+    }
+
+    // keep the load factor under 3/4
+    if ((cache_count + 1) * 4 > cache_cap * 3 && exec_cache_grow() < 0){
+        return -1;
+    }
+
+    char *name = strdup(command_name);
+    char *path = strdup(exec_path);
+    if (name == NULL || path == NULL){
+        perror("exec_cache");
+        free(name);
+        free(path);
+        return -1;
+    }
+
+    size_t i = hash & (cache_cap - 1);
+    while (cache_slots[i].name != NULL){
+        i = (i + 1) & (cache_cap - 1);
+    }
+    cache_slots[i].name = name;
+    cache_slots[i].path = path;
+    cache_slots[i].hash = hash;
+    cache_slots[i].hits = 0;
+    cache_count++;
+    return 0;
+}
+
+
+/*
+** Forgets every remembered location. Called whenever PATH is assigned.
+*/
+void exec_cache_flush(void){
+    cache_generation++;
+    for (size_t i = 0; i < cache_cap; i++){
+        free(cache_slots[i].name);
+        free(cache_slots[i].path);
+    }
+    free(cache_slots);
+    cache_slots = NULL;
+    cache_cap = 0;
+    cache_count = 0;
+}
+
+
+/*
+** Returns a counter that changes every time the table is flushed, so
+** anything derived from earlier lookups can tell it is out of date.
+*/
+uint32_t exec_cache_generation(void){
+    return cache_generation;
+}
+
+
+/*
+** Implements the `hash` builtin.
+**
+**   hash       list remembered commands with their hit counts, and
+**              the hit/miss counts of the parsed-line cache
+**   hash -r    forget all remembered locations (which also retires
+**              every cached line)
+**
+** Returns 0 on success, -1 on a usage error.
+*/
+int hash_cscshell(char **args){
+    if (args[1] != NULL){
+        if (strcmp(args[1], "-r") == 0 && args[2] == NULL){
+            exec_cache_flush();
+            return 0;
+        }
+        ERR_PRINT(ERR_HASH_USAGE);
+        return -1;
+    }
+
+    if (cache_count == 0){
+        printf("hash: hash table empty\n");
+    }
+    else {
+        printf("hits\tcommand\n");
+        for (size_t i = 0; i < cache_cap; i++){
+            if (cache_slots[i].name == NULL) continue;
+            printf("%4u\t%s\n", cache_slots[i].hits, cache_slots[i].path);
+        }
+    }
+    printf("lookups: %lu hits, %lu misses\n", cache_hits, cache_misses);
+
+    unsigned long line_hits, line_misses;
+    line_cache_counts(&line_hits, &line_misses);
+    printf("parsed lines: %lu hits, %lu misses\n", line_hits, line_misses);
+    fflush(stdout);
+    return 0;
+}
@@ -0,0 +1,499 @@
+#include "cscshell.h"
+#include <sys/mman.h>
+
+/*
+** Persistent executable index shared by every shell using the same PATH.
+**
+** Each index file lives under $XDG_CACHE_HOME/cscshell (or ~/.cache/cscshell)
+** and maps every name found in the PATH directories to its full path, first
+** directory winning, exactly as resolve_executable's scan would. The file is
+** stamped with the mtime of each PATH directory and opened read-only with
+** mmap, so a fresh shell resolves a command with a few stat()s (once) and a
+** single hashed probe instead of readdir'ing the whole PATH.
+**
+** A stale or missing index is rebuilt into a temporary file and rename()d
+** into place, so concurrent shells never observe a partial file. If the
+** cache directory isn't writable the freshly built index is used from memory.
+**
+** Layout (native endian, all offsets from the start of the file):
+**
+**   IndexHeader | IndexDir[ndirs] | IndexSlot[nslots] | strings...
+*/
+
+#define INDEX_MAGIC "CSCX"
+#define INDEX_VERSION 1
+
+typedef struct IndexHeader {
+    char magic[4];
+    uint32_t version;
+    uint32_t size;
+    uint32_t path_off;
+    uint32_t ndirs;
+    uint32_t nslots;
+} IndexHeader;
+
+typedef struct IndexDir {
+    uint32_t dir_off;
+    uint32_t present;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+} IndexDir;
+
+// name_off == 0 marks an empty slot; offset 0 is always the header
+typedef struct IndexSlot {
+    uint32_t hash;
+    uint32_t name_off;
+    uint32_t path_off;
+} IndexSlot;
+
+typedef struct IndexBuild {
+    char *buf;
+    size_t len;
+    size_t cap;
+} IndexBuild;
+
+static const char *index_base = NULL;
+static size_t index_len = 0;
+static uint8_t index_mapped = 0;
+
+
+static const IndexHeader *index_header(void){
+    return (const IndexHeader *) index_base;
+}
+
+static const IndexDir *index_dirs(void){
+    return (const IndexDir *) (index_base + sizeof(IndexHeader));
+}
+
+static const IndexSlot *index_slots(void){
+    return (const IndexSlot *) (index_base + sizeof(IndexHeader) +
+        index_header()->ndirs * sizeof(IndexDir));
+}
+
+
+void exec_index_close(void){
+    if (index_base == NULL) return;
+    if (index_mapped){
+        munmap((void *) index_base, index_len);
+    }
+    else {
+        free((void *) index_base);
+    }
+    index_base = NULL;
+    index_len = 0;
+}
+
+
+/*
+** Writes the cache directory for shell-wide data into buf (creating it if
+** needed). Returns 0 on success, -1 if there is no usable directory.
+*/
+int cache_dir_path(char *buf, size_t buflen){
+    const char *xdg = getenv("XDG_CACHE_HOME");
+    const char *home = getenv("HOME");
+    int len;
+    if (xdg != NULL && xdg[0] == '/'){
+        len = snprintf(buf, buflen, "%s", xdg);
+    }
+    else if (home != NULL){
+        len = snprintf(buf, buflen, "%s/.cache", home);
+    }
+    else {
+        return -1;
+    }
+    if (len < 0 || (size_t) len >= buflen) return -1;
+    mkdir(buf, 0755);
+
+    if (snprintf(buf + len, buflen - len, "/%s", CACHE_DIR_NAME) >=
+        (int) (buflen - len)){
+        return -1;
+    }
+    if (mkdir(buf, 0755) < 0 && errno != EEXIST) return -1;
+    return 0;
+}
+
+
+static int index_file_path(const char *path_value, char *buf, size_t buflen){
+    char dir[MAX_PATH_STR];
+    if (cache_dir_path(dir, sizeof(dir)) < 0) return -1;
+
+    uint32_t hash = fnv1a_hash(path_value, strlen(path_value));
+    if (snprintf(buf, buflen, "%s/exec-%08x.idx", dir, hash) >= (int) buflen){
+        return -1;
+    }
+    return 0;
+}
+
+
+/*
+** Returns 1 if every PATH directory still has the mtime it was stamped
+** with, 0 otherwise.
+*/
+static int index_is_fresh(void){
+    const IndexDir *dirs = index_dirs();
+    for (uint32_t i = 0; i < index_header()->ndirs; i++){
+        struct stat st;
+        int present = stat(index_base + dirs[i].dir_off, &st) == 0;
+        if (present != (int) dirs[i].present) return 0;
+        if (present && (st.st_mtim.tv_sec != dirs[i].mtime_sec ||
+                        st.st_mtim.tv_nsec != dirs[i].mtime_nsec)){
+            return 0;
+        }
+    }
+    return 1;
+}
+
+
+/*
+** Returns 1 if the len bytes at header hold a well-formed index for
+** path_value: every table lies inside the file, nslots is a power of two
+** with at least one empty slot (so a probe always ends) and every offset
+** points at a terminated string. A corrupt file is simply rebuilt.
+*/
+static int index_matches(const IndexHeader *header, size_t len,
+                         const char *path_value){
+    const char *base = (const char *) header;
+    if (len < sizeof(IndexHeader) ||
+        memcmp(header->magic, INDEX_MAGIC, 4) != 0 ||
+        header->version != INDEX_VERSION ||
+        header->size != len || base[len - 1] != '\0' ||
+        header->nslots == 0 || (header->nslots & (header->nslots - 1)) != 0){
+        return 0;
+    }
+    size_t tables = sizeof(IndexHeader) +
+        (size_t) header->ndirs * sizeof(IndexDir) +
+        (size_t) header->nslots * sizeof(IndexSlot);
+    if (tables > len || header->path_off < tables || header->path_off >= len){
+        return 0;
+    }
+
+    const IndexDir *dirs = (const IndexDir *) (base + sizeof(IndexHeader));
+    for (uint32_t i = 0; i < header->ndirs; i++){
+        if (dirs[i].dir_off < tables || dirs[i].dir_off >= len) return 0;
+    }
+    const IndexSlot *slots = (const IndexSlot *) (dirs + header->ndirs);
+    uint8_t has_empty = 0;
+    for (uint32_t i = 0; i < header->nslots; i++){
+        if (slots[i].name_off == 0){
+            has_empty = 1;
+            continue;
+        }
+        if (slots[i].name_off < tables || slots[i].name_off >= len ||
+            slots[i].path_off < tables || slots[i].path_off >= len){
+            return 0;
+        }
+    }
+    return has_empty && strcmp(base + header->path_off, path_value) == 0;
+}
+
+
+/*
+** Maps an existing index file for path_value. Returns 0 if a valid and
+** fresh index is now open, -1 otherwise.
+*/
+static int index_map(const char *file_path, const char *path_value){
+    int fd = open(file_path, O_RDONLY);
+    if (fd < 0) return -1;
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t) st.st_size < sizeof(IndexHeader)){
+        close(fd);
+        return -1;
+    }
+
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return -1;
+
+    if (!index_matches(map, st.st_size, path_value)){
+        munmap(map, st.st_size);
+        return -1;
+    }
+
+    index_base = map;
+    index_len = st.st_size;
+    index_mapped = 1;
+    if (!index_is_fresh()){
+        exec_index_close();
+        return -1;
+    }
+    return 0;
+}
+
+
+static uint32_t build_reserve(IndexBuild *build, size_t len){
+    if (build->len + len > build->cap){
+        size_t new_cap = build->cap ? build->cap : 4096;
+        while (build->len + len > new_cap) new_cap *= 2;
+        char *new_buf = realloc(build->buf, new_cap);
+        if (new_buf == NULL){
+            perror("exec_index");
+            return 0;
+        }
+        build->buf = new_buf;
+        build->cap = new_cap;
+    }
+    uint32_t off = build->len;
+    memset(build->buf + off, 0, len);
+    build->len += len;
+    return off;
+}
+
+
+static uint32_t build_string(IndexBuild *build, const char *str,
+                             const char *suffix){
+    size_t len = strlen(str);
+    size_t suffix_len = suffix ? strlen(suffix) : 0;
+    uint8_t slash = suffix && len > 0 && str[len - 1] != '/';
+    uint32_t off = build_reserve(build, len + slash + suffix_len + 1);
+    if (off == 0) return 0;
+
+    memcpy(build->buf + off, str, len);
+    if (slash) build->buf[off + len] = '/';
+    if (suffix) memcpy(build->buf + off + len + slash, suffix, suffix_len);
+    return off;
+}
+
+
+/*
+** Scans every PATH directory once and lays out a complete index in
+** memory. Returns the index buffer (with its size in *len), or NULL.
+*/
+static char *index_build(const char *path_value, size_t *len){
+    char *dirs_copy = strdup(path_value);
+    if (dirs_copy == NULL){
+        perror("exec_index");
+        return NULL;
+    }
+
+    // pass 1: count directories and candidate names to size the index
+    uint32_t ndirs = 0;
+    size_t nnames = 0;
+    char *saveptr;
+    for (char *dir_path = strtok_r(dirs_copy, ":", &saveptr); dir_path;
+         dir_path = strtok_r(NULL, ":", &saveptr)){
+        ndirs++;
+        DIR *dir = opendir(dir_path);
+        if (dir == NULL) continue;
+        while (readdir(dir) != NULL) nnames++;
+        closedir(dir);
+    }
+    uint32_t nslots = 16;
+    while (nslots < nnames * 2) nslots *= 2;
+
+    IndexBuild build = {NULL, 0, 0};
+    build_reserve(&build, sizeof(IndexHeader) + ndirs * sizeof(IndexDir) +
+                  nslots * sizeof(IndexSlot));
+    if (build.buf == NULL){
+        free(dirs_copy);
+        return NULL;
+    }
+    uint32_t path_off = build_string(&build, path_value, NULL);
+
+    // pass 2: stamp each directory, then record first-seen names
+    strcpy(dirs_copy, path_value);
+    uint32_t dir_i = 0;
+    uint32_t used = 0;
+    for (char *dir_path = strtok_r(dirs_copy, ":", &saveptr); dir_path;
+         dir_path = strtok_r(NULL, ":", &saveptr), dir_i++){
+        uint32_t dir_off = build_string(&build, dir_path, NULL);
+        if (dir_off == 0) goto build_fail;
+
+        struct stat st;
+        IndexDir stamp = {dir_off, 0, 0, 0};
+        if (stat(dir_path, &st) == 0){
+            stamp.present = 1;
+            stamp.mtime_sec = st.st_mtim.tv_sec;
+            stamp.mtime_nsec = st.st_mtim.tv_nsec;
+        }
+        memcpy(build.buf + sizeof(IndexHeader) + dir_i * sizeof(IndexDir),
+               &stamp, sizeof(stamp));
+
+        DIR *dir = stamp.present ? opendir(dir_path) : NULL;
+        if (dir == NULL){
+            ERR_PRINT(ERR_BAD_PATH, dir_path);
+            continue;
+        }
+
+        struct dirent *entry;
+        while ((entry = readdir(dir)) != NULL){
+            if (strcmp(entry->d_name, ".") == 0 ||
+                strcmp(entry->d_name, "..") == 0){
+                continue;
+            }
+
+            uint32_t hash = fnv1a_hash(entry->d_name, strlen(entry->d_name));
+            size_t slots_off = sizeof(IndexHeader) + ndirs * sizeof(IndexDir);
+            uint32_t i = hash & (nslots - 1);
+            uint8_t seen = 0;
+            for (;;){
+                IndexSlot *slot = (IndexSlot *) (build.buf + slots_off) + i;
+                if (slot->name_off == 0) break;
+                if (slot->hash == hash &&
+                    strcmp(build.buf + slot->name_off, entry->d_name) == 0){
+                    seen = 1;
+                    break;
+                }
+                i = (i + 1) & (nslots - 1);
+            }
+            // earlier PATH directories win, like the linear scan
+            if (seen) continue;
+
+            // a directory that grew since pass 1 must not fill the table,
+            // or probes would never end; the caller scans PATH instead
+            if (++used == nslots){
+                closedir(dir);
+                goto build_fail;
+            }
+
+            uint32_t full_off = build_string(&build, dir_path, entry->d_name);
+            if (full_off == 0){
+                closedir(dir);
+                goto build_fail;
+            }
+            // the name is the tail of the full path
+            uint32_t name_off = full_off + strlen(build.buf + full_off) -
+                strlen(entry->d_name);
+
+            IndexSlot *slot = (IndexSlot *) (build.buf + slots_off) + i;
+            slot->hash = hash;
+            slot->name_off = name_off;
+            slot->path_off = full_off;
+        }
+        closedir(dir);
+    }
+    free(dirs_copy);
+
+    IndexHeader *header = (IndexHeader *) build.buf;
+    memcpy(header->magic, INDEX_MAGIC, 4);
+    header->version = INDEX_VERSION;
+    header->size = build.len;
+    header->path_off = path_off;
+    header->ndirs = ndirs;
+    header->nslots = nslots;
+
+    *len = build.len;
+    return build.buf;
+
+build_fail:
+    free(dirs_copy);
+    free(build.buf);
+    return NULL;
+}
+
+
+/*
+** Atomically replaces a file in the cache directory with buf. Failure is
+** not an error: the data simply won't be shared with other shells.
+*/
+void cache_file_write(const char *file_path, const char *buf, size_t len){
+    char tmp_path[MAX_PATH_STR];
+    if (snprintf(tmp_path, sizeof(tmp_path), "%s.%d.tmp", file_path,
+                 (int) getpid()) >= (int) sizeof(tmp_path)){
+        return;
+    }
+
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return;
+
+    size_t written = 0;
+    while (written < len){
+        ssize_t n = write(fd, buf + written, len - written);
+        if (n < 0){
+            if (errno == EINTR) continue;
+            break;
+        }
+        written += n;
+    }
+
+    if (close(fd) < 0 || written != len || rename(tmp_path, file_path) < 0){
+        unlink(tmp_path);
+    }
+}
+
+
+/*
+** Ensures an index for path_value is open, mapping the on-disk one or
+** rebuilding it. Returns 0 on success, -1 if no index can be used.
+*/
+static int index_open(const char *path_value){
+    if (index_base != NULL){
+        if (strcmp(index_base + index_header()->path_off, path_value) == 0){
+            return 0;
+        }
+        exec_index_close();
+    }
+
+    // relative PATH entries depend on the cwd, so they can't be indexed
+    const char *entry = path_value;
+    while (entry != NULL){
+        if (*entry != '/') return -1;
+        entry = strchr(entry, ':');
+        if (entry) entry++;
+    }
+
+    char file_path[MAX_PATH_STR];
+    uint8_t have_file = index_file_path(path_value, file_path,
+                                        sizeof(file_path)) == 0;
+    if (have_file && index_map(file_path, path_value) == 0){
+        return 0;
+    }
+
+    size_t len;
+    char *buf = index_build(path_value, &len);
+    if (buf == NULL) return -1;
+    if (have_file){
+        cache_file_write(file_path, buf, len);
+    }
+
+    index_base = buf;
+    index_len = len;
+    index_mapped = 0;
+    return 0;
+}
+
+
+static const char *index_probe(const char *command_name){
+    const IndexSlot *slots = index_slots();
+    uint32_t nslots = index_header()->nslots;
+    uint32_t hash = fnv1a_hash(command_name, strlen(command_name));
+
+    for (uint32_t i = hash & (nslots - 1); slots[i].name_off != 0;
+         i = (i + 1) & (nslots - 1)){
+        if (slots[i].hash == hash &&
+            strcmp(index_base + slots[i].name_off, command_name) == 0){
+            return index_base + slots[i].path_off;
+        }
+    }
+    return NULL;
+}
+
+
+/*
+** Looks command_name up in the persistent index for path_value.
+**
+** Returns:
+** --  1 with *exec_path set (owned by the index) if the command was found
+** --  0 if the index is fresh and the command is on no PATH directory
+** -- -1 if no index is available, or its entry is no longer executable,
+**    and the caller must scan PATH itself
+*/
+int exec_index_lookup(const char *command_name, const char *path_value,
+                      const char **exec_path){
+    if (index_open(path_value) < 0) return -1;
+
+    *exec_path = index_probe(command_name);
+    if (*exec_path != NULL && exec_path_usable(*exec_path)) return 1;
+
+    // a negative answer is only trusted after re-checking the stamps,
+    // since a directory may have gained the command since we opened it
+    if (*exec_path == NULL && index_is_fresh()) return 0;
+
+    // a hit that has gone away, or a stale index, means a rebuild; if the
+    // hit is still unusable after that, the caller's scan has the last word
+    exec_index_close();
+    if (index_open(path_value) < 0) return -1;
+    *exec_path = index_probe(command_name);
+    if (*exec_path == NULL) return 0;
+    return exec_path_usable(*exec_path) ? 1 : -1;
+}
@@ -0,0 +1,273 @@
+#include "cscshell.h"
+#include <signal.h>
+
+/*
+** Background jobs.
+**
+** A line ending in '&' is started like any other, but instead of waiting
+** for it execute_line hands its pids to job_add() and moves on. Every job
+** stays in the table below until it has finished and been reported (as
+** soon as it finishes in an interactive shell, by `jobs` in a script) or
+** waited for.
+**
+** Finished children are noticed asynchronously: a SIGCHLD handler only
+** raises a flag, and jobs_reap() (called between lines, and by the
+** `jobs` and `wait` builtins) collects whatever has exited with
+** non-blocking waitpid()s on the job pids. Only job pids are ever waited
+** on here, so foreground pipelines keep reaping their own children.
+**
+** A job keeps the pids it was started with for `wait PID`, which a script
+** gets from $! (the last pid of the latest job, set by execute_line).
+*/
+
+#define JOBS_INIT_CAP 16
+
+typedef struct Job {
+    int id;
+    char *text;
+    pid_t *pids;
+    uint8_t *reaped;
+    int npids;
+    int running;
+    int status;
+} Job;
+
+static Job **jobs = NULL;
+static size_t jobs_count = 0;
+static size_t jobs_cap = 0;
+static volatile sig_atomic_t child_exited = 0;
+
+
+static void on_sigchld(int sig){
+    (void) sig;
+    child_exited = 1;
+}
+
+
+/*
+** Installs the SIGCHLD handler. Returns 0 on success, -1 on error.
+*/
+int jobs_init(void){
+    struct sigaction action = {0};
+    action.sa_handler = on_sigchld;
+    action.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+    sigemptyset(&action.sa_mask);
+    if (sigaction(SIGCHLD, &action, NULL) < 0){
+        perror("sigaction");
+        return -1;
+    }
+    return 0;
+}
+
+
+// Joins the commands of a line back into text for the job listing.
+static char *job_text(Command *head){
+    size_t len = 1;
+    for (Command *command = head; command != NULL; command = command->next){
+        for (int i = 0; command->args[i] != NULL; i++){
+            len += strlen(command->args[i]) + 1;
+        }
+        len += 3;
+    }
+
+    char *text = malloc(len);
+    if (text == NULL) return NULL;
+    char *p = text;
+    for (Command *command = head; command != NULL; command = command->next){
+        if (command != head) p += sprintf(p, "| ");
+        for (int i = 0; command->args[i] != NULL; i++){
+            p += sprintf(p, "%s ", command->args[i]);
+        }
+    }
+    p[p > text ? -1 : 0] = '\0';
+    return text;
+}
+
+
+/*
+** Records the pids of a line started in the background as a new job,
+** taking ownership of the pids array, and prints its number and last pid.
+**
+** Returns the job number, or -1 if memory could not be allocated (the
+** processes keep running, they just aren't tracked).
+*/
+int job_add(Command *head, pid_t *pids, int npids){
+    if (jobs_count == jobs_cap){
+        size_t new_cap = jobs_cap ? jobs_cap * 2 : JOBS_INIT_CAP;
+        Job **grown = realloc(jobs, new_cap * sizeof(Job *));
+        if (grown == NULL){
+            perror("job_add");
+            free(pids);
+            return -1;
+        }
+        jobs = grown;
+        jobs_cap = new_cap;
+    }
+
+    Job *job = malloc(sizeof(Job));
+    if (job == NULL || (job->text = job_text(head)) == NULL){
+        perror("job_add");
+        free(job);
+        free(pids);
+        return -1;
+    }
+    // pids stays as started, so `wait PID` still finds a finished job
+    job->reaped = calloc(npids, sizeof(uint8_t));
+    if (job->reaped == NULL){
+        perror("job_add");
+        free(job->text);
+        free(job);
+        free(pids);
+        return -1;
+    }
+    // numbers restart once every earlier job is gone
+    job->id = jobs_count ? jobs[jobs_count - 1]->id + 1 : 1;
+    job->pids = pids;
+    job->npids = npids;
+    job->running = npids;
+    job->status = 0;
+    jobs[jobs_count++] = job;
+
+    if (shell_options.interactive){
+        printf("[%d] %d\n", job->id, (int) pids[npids - 1]);
+        fflush(stdout);
+    }
+    return job->id;
+}
+
+
+/*
+** Collects the given pid of job if it has finished, blocking until it
+** does if block is set. The job's status is that of its last process.
+*/
+static void job_reap_pid(Job *job, int i, int block){
+    int status;
+    if (job->reaped[i]) return;
+
+    pid_t ret;
+    do {
+        ret = waitpid(job->pids[i], &status, block ? 0 : WNOHANG);
+    } while (ret < 0 && errno == EINTR && block);
+    if (ret == 0 || (ret < 0 && errno == EINTR)) return;
+    if (ret > 0) trace_child_end(ret, status, NULL);
+    if (ret > 0 && i == job->npids - 1){
+        job->status = exit_code(status);
+    }
+    job->reaped[i] = 1;
+    job->running--;
+}
+
+
+static void job_free(size_t index){
+    free(jobs[index]->text);
+    free(jobs[index]->pids);
+    free(jobs[index]->reaped);
+    free(jobs[index]);
+    memmove(&jobs[index], &jobs[index + 1],
+            (jobs_count - index - 1) * sizeof(Job *));
+    jobs_count--;
+}
+
+
+/*
+** Collects every background process that has exited since the last call.
+** Finished jobs are announced (in an interactive shell) and dropped.
+*/
+void jobs_reap(void){
+    if (!child_exited) return;
+    child_exited = 0;
+
+    for (size_t j = 0; j < jobs_count; ){
+        Job *job = jobs[j];
+        for (int i = 0; i < job->npids; i++){
+            job_reap_pid(job, i, 0);
+        }
+        // a script may still wait for it and get its status
+        if (job->running > 0 || !shell_options.interactive){
+            j++;
+            continue;
+        }
+        printf(JOB_DONE_FORMAT, job->id, job->status, job->text);
+        job_free(j);
+    }
+    fflush(stdout);
+}
+
+
+/*
+** Implements the `jobs` builtin: lists the background jobs. Jobs that
+** are reported as done are forgotten.
+*/
+int jobs_cscshell(char **args){
+    (void) args;
+    child_exited = 1;
+    jobs_reap();
+    for (size_t j = 0; j < jobs_count; ){
+        if (jobs[j]->running > 0){
+            printf("[%d] Running\t%s\n", jobs[j]->id, jobs[j]->text);
+            j++;
+            continue;
+        }
+        printf(JOB_DONE_FORMAT, jobs[j]->id, jobs[j]->status, jobs[j]->text);
+        job_free(j);
+    }
+    fflush(stdout);
+    return 0;
+}
+
+
+// Returns non-zero if job has number id, or a process with pid id.
+static int job_matches(const Job *job, long id, uint8_t by_pid){
+    if (!by_pid) return job->id == id;
+    for (int i = 0; i < job->npids; i++){
+        if (job->pids[i] == id) return 1;
+    }
+    return 0;
+}
+
+
+/*
+** Implements the `wait` builtin.
+**
+**   wait           wait for every background job
+**   wait PID|%N... wait for the jobs with the given pids or numbers
+**
+** Returns the exit status of the last job waited for (0 if none),
+** or 127 if a job does not exist.
+*/
+int wait_cscshell(char **args){
+    int ret = 0;
+
+    if (args[1] == NULL){
+        while (jobs_count > 0){
+            for (int i = 0; i < jobs[0]->npids; i++){
+                job_reap_pid(jobs[0], i, 1);
+            }
+            ret = jobs[0]->status;
+            job_free(0);
+        }
+        return ret;
+    }
+
+    for (int a = 1; args[a] != NULL; a++){
+        uint8_t by_pid = args[a][0] != '%';
+        const char *spec = by_pid ? args[a] : args[a] + 1;
+        char *end;
+        long id = strtol(spec, &end, 10);
+
+        size_t j = 0;
+        while (j < jobs_count && !job_matches(jobs[j], id, by_pid)) j++;
+        if (*end != '\0' || end == spec || j == jobs_count){
+            ERR_PRINT(ERR_NO_JOB, args[a]);
+            ret = 127;
+            continue;
+        }
+
+        for (int i = 0; i < jobs[j]->npids; i++){
+            job_reap_pid(jobs[j], i, 1);
+        }
+        ret = jobs[j]->status;
+        job_free(j);
+    }
+    return ret;
+}
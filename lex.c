@@ -0,0 +1,313 @@
+#include "cscshell.h"
+
+/*
+** Single-pass lexer for a command line.
+**
+** Splits a line into words and operators in one scan, recording each
+** token as an (offset, length) span over the line itself rather than
+** copying it. Quotes are recognised as part of words ('...' is literal,
+** "..." still allows $ expansion) and an unquoted '#' at the start of a
+** word begins a comment that runs to the end of the line.
+**
+** Each word is flagged if it contains quotes or variable usages; only
+** such words ever need to be materialized into a new string. A command
+** substitution, $(...), is part of the word it appears in, blanks,
+** operators and quotes inside it included, and flags the word as one
+** that runs commands when it is expanded. After the
+** scan every word is NUL-terminated in place (the byte after a word is
+** always a blank, an operator or the end of the line, all of which are
+** already recorded), so a plain word can be used directly as an argument.
+**
+** Words are scanned a block at a time with scan_until (see scan.c).
+**
+** A line may carry here-documents: the command is its first line, and
+** each << in it takes the lines after, up to one that is exactly its
+** delimiter, as its body. The << token is given the body's span (NUL
+** terminated in place, newlines kept), and flagged if the body has
+** variables to expand, which it only may if the delimiter is unquoted.
+*/
+
+#define LEX_INIT_TOKENS 16
+// set by lex_word when it stops at an unterminated $(, never kept
+#define LEX_OPEN_SUBST 0x80
+
+
+/*
+** Returns the ')' that closes the command substitution whose "$(" is at
+** p, skipping quoted text and nested substitutions, or NULL if limit
+** comes first.
+*/
+const char *subst_end(const char *p, const char *limit){
+    for (p += 2; p < limit; p++){
+        if (*p == ')') return p;
+        if (*p == VARIABLE_PARSE_MARKER && p + 1 < limit && p[1] == '('){
+            p = subst_end(p, limit);
+            if (p == NULL) return NULL;
+        }
+        else if (*p == '\'' || *p == '"'){
+            char quote = *p++;
+            for (; p < limit && *p != quote; p++){
+                if (quote == '"' && *p == VARIABLE_PARSE_MARKER &&
+                    p + 1 < limit && p[1] == '('){
+                    p = subst_end(p, limit);
+                    if (p == NULL) return NULL;
+                }
+            }
+            if (p == limit) return NULL;
+        }
+    }
+    return NULL;
+}
+
+
+/*
+** Skips the command substitution whose $( is at p, flagging the word.
+** Returns a pointer just past its ')', or NULL if it is unterminated.
+*/
+static const char *lex_subst(const char *p, const char *end, uint8_t *flags){
+    const char *close = subst_end(p, end);
+    if (close == NULL){
+        *flags |= LEX_OPEN_SUBST;
+        return NULL;
+    }
+    *flags |= TOKEN_HAS_VAR | TOKEN_HAS_SUBST;
+    return close + 1;
+}
+
+
+/*
+** Scans the word starting at p (and ending by end at the latest),
+** returning a pointer just past it and setting its flags, or NULL if a
+** quote or command substitution is left unterminated. Literal runs are
+** skipped with scan_until.
+*/
+static const char *lex_word(const char *p, const char *end, uint8_t *flags){
+    for (;;){
+        p += scan_until(p, end - p,
+                        SCAN_BLANK | SCAN_OPERATOR | SCAN_QUOTE | SCAN_DOLLAR);
+        if (p == end) return p;
+
+        if (*p == VARIABLE_PARSE_MARKER && p + 1 < end && p[1] == '('){
+            p = lex_subst(p, end, flags);
+            if (p == NULL) return NULL;
+        }
+        else if (*p == VARIABLE_PARSE_MARKER){
+            *flags |= TOKEN_HAS_VAR;
+            p++;
+        }
+        else if (*p == '\'' || *p == '"'){
+            char quote = *p++;
+            unsigned stop = quote == '"' ? SCAN_QUOTE | SCAN_DOLLAR : SCAN_QUOTE;
+            *flags |= TOKEN_QUOTED;
+            for (;;){
+                p += scan_until(p, end - p, stop);
+                if (p == end) return NULL;
+                if (*p == quote) break;
+                if (*p == VARIABLE_PARSE_MARKER && p + 1 < end && p[1] == '('){
+                    p = lex_subst(p, end, flags);
+                    if (p == NULL) return NULL;
+                    continue;
+                }
+                if (*p == VARIABLE_PARSE_MARKER) *flags |= TOKEN_HAS_VAR;
+                p++;
+            }
+            p++;
+        }
+        else {
+            // a blank or an operator ends the word
+            return p;
+        }
+    }
+}
+
+
+/*
+** Lexes the command (first line) of line into tokens, NUL-terminating
+** its words, and sets *rest to the lines after it (NULL if there are
+** none). Returns the number of tokens, -1 on allocation failure, -2 if
+** a quote is left unterminated or -3 if a command substitution is.
+*/
+static int lex_command(char *line, Arena *arena, Token **tokens, char **rest){
+    size_t cap = LEX_INIT_TOKENS;
+    size_t count = 0;
+    Token *toks = arena_alloc(arena, cap * sizeof(Token));
+    if (toks == NULL) return -1;
+
+    const char *p = line;
+    char *end = line + strcspn(line, "\n");
+    for (;;){
+        while (p < end && (char_class(*p) & SCAN_BLANK)) p++;
+        if (p == end || *p == '#') break;
+
+        if (count == cap){
+            Token *grown = arena_alloc(arena, cap * 2 * sizeof(Token));
+            if (grown == NULL) return -1;
+            memcpy(grown, toks, cap * sizeof(Token));
+            toks = grown;
+            cap *= 2;
+        }
+
+        Token *tok = &toks[count++];
+        const char *start = p;
+        tok->flags = 0;
+
+        if (*p == '|'){
+            tok->kind = TOK_PIPE;
+            p++;
+        }
+        else if (*p == '&'){
+            tok->kind = TOK_BACKGROUND;
+            p++;
+        }
+        else if (*p == '<'){
+            // <<< here-string, << here-document or < file
+            int len = p[1] != '<' ? 1 : p[2] != '<' ? 2 : 3;
+            tok->kind = len == 1 ? TOK_REDIR_IN :
+                len == 2 ? TOK_HEREDOC : TOK_HERESTRING;
+            p += len;
+        }
+        else if (*p == '>'){
+            tok->kind = p[1] == '>' ? TOK_REDIR_APPEND : TOK_REDIR_OUT;
+            p += p[1] == '>' ? 2 : 1;
+        }
+        else {
+            tok->kind = TOK_WORD;
+            p = lex_word(p, end, &tok->flags);
+            if (p == NULL) return tok->flags & LEX_OPEN_SUBST ? -3 : -2;
+        }
+        tok->start = start - line;
+        tok->len = p - start;
+    }
+
+    *rest = *end == '\n' ? end + 1 : NULL;
+
+    // a comment ends the command for good
+    line[p - line] = '\0';
+    for (size_t i = 0; i < count; i++){
+        if (toks[i].kind == TOK_WORD){
+            line[toks[i].start + toks[i].len] = '\0';
+        }
+    }
+
+    *tokens = toks;
+    return (int) count;
+}
+
+
+// The delimiter of a here-document: its (terminated) word without quotes
+static char *heredoc_delimiter(const char *line, const Token *word,
+                               Arena *arena){
+    char *delim = arena_alloc(arena, word->len + 1);
+    if (delim == NULL) return NULL;
+    char *q = delim;
+    for (const char *p = line + word->start; *p; p++){
+        if (*p != '\'' && *p != '"') *q++ = *p;
+    }
+    *q = '\0';
+    return delim;
+}
+
+
+/*
+** Returns the first of the lines between rest and limit that is exactly
+** delim, or NULL if there is none.
+*/
+static const char *find_delimiter(const char *rest, const char *limit,
+                                  const char *delim){
+    size_t delim_len = strlen(delim);
+    while (rest < limit){
+        const char *newline = memchr(rest, '\n', limit - rest);
+        const char *line_end = newline ? newline : limit;
+        if ((size_t) (line_end - rest) == delim_len &&
+            memcmp(rest, delim, delim_len) == 0){
+            return rest;
+        }
+        rest = line_end + 1;
+    }
+    return NULL;
+}
+
+
+/*
+** Lexes line into an array of tokens allocated from arena, giving each
+** here-document its body (see above).
+**
+** Returns the number of tokens (0 for a blank or comment-only line) with
+** *tokens set to the array, or -1 on a syntax error (unterminated quote
+** or here-document) or allocation failure.
+*/
+int lex_line(char *line, Arena *arena, Token **tokens){
+    char *rest;
+    int count = lex_command(line, arena, tokens, &rest);
+    if (count == -2){
+        ERR_PRINT(ERR_UNTERMINATED_QUOTE);
+        return -1;
+    }
+    if (count == -3){
+        ERR_PRINT(ERR_UNTERMINATED_SUBST);
+        return -1;
+    }
+
+    Token *toks = *tokens;
+    for (int i = 0; i + 1 < count; i++){
+        if (toks[i].kind != TOK_HEREDOC || toks[i + 1].kind != TOK_WORD){
+            continue;
+        }
+        char *delim = heredoc_delimiter(line, &toks[i + 1], arena);
+        if (delim == NULL) return -1;
+        char *stop = rest == NULL ? NULL :
+            (char *) find_delimiter(rest, rest + strlen(rest), delim);
+        if (stop == NULL){
+            ERR_PRINT(ERR_HEREDOC_UNTERMINATED, delim);
+            return -1;
+        }
+
+        toks[i].start = rest - line;
+        toks[i].len = stop - rest;
+        toks[i].flags = 0;
+        if (!(toks[i + 1].flags & TOKEN_QUOTED) &&
+            memchr(rest, VARIABLE_PARSE_MARKER, stop - rest)){
+            toks[i].flags = TOKEN_HAS_VAR;
+            if (memmem(rest, stop - rest, "$(", 2)) toks[i].flags |= TOKEN_HAS_SUBST;
+        }
+
+        // the next body starts after this one's delimiter line
+        char *after = strchrnul(stop, '\n');
+        rest = *after == '\n' ? after + 1 : NULL;
+        *stop = '\0';
+    }
+    return count;
+}
+
+
+/*
+** Returns the length of the line at the start of the len bytes at text:
+** up to its first newline, or if that opens here-documents, up to the
+** end of the last one's delimiter line. Returns -1 if a delimiter is not
+** found within len, so more lines are needed.
+*/
+long heredoc_extent(const char *text, size_t len, Arena *arena){
+    const char *newline = memchr(text, '\n', len);
+    size_t first = newline ? (size_t) (newline - text) : len;
+    if (memmem(text, first, "<<", 2) == NULL) return first;
+
+    char *command = arena_strndup(arena, text, first);
+    Token *toks;
+    char *rest;
+    int count = command ? lex_command(command, arena, &toks, &rest) : -1;
+
+    // a line that doesn't lex has its error reported when it is run
+    const char *limit = text + len;
+    const char *line_end = text + first;
+    for (int i = 0; i + 1 < count; i++){
+        if (toks[i].kind != TOK_HEREDOC || toks[i + 1].kind != TOK_WORD){
+            continue;
+        }
+        char *delim = heredoc_delimiter(command, &toks[i + 1], arena);
+        const char *stop = line_end < limit && delim != NULL ?
+            find_delimiter(line_end + 1, limit, delim) : NULL;
+        if (stop == NULL) return -1;
+        line_end = stop + strlen(delim);
+    }
+    return line_end - text;
+}
@@ -0,0 +1,256 @@
+#include "cscshell.h"
+
+/*
+** Cache of built command lines, keyed by the exact text of the line.
+**
+** Generated scripts run the same lines over and over; each time, lexing,
+** expansion and executable lookup produce the same Command chain as long
+** as none of the variables the line reads has been reassigned and PATH
+** (or the executable hash table) hasn't changed. So the first time a line
+** is built its chain is copied into the cache together with the
+** generation of every variable it read and of the executable cache. Later
+** runs of the line only have to check those generations, stat each
+** program the line runs (as a hash table hit would) and copy the chain
+** into the line's arena; the caller then opens redirections.
+**
+** Lines that assign variables or substitute command output are never
+** cached, since the assignment or the commands have to run every time.
+**
+** The cache is direct-mapped: a new line simply replaces whatever shared
+** its slot. Templates are allocated from one arena that is dropped along
+** with every entry once it grows past LINE_CACHE_MAX_BYTES.
+*/
+
+#define LINE_CACHE_SLOTS 1024
+#define LINE_CACHE_MAX_BYTES (4 * 1024 * 1024)
+
+typedef struct LineTemplate {
+    char *text;
+    uint32_t hash;
+    uint32_t exec_generation;
+    Command *commands;
+    VarRef *refs;
+    size_t nrefs;
+} LineTemplate;
+
+static LineTemplate *cache_slots[LINE_CACHE_SLOTS];
+static Arena cache_arena;
+static uint8_t cache_arena_ready = 0;
+static unsigned long cache_hits = 0;
+static unsigned long cache_misses = 0;
+
+
+/*
+** Records that the line being built read var. Returns 0 on success, -1
+** if memory could not be allocated.
+*/
+int var_refs_add(VarRefs *refs, Variable *var){
+    if (refs->count == refs->cap){
+        size_t new_cap = refs->cap ? refs->cap * 2 : 8;
+        VarRef *grown = arena_alloc(refs->arena, new_cap * sizeof(VarRef));
+        if (grown == NULL) return -1;
+        if (refs->count > 0){
+            memcpy(grown, refs->refs, refs->count * sizeof(VarRef));
+        }
+        refs->refs = grown;
+        refs->cap = new_cap;
+    }
+    refs->refs[refs->count].var = var;
+    refs->refs[refs->count].generation = var->generation;
+    refs->count++;
+    return 0;
+}
+
+
+/*
+** Deep copies a command chain (structures, argument arrays and strings)
+** into arena. Descriptors are not copied; the clone has default ones.
+**
+** Returns the copy, or NULL if memory could not be allocated.
+*/
+Command *clone_commands(const Command *head, Arena *arena){
+    Command *first = NULL;
+    Command **link = &first;
+
+    for (const Command *src = head; src != NULL; src = src->next){
+        Command *dst = arena_alloc(arena, sizeof(Command));
+        if (dst == NULL) return NULL;
+
+        size_t argc = 0;
+        while (src->args[argc] != NULL) argc++;
+        dst->args = arena_alloc(arena, (argc + 1) * sizeof(char *));
+        if (dst->args == NULL) return NULL;
+        for (size_t i = 0; i < argc; i++){
+            if ((dst->args[i] = arena_strdup(arena, src->args[i])) == NULL){
+                return NULL;
+            }
+        }
+        dst->args[argc] = NULL;
+
+        dst->builtin = src->builtin;
+        dst->exec_path = arena_strdup(arena, src->exec_path);
+        dst->redir_in_path = src->redir_in_path ?
+            arena_strdup(arena, src->redir_in_path) : NULL;
+        dst->redir_out_path = src->redir_out_path ?
+            arena_strdup(arena, src->redir_out_path) : NULL;
+        dst->here_doc = src->here_doc ?
+            arena_strdup(arena, src->here_doc) : NULL;
+        if (dst->exec_path == NULL ||
+            (src->redir_in_path && dst->redir_in_path == NULL) ||
+            (src->redir_out_path && dst->redir_out_path == NULL) ||
+            (src->here_doc && dst->here_doc == NULL)){
+            return NULL;
+        }
+        dst->redir_append = src->redir_append;
+        dst->background = src->background;
+        dst->stdin_fd = STDIN_FILENO;
+        dst->stdout_fd = STDOUT_FILENO;
+        dst->next = NULL;
+
+        *link = dst;
+        link = &dst->next;
+    }
+    return first;
+}
+
+
+/*
+** Drops every cached line.
+*/
+void line_cache_flush(void){
+    memset(cache_slots, 0, sizeof(cache_slots));
+    if (cache_arena_ready){
+        arena_free(&cache_arena);
+        cache_arena_ready = 0;
+    }
+}
+
+
+/*
+** Returns non-zero if template would still be built the same way: no
+** variable it read has changed, the executable cache hasn't moved on,
+** and every program it runs is still there to be run.
+*/
+static int template_is_current(const LineTemplate *template){
+    if (template->exec_generation != exec_cache_generation()) return 0;
+    for (size_t i = 0; i < template->nrefs; i++){
+        if (template->refs[i].var->generation != template->refs[i].generation){
+            return 0;
+        }
+    }
+    for (const Command *command = template->commands; command != NULL;
+         command = command->next){
+        if (command->builtin == NULL && !exec_path_usable(command->exec_path)){
+            return 0;
+        }
+    }
+    return 1;
+}
+
+
+/*
+** Returns a copy of the cached commands for line in arena, or NULL if the
+** line isn't cached or is out of date.
+*/
+Command *line_cache_get(const char *line, Arena *arena){
+    uint32_t hash = fnv1a_hash(line, strlen(line));
+    LineTemplate *template = cache_slots[hash & (LINE_CACHE_SLOTS - 1)];
+
+    if (template == NULL || template->hash != hash ||
+        strcmp(template->text, line) != 0 || !template_is_current(template)){
+        cache_misses++;
+        return NULL;
+    }
+
+    cache_hits++;
+    return clone_commands(template->commands, arena);
+}
+
+
+static void line_cache_store(const char *line, uint32_t hash,
+                             const Command *commands, const VarRefs *refs){
+    if (!cache_arena_ready){
+        arena_init(&cache_arena);
+        cache_arena_ready = 1;
+    }
+    else if (cache_arena.bytes > LINE_CACHE_MAX_BYTES){
+        line_cache_flush();
+        arena_init(&cache_arena);
+        cache_arena_ready = 1;
+    }
+
+    LineTemplate *template = arena_alloc(&cache_arena, sizeof(LineTemplate));
+    if (template == NULL) return;
+    template->text = arena_strdup(&cache_arena, line);
+    template->hash = hash;
+    template->exec_generation = exec_cache_generation();
+    template->commands = clone_commands(commands, &cache_arena);
+    template->nrefs = refs->count;
+    template->refs = arena_alloc(&cache_arena,
+                                 (refs->count + 1) * sizeof(VarRef));
+    if (template->text == NULL || template->commands == NULL ||
+        template->refs == NULL){
+        return;
+    }
+    if (refs->count > 0){
+        memcpy(template->refs, refs->refs, refs->count * sizeof(VarRef));
+    }
+
+    cache_slots[hash & (LINE_CACHE_SLOTS - 1)] = template;
+}
+
+
+/*
+** Builds the commands for line in arena (see build_commands) and, if the
+** line can be reused, remembers them in the cache.
+**
+** Returns the same values as build_commands.
+*/
+Command *line_cache_build(const char *line, VarTable *variables, Arena *arena){
+    // lexing works in place, so the cache key is kept intact
+    char *work = arena_strdup(arena, line);
+    if (work == NULL) return (Command *) -1;
+
+    Token *tokens;
+    int count = lex_line(work, arena, &tokens);
+    if (count < 0 || check_tokens(work, tokens, count) < 0){
+        return (Command *) -1;
+    }
+    return line_cache_build_lexed(line, work, tokens, count, variables, arena);
+}
+
+
+// Returns non-zero if any of the tokens runs a command substitution
+static int has_subst(const Token *tokens, int count){
+    for (int i = 0; i < count; i++){
+        if (tokens[i].flags & TOKEN_HAS_SUBST) return 1;
+    }
+    return 0;
+}
+
+
+/*
+** Like line_cache_build, for a line that has already been lexed into
+** lexed and tokens and checked (see script.c).
+*/
+Command *line_cache_build_lexed(const char *line, char *lexed,
+                                const Token *tokens, int count,
+                                VarTable *variables, Arena *arena){
+    VarRefs refs = {NULL, 0, 0, arena};
+    uint8_t assigned;
+    Command *commands = build_tokens(lexed, tokens, count, variables, arena,
+                                     &refs, &assigned);
+
+    if (commands != NULL && commands != (Command *) -1 && !assigned &&
+        !has_subst(tokens, count)){
+        line_cache_store(line, fnv1a_hash(line, strlen(line)), commands,
+                         &refs);
+    }
+    return commands;
+}
+
+
+void line_cache_counts(unsigned long *hits, unsigned long *misses){
+    *hits = cache_hits;
+    *misses = cache_misses;
+}
@@ -0,0 +1,408 @@
+#include "cscshell.h"
+#include <signal.h>
+#include <sys/mman.h>
+
+/*
+** The `parallel` builtin: runs a command template once per input item,
+** several at a time, in the manner of `xargs -P`.
+**
+**   parallel [-j N] [-k] TEMPLATE [::: ITEM...]
+**
+** TEMPLATE is a single word holding a whole command line (pipes and
+** redirections included), in which every {} is replaced by the item; if
+** it has no {}, the item is appended as a last argument. Items are the
+** words after :::, or else the lines read from stdin.
+**
+** The template is built once with build_commands, so lexing, expansion
+** and executable lookup aren't repeated per item; each instance is just
+** a copy of the built commands with the item substituted in. Up to N
+** instances (default: one per CPU) run at once, each owning a worker
+** slot whose arena is reset when the slot is reused. The stdout of every
+** instance is collected in a memfd and written out as the instance
+** finishes, or, with -k, in item order. stderr is not collected.
+**
+** The exit status is the number of instances that failed (at most 101),
+** 2 on a usage error or if memory runs out (no more instances are started
+** then, but the running ones are still waited for).
+*/
+
+#define PARALLEL_PLACEHOLDER "{}"
+#define PARALLEL_ITEMS_MARKER ":::"
+#define PARALLEL_MAX_FAILURES 101
+
+typedef struct ParallelSlot {
+    Arena arena;
+    pid_t *pids;
+    int npids;
+    int running;
+    long item;
+} ParallelSlot;
+
+typedef struct ParallelOutput {
+    int fd;
+    int status;
+    uint8_t done;
+} ParallelOutput;
+
+typedef struct Parallel {
+    Command *template;
+    uint8_t has_placeholder;
+    uint8_t keep_order;
+    char **items;
+    char *line;
+    size_t line_len;
+    ParallelOutput *outputs;
+    size_t count;
+    size_t cap;
+    size_t flushed;
+    int failures;
+} Parallel;
+
+
+/*
+** Returns the next item, from the argument list if there is one or else
+** from stdin, or NULL once there are no more.
+*/
+static const char *next_item(Parallel *par){
+    if (par->items != NULL){
+        return *par->items ? *par->items++ : NULL;
+    }
+
+    ssize_t read;
+    while ((read = getline(&par->line, &par->line_len, stdin)) != -1){
+        if (read > 0 && par->line[read - 1] == '\n') par->line[--read] = '\0';
+        if (read > 0) return par->line;
+    }
+    clearerr(stdin);
+    return NULL;
+}
+
+
+// Returns word with every {} replaced by item (word itself if it has none).
+static char *substitute(char *word, const char *item, Arena *arena){
+    if (word == NULL || strstr(word, PARALLEL_PLACEHOLDER) == NULL) return word;
+
+    size_t item_len = strlen(item);
+    size_t len = 0;
+    for (const char *p = word; *p; ){
+        if (strncmp(p, PARALLEL_PLACEHOLDER, 2) == 0){
+            len += item_len;
+            p += 2;
+        }
+        else {
+            len++;
+            p++;
+        }
+    }
+
+    char *out = arena_alloc(arena, len + 1);
+    if (out == NULL) return NULL;
+    char *q = out;
+    for (const char *p = word; *p; ){
+        if (strncmp(p, PARALLEL_PLACEHOLDER, 2) == 0){
+            memcpy(q, item, item_len);
+            q += item_len;
+            p += 2;
+        }
+        else {
+            *q++ = *p++;
+        }
+    }
+    *q = '\0';
+    return out;
+}
+
+
+/*
+** Copies the template into arena with item substituted in. Returns the
+** commands, or NULL if memory could not be allocated.
+*/
+static Command *instantiate(Parallel *par, const char *item, Arena *arena){
+    Command *head = clone_commands(par->template, arena);
+    if (head == NULL) return NULL;
+
+    Command *last = head;
+    for (Command *command = head; command != NULL; command = command->next){
+        for (size_t i = 0; command->args[i] != NULL; i++){
+            command->args[i] = substitute(command->args[i], item, arena);
+            if (command->args[i] == NULL) return NULL;
+        }
+        if (command->redir_in_path != NULL &&
+            (command->redir_in_path = substitute(command->redir_in_path,
+                                                 item, arena)) == NULL){
+            return NULL;
+        }
+        if (command->redir_out_path != NULL &&
+            (command->redir_out_path = substitute(command->redir_out_path,
+                                                  item, arena)) == NULL){
+            return NULL;
+        }
+        if (command->here_doc != NULL &&
+            (command->here_doc = substitute(command->here_doc, item,
+                                            arena)) == NULL){
+            return NULL;
+        }
+        last = command;
+    }
+
+    if (!par->has_placeholder){
+        size_t argc = 0;
+        while (last->args[argc] != NULL) argc++;
+        char **args = arena_alloc(arena, (argc + 2) * sizeof(char *));
+        char *copy = arena_strdup(arena, item);
+        if (args == NULL || copy == NULL) return NULL;
+        memcpy(args, last->args, argc * sizeof(char *));
+        args[argc] = copy;
+        args[argc + 1] = NULL;
+        last->args = args;
+    }
+    return head;
+}
+
+
+void output_write(int fd){
+    char buf[65536];
+    ssize_t n;
+    fflush(stdout);
+    lseek(fd, 0, SEEK_SET);
+    while ((n = read(fd, buf, sizeof(buf))) > 0){
+        for (ssize_t done = 0; done < n; ){
+            ssize_t w = write(STDOUT_FILENO, buf + done, n - done);
+            if (w < 0){
+                if (errno == EINTR) continue;
+                perror("output");
+                n = 0;
+                break;
+            }
+            done += w;
+        }
+    }
+    close(fd);
+}
+
+
+// Writes out a finished instance's collected stdout and releases it.
+static void output_flush(ParallelOutput *output){
+    if (output->fd < 0) return;
+    output_write(output->fd);
+    output->fd = -1;
+}
+
+
+// Writes out whatever may be written now, in item order if keep_order.
+static void flush_finished(Parallel *par, size_t just_done){
+    if (!par->keep_order){
+        output_flush(&par->outputs[just_done]);
+        return;
+    }
+    while (par->flushed < par->count && par->outputs[par->flushed].done){
+        output_flush(&par->outputs[par->flushed++]);
+    }
+}
+
+
+/*
+** Starts the instance for the next item in slot. Returns 1 if it was
+** started, 0 if there are no items left, -1 if it could not be started
+** (which counts as a failure of that item), or -2 if there is no memory
+** to record another item (which is then left unread).
+*/
+static int launch(Parallel *par, ParallelSlot *slot, VarTable *variables){
+    // make room first, so an item that is taken is always accounted for
+    if (par->count == par->cap){
+        size_t new_cap = par->cap ? par->cap * 2 : 64;
+        ParallelOutput *grown = realloc(par->outputs, new_cap * sizeof(ParallelOutput));
+        if (grown == NULL){
+            perror("parallel");
+            return -2;
+        }
+        par->outputs = grown;
+        par->cap = new_cap;
+    }
+
+    const char *item = next_item(par);
+    if (item == NULL) return 0;
+
+    size_t index = par->count++;
+    ParallelOutput *output = &par->outputs[index];
+    output->fd = -1;
+    output->status = 0;
+    output->done = 0;
+
+    arena_reset(&slot->arena);
+    Command *commands = instantiate(par, item, &slot->arena);
+    if (commands == NULL || open_redirections(commands) < 0){
+        goto launch_fail;
+    }
+
+    Command *last = commands;
+    while (last->next != NULL) last = last->next;
+    if (last->redir_out_path == NULL){
+        output->fd = memfd_create("parallel", MFD_CLOEXEC);
+        int stage_fd = output->fd < 0 ? -1 :
+            fcntl(output->fd, F_DUPFD_CLOEXEC, 0);
+        if (stage_fd < 0){
+            perror("parallel");
+            free_command(commands);
+            goto launch_fail;
+        }
+        last->stdout_fd = stage_fd;
+    }
+
+    slot->pids = arena_alloc(&slot->arena,
+                             sizeof(pid_t) * count_commands(commands));
+    slot->npids = slot->pids == NULL ? -1 :
+        start_pipeline(commands, variables, slot->pids, NULL, NULL);
+    if (slot->npids < 0){
+        free_command(commands);
+        goto launch_fail;
+    }
+    slot->running = slot->npids;
+    slot->item = index;
+    return 1;
+
+launch_fail:
+    output->done = 1;
+    output->status = -1;
+    par->failures++;
+    flush_finished(par, index);
+    return -1;
+}
+
+
+/*
+** Waits until at least one running instance has finished, collecting
+** every one that has. Returns the number of instances still running.
+*/
+static int reap(Parallel *par, ParallelSlot *slots, int nslots){
+    sigset_t chld, old;
+    sigemptyset(&chld);
+    sigaddset(&chld, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &chld, &old);
+
+    int running;
+    for (;;){
+        uint8_t reaped = 0;
+        running = 0;
+        for (int s = 0; s < nslots; s++){
+            ParallelSlot *slot = &slots[s];
+            if (slot->item < 0) continue;
+
+            for (int i = 0; i < slot->npids; i++){
+                int status;
+                if (slot->pids[i] <= 0) continue;
+                pid_t ret = waitpid(slot->pids[i], &status, WNOHANG);
+                if (ret == 0) continue;
+                if (ret > 0) trace_child_end(ret, status, NULL);
+                // an instance's status is that of its last stage
+                if (ret > 0 && i == slot->npids - 1){
+                    par->outputs[slot->item].status = status;
+                }
+                slot->pids[i] = 0;
+                slot->running--;
+            }
+            if (slot->running > 0){
+                running++;
+                continue;
+            }
+
+            ParallelOutput *output = &par->outputs[slot->item];
+            output->done = 1;
+            if (output->status != 0) par->failures++;
+            flush_finished(par, slot->item);
+            slot->item = -1;
+            reaped = 1;
+        }
+        if (reaped || running == 0) break;
+        sigsuspend(&old);
+    }
+    sigprocmask(SIG_SETMASK, &old, NULL);
+    return running;
+}
+
+
+/*
+** Implements the `parallel` builtin (see above).
+*/
+int parallel_cscshell(char **args, VarTable *variables){
+    Parallel par = {0};
+    long nslots = sysconf(_SC_NPROCESSORS_ONLN);
+    int a = 1;
+
+    for (; args[a] != NULL && args[a][0] == '-' && args[a][1] != '\0'; a++){
+        if (strcmp(args[a], "-k") == 0){
+            par.keep_order = 1;
+        }
+        else if (strcmp(args[a], "-j") == 0 && args[a + 1] != NULL){
+            char *end;
+            nslots = strtol(args[++a], &end, 10);
+            if (*end != '\0' || nslots <= 0){
+                ERR_PRINT(ERR_PARALLEL_USAGE);
+                return 2;
+            }
+        }
+        else {
+            ERR_PRINT(ERR_PARALLEL_USAGE);
+            return 2;
+        }
+    }
+    if (args[a] == NULL || (args[a + 1] != NULL &&
+                            strcmp(args[a + 1], PARALLEL_ITEMS_MARKER) != 0)){
+        ERR_PRINT(ERR_PARALLEL_USAGE);
+        return 2;
+    }
+    if (args[a + 1] != NULL) par.items = &args[a + 2];
+    if (nslots < 1) nslots = 1;
+
+    // Build the template once; its {} words are ordinary text to the lexer
+    Arena template_arena;
+    arena_init(&template_arena);
+    char *work = arena_strdup(&template_arena, args[a]);
+    uint8_t assigned;
+    par.template = work ? build_commands(work, variables, &template_arena,
+                                         NULL, &assigned) : (Command *) -1;
+    if (par.template == NULL || par.template == (Command *) -1 || assigned){
+        ERR_PRINT(ERR_PARALLEL_TEMPLATE, args[a]);
+        arena_free(&template_arena);
+        return 2;
+    }
+    par.has_placeholder = strstr(args[a], PARALLEL_PLACEHOLDER) != NULL;
+
+    ParallelSlot *slots = calloc(nslots, sizeof(ParallelSlot));
+    if (slots == NULL){
+        perror("parallel");
+        arena_free(&template_arena);
+        return 2;
+    }
+    for (long s = 0; s < nslots; s++){
+        arena_init(&slots[s].arena);
+        slots[s].item = -1;
+    }
+
+    // keep every slot busy until the items run out
+    uint8_t more = 1;
+    uint8_t out_of_memory = 0;
+    int running = 0;
+    while (more || running > 0){
+        for (long s = 0; more && s < nslots; s++){
+            if (slots[s].item >= 0) continue;
+            int started;
+            while ((started = launch(&par, &slots[s], variables)) == -1);
+            if (started == -2) out_of_memory = 1;
+            if (started <= 0) more = 0;
+            else running++;
+        }
+        if (running > 0) running = reap(&par, slots, nslots);
+    }
+
+    for (long s = 0; s < nslots; s++){
+        arena_free(&slots[s].arena);
+    }
+    free(slots);
+    free(par.outputs);
+    free(par.line);
+    arena_free(&template_arena);
+    if (out_of_memory) return 2;
+    return par.failures > PARALLEL_MAX_FAILURES ?
+        PARALLEL_MAX_FAILURES : par.failures;
+}
@@ -1,20 +1,25 @@
 #include "cscshell.h"
 #include <ctype.h>
 #include <assert.h>
+#include <sys/mman.h>
 
 #define CONTINUE_SEARCH NULL
 
-// COMPLETE
-char *resolve_executable(const char *command_name, Variable *path){
+// The outputs of the command substitutions in a span being expanded
+typedef struct Outputs {
+    char **values;
+    size_t count;
+    size_t cap;
+} Outputs;
+
+// resolve_executable, untimed (see cscshell.h)
+static char *find_executable(const char *command_name, Variable *path,
+                             Arena *arena){
 
     if (command_name == NULL || path == NULL){
         return NULL;
     }
 
-    if (strcmp(command_name, CD) == 0){
-        return strdup(CD);
-    }
-
     if (strcmp(path->name, PATH_VAR_NAME) != 0){
         ERR_PRINT(ERR_NOT_PATH);
         return NULL;
@@ -23,7 +28,7 @@ char *resolve_executable(const char *command_name, Variable *path){
     char *exec_path = NULL;
 
     if (strchr(command_name, '/')){
-        exec_path = strdup(command_name);
+        exec_path = arena_strdup(arena, command_name);
         if (exec_path == NULL){
             perror("resolve_executable");
             return NULL;
@@ -31,7 +36,30 @@ char *resolve_executable(const char *command_name, Variable *path){
         return exec_path;
     }
 
-    // we create a duplicate so that we can mess it up with strtok
+    const char *cached = exec_cache_get(command_name);
+    if (cached != NULL){
+        exec_path = arena_strdup(arena, cached);
+        if (exec_path == NULL){
+            perror("resolve_executable");
+        }
+        return exec_path;
+    }
+
+    const char *indexed;
+    int found = exec_index_lookup(command_name, path->value, &indexed);
+    if (found == 0){
+        return NULL;
+    }
+    if (found > 0){
+        exec_cache_put(command_name, indexed);
+        exec_path = arena_strdup(arena, indexed);
+        if (exec_path == NULL){
+            perror("resolve_executable");
+        }
+        return exec_path;
+    }
+
+    // no usable index: we create a duplicate so that we can mess it up with strtok
     char *path_to_toke = strdup(path->value);
     if (path_to_toke == NULL){
         perror("resolve_executable");
@@ -43,7 +71,6 @@ char *resolve_executable(const char *command_name, Variable *path){
         DIR *dir = opendir(current_path);
         if (dir == NULL){
             ERR_PRINT(ERR_BAD_PATH, current_path);
-            closedir(dir);
             continue;
         }
 
@@ -64,16 +91,18 @@ char *resolve_executable(const char *command_name, Variable *path){
             }
 
             if (strcmp(possible_file->d_name, command_name) == 0){
-                // +1 null term, +1 possible missing '/'
-                size_t buflen = strlen(current_path) +
-                    strlen(command_name) + 1 + 1;
-                exec_path = (char *) malloc(buflen);
-                // also sets remaining buf to 0
-                strncpy(exec_path, current_path, buflen);
-                if (current_path[strlen(current_path)-1] != '/'){
-                    strncat(exec_path, "/", 2);
+                char found_path[MAX_PATH_STR];
+                uint8_t has_slash =
+                    current_path[strlen(current_path)-1] == '/';
+                snprintf(found_path, MAX_PATH_STR, "%s%s%s", current_path,
+                         has_slash ? "" : "/", command_name);
+                exec_cache_put(command_name, found_path);
+                exec_path = arena_strdup(arena, found_path);
+                if (exec_path == NULL){
+                    perror("resolve_executable");
+                    closedir(dir);
+                    goto res_ex_cleanup;
                 }
-                strncat(exec_path, command_name, strlen(command_name)+1);
             }
         }
         closedir(dir);
@@ -88,427 +117,699 @@ res_ex_cleanup:
     return exec_path;
 }
 
-/**
- * Preprocesses a given line by adding spaces around certain symbols ('|', '<', '>'),
- * ensuring there are no additional spaces where they're not needed.
- * 
- * @param line The input line to be processed. It is a constant pointer to ensure
- *             the input is not modified.
- * 
- * @return A pointer to the newly allocated string that has been processed.
- *         Returns NULL if the input line is NULL.
- */
-char* preprocess_line(const char* line) {
-    // Return NULL immediately if the input line is NULL.
-    if (line == NULL) return NULL;
-
-    // Allocate memory for the processed line, considering worst-case scenario for spacing.
-    char* processed_line = malloc(strlen(line) * 3 + 1); // 3 times the length for spaces + 1 for null terminator.
-    if (processed_line == NULL) {
-        perror("malloc"); // Print error message if memory allocation fails.
-        exit(EXIT_FAILURE); // Exit the program if memory allocation fails.
-    }
-
-    const char* current_char = line;
-    char* new_char_position = processed_line; // Pointer to append characters to the processed line.
-
-    // Loop through each character of the input line.
-    while (*current_char != '\0') {
-        // Check if the current character is one of the specified symbols.
-        if (*current_char == '|' || *current_char == '<' || *current_char == '>') {
-            // Add a space before the symbol if it's not the first character and the previous one isn't a space.
-            if (new_char_position != processed_line && *(new_char_position - 1) != ' ') {
-                *new_char_position++ = ' ';
+char *resolve_executable(const char *command_name, Variable *path,
+                         Arena *arena){
+    uint64_t start = trace_now();
+    char *exec_path = find_executable(command_name, path, arena);
+    stats_record(STAT_RESOLVE, start);
+    if (trace_on) {
+        trace_span("resolve_executable", start, command_name, -1);
+    }
+    return exec_path;
+}
+
+/*
+** Parses the variable usage ($NAME, ${NAME} or $!) starting at the '$' at
+** usage, without reading past limit. If refs is not NULL the variable
+** and its current generation are recorded in it.
+**
+** Returns the variable's value and sets *end just past the usage, or
+** returns NULL (after printing an error) if the variable is not defined.
+*/
+static const char *usage_value(const char *usage, const char *limit,
+                               const char **end, VarTable *variables,
+                               VarRefs *refs) {
+    const char *name = usage + 1; // Skip '$'
+    const char *end_var = name;
+    size_t name_len;
+    if (name < limit && *name == '{') {
+        name++; // Skip '{'
+        end_var = name;
+        while (end_var < limit && *end_var != '}') end_var++;
+        name_len = end_var - name;
+        if (end_var < limit) { // Found closing brace
+            end_var++; // Include '}'
+        }
+    } else if (name < limit && *name == LAST_JOB_VAR_NAME[0]) {
+        end_var++; // $! is a one-character name
+        name_len = 1;
+    } else {
+        while (end_var < limit && (isalnum((unsigned char)*end_var) || *end_var == '_')) end_var++;
+        name_len = end_var - name;
+    }
+
+    Variable *var = var_lookup(variables, name, name_len);
+    if (var == NULL) {
+        char var_name[256] = {0};
+        strncpy(var_name, name, name_len < 255 ? name_len : 255);
+        ERR_PRINT(ERR_VAR_NOT_FOUND, var_name);
+        return NULL;
+    }
+    if (refs != NULL && var_refs_add(refs, var) < 0) {
+        return NULL;
+    }
+    *end = end_var;
+    return var->value;
+}
+
+/*
+** Runs the command substitution whose "$(" is at usage (see subst.c),
+** setting *end just past it. The output is added to outputs, which owns
+** it. Returns the output, or NULL on error.
+*/
+static const char *subst_value(const char *usage, const char *limit,
+                               const char **end, VarTable *variables,
+                               Outputs *outputs) {
+    const char *close = subst_end(usage, limit);
+    if (close == NULL) {
+        ERR_PRINT(ERR_UNTERMINATED_SUBST);
+        return NULL;
+    }
+    if (outputs->count == outputs->cap) {
+        size_t new_cap = outputs->cap ? outputs->cap * 2 : 4;
+        char **grown = realloc(outputs->values, new_cap * sizeof(char *));
+        if (grown == NULL) {
+            perror("realloc");
+            return NULL;
+        }
+        outputs->values = grown;
+        outputs->cap = new_cap;
+    }
+
+    char *output = command_output(usage + 2, close - usage - 2, variables);
+    if (output == NULL) {
+        return NULL;
+    }
+    outputs->values[outputs->count++] = output;
+    *end = close + 1;
+    return output;
+}
+
+static void outputs_free(Outputs *outputs) {
+    for (size_t i = 0; i < outputs->count; i++) {
+        free(outputs->values[i]);
+    }
+    free(outputs->values);
+}
+
+/*
+** Expands the len bytes at span into a new string in arena (or on the heap
+** if arena is NULL), replacing variable usages with their values and
+** command substitutions with their output. If quotes is non-zero, quote
+** characters are removed and nothing inside '...' is expanded. Variables
+** read are recorded in refs, if it is not NULL.
+**
+** The expansion is built in a stack buffer and copied out once at its
+** exact size; only strings expanding past MAX_SINGLE_LINE take a second
+** pass, writing straight into an allocation sized by the first. Commands
+** are only run in the first pass, which keeps their output for the
+** second.
+**
+** Returns NULL if a variable is not defined or a command substitution
+** fails, or (char *) -1 if memory could not be allocated.
+*/
+static char *expand_text(const char *span, size_t len, VarTable *variables,
+                         Arena *arena, uint8_t quotes, VarRefs *refs) {
+    char scratch[MAX_SINGLE_LINE];
+    size_t new_len = 0;
+    char *new_line = NULL;
+    Outputs outputs = {NULL, 0, 0};
+    size_t next_output = 0;
+
+    for (int pass = 0; pass < 2; pass++) {
+        if (pass == 1) {
+            new_line = arena ? arena_alloc(arena, new_len + 1) : malloc(new_len + 1);
+            if (new_line == NULL) {
+                if (arena == NULL) perror("malloc");
+                outputs_free(&outputs);
+                return (char *) -1;
+            }
+            if (new_len < sizeof(scratch)) {
+                memcpy(new_line, scratch, new_len);
+                break;
+            }
+            new_len = 0;
+        }
+
+        const char *p = span;
+        const char *limit = span + len;
+        char quote = '\0';
+        while (p < limit) {
+            const char *value = p;
+            size_t value_len;
+
+            if (quotes && (*p == '\'' || *p == '"') && (quote == '\0' || quote == *p)) {
+                // Opening or closing quote: drop it
+                quote = quote ? '\0' : *p;
+                p++;
+                continue;
             }
-            *new_char_position++ = *current_char; // Add the symbol to the processed line.
 
-            // Special handling for ">>" to avoid adding an extra space.
-            if (*current_char == '>' && *(current_char + 1) == '>') {
-                *new_char_position++ = *++current_char; // Skip the next '>' character.
+            if (*p == VARIABLE_PARSE_MARKER && quote != '\'' &&
+                p + 1 < limit && p[1] == '(') {
+                if (pass == 0) {
+                    value = subst_value(p, limit, &p, variables, &outputs);
+                } else {
+                    // the command already ran: reuse its output
+                    value = outputs.values[next_output++];
+                    p = subst_end(p, limit) + 1;
+                }
+                if (value == NULL) {
+                    outputs_free(&outputs);
+                    return NULL;
+                }
+                value_len = strlen(value);
+            } else if (*p == VARIABLE_PARSE_MARKER && quote != '\'') {
+                value = usage_value(p, limit, &p, variables, refs);
+                if (value == NULL) {
+                    outputs_free(&outputs);
+                    return NULL;
+                }
+                value_len = strlen(value);
+            } else {
+                // Copy the literal run up to the next special character in one go
+                unsigned stop = SCAN_DOLLAR | (quotes ? SCAN_QUOTE : 0);
+                value_len = 1 + scan_until(p + 1, limit - p - 1, stop);
+                p += value_len;
             }
 
-            // Add a space after the symbol if the next character isn't a space or the end of the string.
-            if (*(current_char + 1) != ' ' && *(current_char + 1) != '\0') {
-                *new_char_position++ = ' ';
+            if (pass == 1) {
+                memcpy(new_line + new_len, value, value_len);
+            } else if (new_len + value_len < sizeof(scratch)) {
+                memcpy(scratch + new_len, value, value_len);
             }
-        } else {
-            *new_char_position++ = *current_char; // Add the current character to the processed line.
+            new_len += value_len;
         }
-        current_char++; // Move to the next character in the input line.
     }
 
-    *new_char_position = '\0'; // Null-terminate the processed line.
-    return processed_line;
+    new_line[new_len] = '\0'; // Ensure null-terminated string
+    outputs_free(&outputs);
+    return new_line;
+}
+
+// expand_text, timed for the statistics
+static char *expand_span(const char *span, size_t len, VarTable *variables,
+                         Arena *arena, uint8_t quotes, VarRefs *refs) {
+    uint64_t start = trace_now();
+    char *expanded = expand_text(span, len, variables, arena, quotes, refs);
+    stats_record(STAT_EXPAND, start);
+    return expanded;
+}
+
+/*
+** Returns the value of a word token: the word itself (already
+** NUL-terminated in the line by the lexer) if it has no quotes or variable
+** usages, otherwise its expansion in the arena.
+*/
+static char *word_value(char *line, const Token *token, VarTable *variables,
+                        Arena *arena, VarRefs *refs) {
+    if (token->flags == 0) {
+        return line + token->start;
+    }
+    return expand_span(line + token->start, token->len, variables, arena, 1, refs);
+}
+
+// Returns non-zero if the word is a NAME=VALUE assignment, i.e. it has an
+// '=' with no quotes or command substitution before it.
+static int is_assignment(const char *word) {
+    for (const char *p = word; *p; p++) {
+        if (*p == '=') return 1;
+        if (*p == '\'' || *p == '"') return 0;
+        if (*p == VARIABLE_PARSE_MARKER && p[1] == '(') return 0;
+    }
+    return 0;
 }
 
-// Handles the assignment of values to variables. If the variable already exists in the list, its value is updated.
-// If it does not exist, a new variable is created and added to the list.
+// Handles the assignment of values to variables. If the variable already exists in the table, its value is updated.
+// If it does not exist, a new variable is created and added to the table.
 // Arguments:
-//   token - a string containing the variable name, an equals sign, and the value to assign.
-//   variables - a pointer to the head pointer of the list of variables.
-// Return value: None.
-int handle_variable_assignment(char* token, Variable** variables) {
-    char *saveptr1; // For strtok_r's internal use
-
-    // Extract the variable name from the token
-    char* name = strtok_r(token, "=", &saveptr1);
+//   word - the assignment word: a variable name, an equals sign, and the value (which is expanded).
+//   variables - the table of shell variables.
+//   arena - the line's arena, used for the expanded value.
+// Return value: 0 on success, 1 on error.
+int handle_variable_assignment(const char* word, VarTable* variables, Arena* arena) {
+    const char *equals = strchr(word, '=');
+    if (equals == word) {
+        ERR_PRINT(ERR_VAR_START);
+        return 1;
+    }
+
     // Validate the variable name
-    for(char *p = name; *p; p++) {
+    for (const char *p = word; p < equals; p++) {
         if (!isalpha((unsigned char)*p) && *p != '_') {
-            ERR_PRINT(ERR_VAR_NAME, name);
+            char *name = arena_strndup(arena, word, equals - word);
+            ERR_PRINT(ERR_VAR_NAME, name ? name : word);
             return 1;
         }
     }
 
-    // Extract the variable value from the token
-    char* value = strtok_r(NULL, "=\n", &saveptr1);
-    // Default value to an empty string if none is provided
-    if (value == NULL) {
-        value = "";
+    // Expand the value; an empty value is allowed
+    char *value = expand_span(equals + 1, strlen(equals + 1), variables, arena, 1, NULL);
+    if (value == NULL || value == (char *) -1) {
+        return 1;
     }
 
-    // Look for the variable in the existing list
-    Variable* var;
-    for (var = *variables; var != NULL; var = var->next) {
-        if (strcmp(var->name, name) == 0) {
-            break; // Variable found
-        }
+    // Insert or update the variable
+    if (var_set(variables, word, equals - word, value) == NULL) {
+        return 1;
     }
+    return 0;
+}
 
-    if (var != NULL) {
-        // Update the value of an existing variable
-        free(var->value);
-        var->value = strdup(value);
-        if (var->value == NULL) {
-            perror("strdup");
-            return 1;
-        }
-    } else {
-        // Add a new variable to the list
-        var = malloc(sizeof(Variable));
-        if (!var) {
-            perror("malloc");
-            return 1;
-        }
-
-        // Initialize the new variable
-        var->name = strdup(name);
-        if (var->name == NULL) {
-            perror("strdup");
-            return 1;
-        }
+// Allocates a Command with no arguments and default file descriptors from the arena.
+static Command *new_command(Arena *arena) {
+    Command *command = arena_alloc(arena, sizeof(Command));
+    if (command == NULL) {
+        return NULL;
+    }
+    command->builtin = NULL;
+    command->exec_path = NULL;
+    command->args = NULL;
+    command->next = NULL;
+    command->stdin_fd = 0;
+    command->stdout_fd = 1;
+    command->redir_in_path = NULL;
+    command->redir_out_path = NULL;
+    command->here_doc = NULL;
+    command->redir_append = 0;
+    command->background = 0;
+    return command;
+}
 
-        var->value = strdup(value);
-        if (var->value == NULL) {
-            perror("strdup");
-            return 1;
+// Appends arg to the NULL-terminated args array of command, which currently
+// holds *argc arguments in room for *argcap. The array is doubled in the arena
+// when full, so adding n arguments costs O(n) overall.
+static int add_argument(Command *command, char *arg, size_t *argc, size_t *argcap, Arena *arena) {
+    if (*argc + 1 >= *argcap) {
+        size_t new_cap = *argcap ? *argcap * 2 : 8;
+        char **args = arena_alloc(arena, new_cap * sizeof(char *));
+        if (args == NULL) {
+            return -1;
         }
-
-        var->next = NULL;
-
-        // Insert the new variable into the list
-        if (*variables == NULL) {
-            // The list is empty, make the new variable the head
-            *variables = var;
-        } else {
-            // Append the new variable to the end of the list
-            Variable *current = *variables;
-            while (current->next != NULL) {
-                current = current->next;
-            }
-            current->next = var;
+        if (*argc > 0) {
+            memcpy(args, command->args, *argc * sizeof(char *));
         }
+        command->args = args;
+        *argcap = new_cap;
     }
+    command->args[(*argc)++] = arg;
+    command->args[*argc] = NULL;
     return 0;
 }
 
+// The text a here-string gives its command: the word and a newline.
+static char *here_string(const char *word, Arena *arena) {
+    size_t len = strlen(word);
+    char *text = arena_alloc(arena, len + 2);
+    if (text == NULL) {
+        return NULL;
+    }
+    memcpy(text, word, len);
+    text[len] = '\n';
+    text[len + 1] = '\0';
+    return text;
+}
+
 /*
-** Executes a single "line" of commands (through pipes)
-** If a command fails, the rest of the line should not be executed.
+** Checks the shape of a lexed line without expanding anything: every
+** pipeline stage needs a command word, a redirection needs a path after
+** it, and & may only end a line that runs something.
 **
-** The error code from the last command is returned through a pointer
-** to a heap integer on success. If the line is a `cd` command, the
-** return value of `cd_cscshell` is stored by the heap int.
-** -- If there are no commands to execute, returns NULL
-** -- If there were any errors starting any commands,
-**    returns (pointer value) -1
+** Returns 0 if the line is well formed, -1 on a syntax error.
 */
-Command* parse_line(char* line, Variable** variables) {
-    
-    // Check if the line only contains white spaces
-    char *temp = line;
-    while (*temp != '\0') {
-        if (!isspace((unsigned char)*temp)) {
-            if (*temp == '#') {
-                return NULL;
+int check_tokens(const char *line, const Token *tokens, int count) {
+    // Lines can't start with an operator
+    if (count > 0 && tokens[0].kind != TOK_WORD) {
+        return -1;
+    }
+
+    uint8_t has_command = 0;
+    uint8_t piped = 0;
+    for (int i = 0; i < count; i++) {
+        switch (tokens[i].kind) {
+        case TOK_WORD:
+            // Assignments may only come before the command word
+            if (!has_command && !is_assignment(line + tokens[i].start)) {
+                has_command = 1;
+            }
+            break;
+
+        case TOK_PIPE:
+            // Every stage of a pipeline needs a command
+            if (!has_command) {
+                return -1;
+            }
+            has_command = 0;
+            piped = 1;
+            break;
+
+        case TOK_BACKGROUND:
+            // Only a whole line can be sent to the background
+            if (!has_command || i + 1 != count) {
+                return -1;
+            }
+            break;
+
+        default:
+            // A redirection, which must be followed by its path
+            if (i + 1 >= count || tokens[i + 1].kind != TOK_WORD) {
+                return -1;
             }
+            i++;
             break;
         }
-        temp++;
     }
 
-    if (*temp == '|' || *temp == '<' || *temp == '>') {
-        return (Command *)-1;
-    }
-    // If the line only contains white spaces, return NULL
-    if (*temp == '\0') {
+    // A trailing pipe is an error
+    return piped && !has_command ? -1 : 0;
+}
+
+/*
+** Builds the linked list of commands for a line already lexed (in place)
+** into tokens and accepted by check_tokens, without opening any
+** redirections. Every Command, argument array and expanded string is
+** allocated from arena. Words without quotes or variables are used in
+** place.
+**
+** Every variable the commands depend on is recorded in refs (if not NULL),
+** and *assigned is set if the line assigned any variables.
+**
+** Returns NULL if there are no commands to run (empty line, comment or
+** assignment), or (Command *) -1 on error.
+*/
+Command *build_tokens(char *line, const Token *tokens, int count,
+                      VarTable *variables, Arena *arena, VarRefs *refs,
+                      uint8_t *assigned) {
+    *assigned = 0;
+    if (count == 0) {
         return NULL;
     }
 
-    Command* command = malloc(sizeof(Command));
+    Command* command = new_command(arena);
     if (!command) {
-        perror("malloc");
         return (Command *)-1;
     }
 
     Command* current_command = command;
+    size_t argc = 0;
+    size_t argcap = 0;
 
-    // Initialize command
-    command->exec_path = NULL;
-    command->args = malloc(sizeof(char*));
-    command->args[0] = NULL;
-    command->next = NULL;
-    command->stdin_fd = 0;
-    command->stdout_fd = 1;
-    command->redir_in_path = NULL;
-    command->redir_out_path = NULL;
-    command->redir_append = 0;
-
-    // Tokenize the line
-    char *var_token = strdup(line);
-    if (var_token == NULL) {
-        free_command(command);
-        perror("strdup");
-        return (Command *)-1;
-    }
-    char *saveptr;
-    char *processed = preprocess_line(line);
-    char *token = strtok_r(processed, " ", &saveptr);
-    char *new;
-    
+    for (int i = 0; i < count; i++) {
+        const Token *token = &tokens[i];
+        char *value;
 
-    while (token != NULL) {
-        // If the token is a comment, break the loop
-        if (token[0] == '#') {
-            break;
-        }
-        // If the token is a variable assignment
-        else if (strchr(token, '=')) {
-            if(handle_variable_assignment(var_token, variables) == 1) {
-                free_command(command);
-                free(var_token);
-                free(processed);
-                ERR_PRINT(ERR_EXECUTE_LINE);
-                return (Command *)-1;
-            }
-        }
-        // If the token is a redirection symbol
-        else if (strcmp(token, "<") == 0 || strcmp(token, ">") == 0 || strcmp(token, ">>") == 0) {
-            char* symbol = token;
-            token = strtok_r(NULL, " ", &saveptr);
-            if (token == NULL) {
-                free_command(command);
-                free(var_token);
-                free(processed);
-                ERR_PRINT(ERR_EXECUTE_LINE);
-                return (Command *)-1;
-            }
-            new = replace_variables_mk_line(token, *variables);
-            if (new == (char *)-1) {
-                free_command(command);
-                free(var_token);
-                free(processed);
-                ERR_PRINT(ERR_EXECUTE_LINE);
-                return (Command *)-1;
+        switch (token->kind) {
+        case TOK_WORD:
+            if (argc == 0 && is_assignment(line + token->start)) {
+                if (handle_variable_assignment(line + token->start, variables, arena) == 1) {
+                    return (Command *)-1;
+                }
+                *assigned = 1;
+                break;
             }
-            if (new == NULL) {
-                free_command(command);
-                free(var_token);
-                free(processed);
-                ERR_PRINT(ERR_EXECUTE_LINE);
+
+            value = word_value(line, token, variables, arena, refs);
+            if (value == NULL || value == (char *)-1) {
                 return (Command *)-1;
             }
-            if (strcmp(symbol, "<") == 0) {
-                current_command->redir_in_path = strdup(new);
-                if (current_command->redir_in_path == NULL) {
-                    free_command(command);
-                    free(new);
-                    free(var_token);
-                    free(processed);
-                    perror("strdup");
+
+            // If this is the first argument, it's the command: a builtin, or
+            // else an executable found on the PATH
+            if (argc == 0) {
+                current_command->builtin = builtin_lookup(value);
+                current_command->exec_path = current_command->builtin ? value :
+                    resolve_executable(value, variables->path, arena);
+                if (current_command->exec_path == NULL) {
+                    ERR_PRINT(ERR_NO_EXECU, value);
                     return (Command *)-1;
                 }
-                current_command->stdin_fd = open(new, O_RDONLY);
             }
-            else {
-                current_command->redir_out_path = strdup(new);
-                if (current_command->redir_out_path == NULL) {
-                    free_command(command);
-                    free(new);
-                    free(var_token);
-                    free(processed);
-                    perror("strdup");
-                    return (Command *)-1;
-                }
-                current_command->redir_append = (strcmp(symbol, ">>") == 0);
 
-                int flags = O_WRONLY | O_CREAT;
-                flags |= current_command->redir_append ? O_APPEND : O_TRUNC;
-
-                current_command->stdout_fd = open(new, flags, 0644);
+            if (add_argument(current_command, value, &argc, &argcap, arena) < 0) {
+                return (Command *)-1;
             }
-            free(new);
-        }
-        // If the token is a pipe symbol
-        else if (strcmp(token, "|") == 0) {
-            current_command->next = malloc(sizeof(Command));
+            break;
+
+        case TOK_PIPE:
+            current_command->next = new_command(arena);
             current_command = current_command->next;
             if (!current_command) {
-                free_command(command);
-                free(var_token);
-                free(processed);
-                perror("malloc");
                 return (Command *)-1;
             }
+            argc = 0;
+            argcap = 0;
+            break;
 
-            // Initialize the next command
-            current_command->exec_path = NULL;
-            current_command->args = malloc(sizeof(char*));
-            current_command->args[0] = NULL;
-            current_command->next = NULL;
-            current_command->stdin_fd = 0;
-            current_command->stdout_fd = 1;
-            current_command->redir_in_path = NULL;
-            current_command->redir_out_path = NULL;
-            current_command->redir_append = 0;
-        }
-        // If the token is a command or argument
-        else {
-            new = replace_variables_mk_line(token, *variables);
-            if (new == (char *)-1 || new == NULL) {
-                free_command(command);
-                free(var_token);
-                free(processed);
-                ERR_PRINT(ERR_EXECUTE_LINE);
+        case TOK_BACKGROUND:
+            command->background = 1;
+            break;
+
+        case TOK_HEREDOC:
+            // The lexer gave the operator its body; the delimiter is done with
+            i++;
+            value = token->flags == 0 ? line + token->start :
+                expand_span(line + token->start, token->len, variables, arena, 0, refs);
+            if (value == NULL || value == (char *)-1) {
                 return (Command *)-1;
             }
+            current_command->here_doc = value;
+            current_command->redir_in_path = NULL;
+            break;
 
-            // If this is the first argument, it's the command
-            if (current_command->args[0] == NULL) {
-                current_command->exec_path = resolve_executable(new, *variables);
+        case TOK_HERESTRING:
+            value = word_value(line, &tokens[++i], variables, arena, refs);
+            if (value == NULL || value == (char *)-1) {
+                return (Command *)-1;
             }
-
-            // Count the current number of arguments
-            int arg_count;
-            for (arg_count = 0; current_command->args[arg_count] != NULL; arg_count++);
-
-            // Resize the args array
-            current_command->args = realloc(current_command->args, (arg_count + 2) * sizeof(char *));
-            if (!current_command->args) {
-                free_command(command);
-                free(new);
-                free(var_token);
-                free(processed);
-                perror("realloc");
+            current_command->here_doc = here_string(value, arena);
+            if (current_command->here_doc == NULL) {
                 return (Command *)-1;
             }
+            current_command->redir_in_path = NULL;
+            break;
 
-            // Add the new argument
-            current_command->args[arg_count] = strdup(new);
-            if (current_command->args[arg_count] == NULL) {
-                free_command(command);
-                free(new);
-                free(var_token);
-                free(processed);
-                perror("strdup");
+        default:
+            value = word_value(line, &tokens[++i], variables, arena, refs);
+            if (value == NULL || value == (char *)-1) {
                 return (Command *)-1;
             }
-            current_command->args[arg_count + 1] = NULL;
-            free(new);
+
+            if (token->kind == TOK_REDIR_IN) {
+                current_command->redir_in_path = value;
+                current_command->here_doc = NULL;
+            }
+            else {
+                current_command->redir_out_path = value;
+                current_command->redir_append = (token->kind == TOK_REDIR_APPEND);
+            }
+            break;
         }
-        // Get the next token
-        token = strtok_r(NULL, " ", &saveptr);
     }
-    
-    if (command->exec_path == NULL) {
-        free_command(command);
-        command = NULL;
+
+    // Nothing but assignments
+    return argc == 0 ? NULL : command;
+}
+
+/*
+** Returns 1 if running line would assign a variable, as build_tokens
+** would (a NAME=VALUE word before a command's name), 0 if not, or -1 if
+** it doesn't lex, which has then been reported. line itself is left as
+** it was.
+*/
+int line_assigns(const char *line, Arena *arena) {
+    char *copy = arena_strdup(arena, line);
+    if (copy == NULL) {
+        perror("line_assigns");
+        return -1;
+    }
+    Token *tokens;
+    int count = lex_line(copy, arena, &tokens);
+    if (count < 0) {
+        return -1;
     }
 
-    free(var_token);
-    free(processed);
+    uint8_t named = 0;
+    for (int i = 0; i < count; i++) {
+        if (tokens[i].kind == TOK_PIPE) {
+            named = 0;
+        }
+        else if (tokens[i].kind != TOK_WORD) {
+            // redirections take the word after them
+            if (tokens[i].kind != TOK_BACKGROUND) i++;
+        }
+        else if (!named && is_assignment(copy + tokens[i].start)) {
+            return 1;
+        }
+        else {
+            named = 1;
+        }
+    }
+    return 0;
+}
 
-    return command;
+/*
+** Builds the linked list of commands for a single line, without opening
+** any redirections: the line is lexed in place (see lex.c), checked and
+** built with build_tokens.
+**
+** Returns NULL if there are no commands to run (empty line, comment or
+** assignment), or (Command *) -1 on error.
+*/
+Command *build_commands(char *line, VarTable *variables, Arena *arena,
+                        VarRefs *refs, uint8_t *assigned) {
+    *assigned = 0;
+
+    Token *tokens;
+    int count = lex_line(line, arena, &tokens);
+    if (count < 0 || check_tokens(line, tokens, count) < 0) {
+        return (Command *)-1;
+    }
+    return build_tokens(line, tokens, count, variables, arena, refs, assigned);
+}
+
+// Writes all len bytes of text to fd. Returns 0, or -1 on error.
+static int write_all(int fd, const char *text, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, text, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) return -1;
+        text += n;
+        len -= n;
+    }
+    return 0;
 }
 
 /*
-** This function is partially implemented for you, but you may
-** scrap the implementation as long as it produces the same result.
+** Returns a descriptor to read text from: an anonymous in-memory file
+** (memfd) holding it, written with a single copy and rewound, so inline
+** input never touches the filesystem. Without memfds (Linux before 3.17)
+** a pipe is used instead, grown to hold all of text, since nothing reads
+** it until the command starts.
 **
-** Creates a new line on the heap with all named variable *usages*
-** replaced with their associated values.
+** Returns -1 on error.
+*/
+static int here_doc_fd(const char *text) {
+    size_t len = strlen(text);
+    int fd = memfd_create("cscshell-heredoc", MFD_CLOEXEC);
+    if (fd >= 0) {
+        if (write_all(fd, text, len) < 0 || lseek(fd, 0, SEEK_SET) < 0) {
+            close(fd);
+            return -1;
+        }
+        return fd;
+    }
+
+    int fds[2];
+    if (make_pipe(fds) < 0) {
+        return -1;
+    }
+    if (fcntl(fds[1], F_GETPIPE_SZ) < (int) len &&
+        fcntl(fds[1], F_SETPIPE_SZ, (int) len) < 0) {
+        close(fds[0]);
+        close(fds[1]);
+        return -1;
+    }
+    int ret = write_all(fds[1], text, len);
+    close(fds[1]);
+    if (ret < 0) {
+        close(fds[0]);
+        return -1;
+    }
+    return fds[0];
+}
+
+/*
+** Opens the redirection files of every command in the chain, setting
+** their stdin_fd/stdout_fd, and puts any here-document or here-string
+** behind its command's stdin. On error, descriptors already opened are
+** closed again.
 **
-** Returns NULL if replacement parsing had an error, or (char *) -1 if
-** system calls fail and the shell needs to exit.
+** Returns 0 on success, -1 if any file could not be opened.
 */
-char *replace_variables_mk_line(const char *line, Variable *variables) {
-    size_t new_line_length = strlen(line) + 1;
-    char *new_line = (char *)malloc(new_line_length);
-    if (new_line == NULL) {
-        perror("malloc");
-        return (char *) -1;
-    }
-
-    const char *line_ptr = line;
-    char *new_line_ptr = new_line;
-    while (*line_ptr != '\0') {
-        if (*line_ptr == '$') {
-            const char *start_var = line_ptr + 1; // Skip '$'
-            const char *end_var = start_var;
-            if (*start_var == '{') {
-                end_var++; // Skip '{'
-                while (*end_var && *end_var != '}') end_var++;
-                if (*end_var == '}') { // Found closing brace
-                    end_var++; // Include '}'
-                }
-            } else {
-                while (isalnum(*end_var) || *end_var == '_') end_var++;
+int open_redirections(Command *head) {
+    for (Command *command = head; command != NULL; command = command->next) {
+        if (command->here_doc != NULL) {
+            int fd = here_doc_fd(command->here_doc);
+            if (fd < 0) {
+                perror("here-document");
+                free_command(head);
+                return -1;
             }
-
-            char var_name[256] = {0};
-            if (*(start_var) == '{') {
-                strncpy(var_name, start_var + 1, end_var - start_var - 2); // Skip '${' and '}'
-            } else {
-                strncpy(var_name, start_var, end_var - start_var);
+            command->stdin_fd = fd;
+        }
+        else if (command->redir_in_path != NULL) {
+            int fd = open(command->redir_in_path, O_RDONLY | O_CLOEXEC);
+            if (fd < 0) {
+                perror(command->redir_in_path);
+                free_command(head);
+                return -1;
             }
-
-            Variable *current = variables;
-            int found = 0;
-            while (current != NULL) {
-                if (strcmp(current->name, var_name) == 0) {
-                    size_t value_len = strlen(current->value);
-                    memcpy(new_line_ptr, current->value, value_len);
-                    new_line_ptr += value_len;
-                    found = 1;
-                    break;
-                }
-                current = current->next;
+            command->stdin_fd = fd;
+        }
+        if (command->redir_out_path != NULL) {
+            int flags = O_WRONLY | O_CREAT | O_CLOEXEC;
+            flags |= command->redir_append ? O_APPEND : O_TRUNC;
+
+            int fd = open(command->redir_out_path, flags, 0644);
+            if (fd < 0) {
+                perror(command->redir_out_path);
+                free_command(head);
+                return -1;
             }
+            command->stdout_fd = fd;
+        }
+    }
+    return 0;
+}
 
-            if (!found) {
-                ERR_PRINT(ERR_VAR_NOT_FOUND, var_name);
-                free(new_line);
-                return NULL;
-            }
+/*
+** Returns the commands for line from the line cache, or builds them (and
+** caches them if they can be reused). No redirections are opened.
+*/
+Command *build_line(const char *line, VarTable *variables, Arena *arena) {
+    Command *command = line_cache_get(line, arena);
+    if (command == NULL) {
+        command = line_cache_build(line, variables, arena);
+    }
+    return command;
+}
 
-            line_ptr = end_var; // Move past the variable
-        } else {
-            *new_line_ptr++ = *line_ptr++; // Copy characters outside variables
-        }
+/*
+** Parses a single line of text and returns a linked list of commands,
+** with redirections opened. Lines that ran before are served from the
+** line cache (see line_cache.c) as long as nothing they depend on has
+** changed; otherwise they are built afresh.
+**
+** The commands, their arguments and paths are all allocated from arena
+** and remain valid until it is reset.
+**
+** Returns NULL if there are no commands to run (empty line, comment or
+** assignment), or (Command *) -1 on error.
+*/
+Command* parse_line(char* line, VarTable* variables, Arena* arena) {
+    uint64_t start = trace_now();
+    Command *command = build_line(line, variables, arena);
+    if (command != NULL && command != (Command *)-1 &&
+        open_redirections(command) < 0) {
+        command = (Command *)-1;
+    }
+    stats_record(STAT_PARSE, start);
+    if (trace_on) {
+        trace_span("parse_line", start, line, -1);
     }
+    return command;
+}
 
-    *new_line_ptr = '\0'; // Ensure null-terminated string
-    return new_line;
+/*
+** Creates a new line in arena (or on the heap if arena is NULL) with all
+** named variable *usages* replaced with their associated values. Quote
+** characters are not treated specially.
+**
+** Returns NULL if replacement parsing had an error, or (char *) -1 if
+** system calls fail and the shell needs to exit.
+*/
+char *replace_variables_mk_line(const char *line, VarTable *variables, Arena *arena) {
+    return expand_span(line, strlen(line), variables, arena, 0, NULL);
 }
 
 /*
@@ -518,23 +819,21 @@ char *replace_variables_mk_line(const char *line, Variable *variables) {
 ** list starting at var, else just var.
 */
 void free_variable(Variable *var, uint8_t recursive) {
-    if (var == NULL) {
-        return;
-    }
+    while (var != NULL) {
+        Variable *next = var->next;
 
-    // Free the name and value
-    if (var->name != NULL) {
-        free(var->name);
-    }
-    if (var->value != NULL) {
-        free(var->value);
-    }
+        // Free the name and value
+        if (var->name != NULL) {
+            free(var->name);
+        }
+        if (var->value != NULL) {
+            free(var->value);
+        }
 
-    // If recursive is non-zero, free the next variable in the list
-    if (recursive && var->next != NULL) {
-        free_variable(var->next, recursive);
-    }
+        // Free the variable itself
+        free(var);
 
-    // Finally, free the variable itself
-    free(var);
-}
\ No newline at end of file
+        // If recursive is non-zero, continue with the rest of the list
+        var = recursive ? next : NULL;
+    }
+}
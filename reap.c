@@ -0,0 +1,343 @@
+#include "cscshell.h"
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/syscall.h>
+
+/*
+** Reaping the stages of a foreground line.
+**
+** Each stage's pid is opened as a pidfd and the pidfds are watched with
+** one epoll instance, so stages are collected (with wait4, for their
+** resource usage) in whatever order they exit rather than first to last.
+** How each stage ended is kept in pipeline_status until the next line,
+** and its exit codes are published in the PIPESTATUS variable.
+**
+** Two `set -o` options change what happens when a stage fails, that is
+** exits non-zero or is killed by a signal other than SIGPIPE (which only
+** means a later stage stopped reading):
+**
+**   pipefail   the line's exit code is that of the last stage that
+**              failed, rather than that of the last stage
+**   failfast   the stages still running are sent SIGTERM at once, and
+**              the line's exit code is that of the failed stage
+**
+** Without pidfds (kernels before 5.3) the stages are waited for in order,
+** and failfast can only act once the failing stage's turn comes.
+**
+** Lines of a parallel script (see schedule.c) run alongside each other,
+** so they are collected with line_reap_poll instead, which gives each
+** line the same treatment without ever blocking on one of them.
+*/
+
+#define REAP_MAX_EVENTS 16
+// The wait status recorded for a stage wait4 fails on: exit code 255
+#define REAP_LOST_STATUS (255 << 8)
+
+PipelineStatus pipeline_status = {NULL, 0, 0};
+
+
+int exit_code(int status){
+    if (WIFSIGNALED(status)) return 128 + WTERMSIG(status);
+    return WEXITSTATUS(status);
+}
+
+
+static int pipeline_reserve(int count){
+    if (count > pipeline_status.cap){
+        StageStatus *grown = realloc(pipeline_status.stages,
+                                     count * sizeof(StageStatus));
+        if (grown == NULL){
+            perror("pipeline_status");
+            return -1;
+        }
+        pipeline_status.stages = grown;
+        pipeline_status.cap = count;
+    }
+    memset(pipeline_status.stages, 0, count * sizeof(StageStatus));
+    pipeline_status.count = count;
+    return 0;
+}
+
+
+/*
+** Records a line that ran in the shell itself (a lone builtin) as a
+** single stage with exit code code. Returns code.
+*/
+int pipeline_status_set(int code){
+    if (pipeline_reserve(1) == 0){
+        pipeline_status.stages[0].code = code;
+    }
+    return code;
+}
+
+
+static void record_stage(StageStatus *stage, int status, uint8_t kill_sent){
+    trace_child_end(stage->pid, status, &stage->usage);
+    stage->code = exit_code(status);
+    stage->signal = WIFSIGNALED(status) ? WTERMSIG(status) : 0;
+    stage->killed = kill_sent && stage->signal == SIGTERM;
+}
+
+
+static int stage_failed(const StageStatus *stage){
+    return stage->code != 0 && stage->signal != SIGPIPE;
+}
+
+
+/*
+** The exit code of a line whose count stages ended as in stages, failed
+** being the first stage that failed (or -1): see above. Stages the shell
+** killed don't count.
+*/
+static int line_code(const StageStatus *stages, int count, int failed){
+    int last = count - 1;
+    if (shell_options.failfast && failed >= 0){
+        return stages[failed].code;
+    }
+    if (shell_options.pipefail){
+        for (int i = last; i >= 0; i--){
+            if (stages[i].code != 0 && !stages[i].killed) return stages[i].code;
+        }
+        return 0;
+    }
+    return stages[last].code;
+}
+
+
+// Sends SIGTERM to every stage that hasn't been reaped yet.
+static void kill_remaining(const pid_t *pids, const uint8_t *done,
+                           uint8_t *kill_sent, int npids){
+    for (int i = 0; i < npids; i++){
+        if (done[i] || kill_sent[i]) continue;
+        kill(pids[i], SIGTERM);
+        kill_sent[i] = 1;
+    }
+}
+
+
+// Waits for the stages in order, for when pidfds can't be used.
+static int wait_in_order(const pid_t *pids, int npids, uint8_t *done,
+                         uint8_t *kill_sent){
+    int failed = -1;
+    for (int i = 0; i < npids; i++){
+        int status;
+        StageStatus *stage = &pipeline_status.stages[i];
+        pid_t ret;
+        while ((ret = wait4(pids[i], &status, 0, &stage->usage)) < 0 &&
+               errno == EINTR);
+        done[i] = 1;
+        if (ret < 0){
+            perror("wait4");
+            status = REAP_LOST_STATUS;
+        }
+        record_stage(stage, status, kill_sent[i]);
+        if (failed < 0 && !stage->killed && stage_failed(stage)){
+            failed = i;
+            if (shell_options.failfast){
+                kill_remaining(pids, done, kill_sent, npids);
+            }
+        }
+    }
+    return failed;
+}
+
+
+/*
+** Waits for every stage of a line to exit (see above). Returns the line's
+** exit code, or -1 if the stages could not be waited for.
+*/
+int wait_pipeline(const pid_t *pids, int npids){
+    if (pipeline_reserve(npids) < 0) return -1;
+    for (int i = 0; i < npids; i++){
+        pipeline_status.stages[i].pid = pids[i];
+    }
+
+    uint8_t *done = calloc(2 * npids, 1);
+    int *pidfds = malloc(npids * sizeof(int));
+    if (done == NULL || pidfds == NULL){
+        perror("wait_pipeline");
+        free(done);
+        free(pidfds);
+        return -1;
+    }
+    uint8_t *kill_sent = done + npids;
+
+    int epfd = epoll_create1(EPOLL_CLOEXEC);
+    int opened = 0;
+    for (; epfd >= 0 && opened < npids; opened++){
+        pidfds[opened] = syscall(SYS_pidfd_open, pids[opened], 0);
+        struct epoll_event event = {.events = EPOLLIN, .data.u32 = opened};
+        if (pidfds[opened] < 0 ||
+            epoll_ctl(epfd, EPOLL_CTL_ADD, pidfds[opened], &event) < 0){
+            if (pidfds[opened] >= 0) close(pidfds[opened]);
+            break;
+        }
+    }
+
+    int failed = -1;
+    if (opened < npids){
+        // no pidfds: fall back to waiting in order
+        for (int i = 0; i < opened; i++) close(pidfds[i]);
+        failed = wait_in_order(pids, npids, done, kill_sent);
+    }
+    else {
+        int running = npids;
+        while (running > 0){
+            struct epoll_event events[REAP_MAX_EVENTS];
+            int n = epoll_wait(epfd, events, REAP_MAX_EVENTS, -1);
+            if (n < 0){
+                if (errno == EINTR) continue;
+                perror("epoll_wait");
+                break;
+            }
+
+            for (int e = 0; e < n; e++){
+                int i = events[e].data.u32;
+                StageStatus *stage = &pipeline_status.stages[i];
+                int status;
+                pid_t ret = 0;
+                if (!done[i]){
+                    while ((ret = wait4(pids[i], &status, WNOHANG,
+                                        &stage->usage)) < 0 && errno == EINTR);
+                }
+                if (ret == 0) continue;
+                done[i] = 1;
+                close(pidfds[i]);
+                running--;
+
+                // a stage that can't be waited for (reaped elsewhere, say)
+                // is done too, or its readable pidfd would spin the loop
+                if (ret < 0){
+                    perror("wait4");
+                    status = REAP_LOST_STATUS;
+                }
+                record_stage(stage, status, kill_sent[i]);
+                if (failed < 0 && !stage->killed && stage_failed(stage)){
+                    failed = i;
+                    if (shell_options.failfast){
+                        kill_remaining(pids, done, kill_sent, npids);
+                    }
+                }
+            }
+        }
+        // only if epoll itself failed: collect the rest in order
+        for (int i = 0; i < npids; i++){
+            if (done[i]) continue;
+            close(pidfds[i]);
+            int status;
+            StageStatus *stage = &pipeline_status.stages[i];
+            if (wait4(pids[i], &status, 0, &stage->usage) < 0){
+                status = REAP_LOST_STATUS;
+            }
+            record_stage(stage, status, kill_sent[i]);
+        }
+    }
+
+    if (epfd >= 0) close(epfd);
+    free(done);
+    free(pidfds);
+    return line_code(pipeline_status.stages, pipeline_status.count, failed);
+}
+
+
+/*
+** Starts keeping track of a line that is reaped alongside others with
+** line_reap_poll, rather than waited for with wait_pipeline. pids must
+** stay valid until the line has been reaped. Returns 0, or -1 on error.
+*/
+int line_reap_start(LineReap *reap, const pid_t *pids, int npids){
+    reap->stages = calloc(npids, sizeof(StageStatus));
+    reap->done = calloc(2 * npids, 1);
+    if (reap->stages == NULL || reap->done == NULL){
+        perror("line_reap");
+        line_reap_free(reap);
+        return -1;
+    }
+    for (int i = 0; i < npids; i++){
+        reap->stages[i].pid = pids[i];
+    }
+    reap->pids = pids;
+    reap->npids = npids;
+    reap->running = npids;
+    reap->failed = -1;
+    return 0;
+}
+
+
+/*
+** Collects whichever stages of reap's line have exited, without waiting,
+** just as wait_pipeline would (failfast included). Returns the number of
+** stages still running.
+*/
+int line_reap_poll(LineReap *reap){
+    uint8_t *kill_sent = reap->done + reap->npids;
+    for (int i = 0; i < reap->npids; i++){
+        if (reap->done[i]) continue;
+        StageStatus *stage = &reap->stages[i];
+        int status;
+        pid_t ret;
+        while ((ret = wait4(reap->pids[i], &status, WNOHANG,
+                            &stage->usage)) < 0 && errno == EINTR);
+        if (ret == 0) continue;
+        reap->done[i] = 1;
+        reap->running--;
+        if (ret < 0){
+            perror("wait4");
+            status = REAP_LOST_STATUS;
+        }
+        record_stage(stage, status, kill_sent[i]);
+        if (reap->failed < 0 && !stage->killed && stage_failed(stage)){
+            reap->failed = i;
+            if (shell_options.failfast){
+                kill_remaining(reap->pids, reap->done, kill_sent, reap->npids);
+            }
+        }
+    }
+    return reap->running;
+}
+
+
+// The exit code of a line line_reap_poll has collected every stage of
+int line_reap_code(const LineReap *reap){
+    return line_code(reap->stages, reap->npids, reap->failed);
+}
+
+
+/*
+** Makes reap's line the last line as far as pipeline_status (and so
+** PIPESTATUS) is concerned. Returns 0, or -1 on error.
+*/
+int line_reap_publish(const LineReap *reap){
+    if (pipeline_reserve(reap->npids) < 0) return -1;
+    memcpy(pipeline_status.stages, reap->stages,
+           reap->npids * sizeof(StageStatus));
+    return 0;
+}
+
+
+void line_reap_free(LineReap *reap){
+    free(reap->stages);
+    free(reap->done);
+    reap->stages = NULL;
+    reap->done = NULL;
+}
+
+
+/*
+** Sets PIPESTATUS to the exit codes of the last line's stages, separated
+** by spaces. Returns 0, or -1 if the variable could not be set.
+*/
+int pipeline_status_export(VarTable *variables){
+    char buf[MAX_SINGLE_LINE];
+    size_t len = 0;
+    buf[0] = '\0';
+    for (int i = 0; i < pipeline_status.count && len < sizeof(buf); i++){
+        len += snprintf(buf + len, sizeof(buf) - len, "%s%d", i ? " " : "",
+                        pipeline_status.stages[i].code);
+    }
+    if (var_set(variables, PIPESTATUS_VAR_NAME, strlen(PIPESTATUS_VAR_NAME),
+                buf) == NULL){
+        return -1;
+    }
+    return 0;
+}
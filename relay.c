@@ -0,0 +1,237 @@
+#include "cscshell.h"
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+
+/*
+** Pipe setup and the optional splice() relay for pipelines.
+**
+** Every pipe execute_line creates comes from make_pipe(), which grows it
+** to shell_options.pipe_size with F_SETPIPE_SZ when that is set, so high
+** volume pipelines switch between stages less often.
+**
+** With shell_options.relay on, the shell puts itself in the middle of
+** each connection of a line (stage to stage, redirect file to stage and
+** stage to redirect file): the producer writes into one pipe, the
+** consumer reads from another, and relay_run() moves the data across
+** with splice(), which never copies it into the shell. Each relay counts
+** the bytes it moved, and the throughput of every connection is reported
+** on stderr when the line finishes.
+*/
+
+#define RELAY_CHUNK (1 << 20)
+
+static double now_seconds(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+/*
+** Creates a close-on-exec pipe, sized per shell_options.pipe_size.
+** A size the kernel refuses is reported once and otherwise ignored.
+**
+** Returns 0 on success, -1 on error.
+*/
+int make_pipe(int fds[2]){
+    static uint8_t size_warned = 0;
+
+    if (pipe2(fds, O_CLOEXEC) == -1){
+        perror("pipe");
+        return -1;
+    }
+    if (shell_options.pipe_size > 0 &&
+        fcntl(fds[1], F_SETPIPE_SZ, shell_options.pipe_size) < 0 &&
+        !size_warned){
+        perror("F_SETPIPE_SZ");
+        size_warned = 1;
+    }
+    return 0;
+}
+
+
+/*
+** Puts a relay between a producer and a consumer. A new pipe is made
+** for whichever side isn't a file: *from_fd is the descriptor the
+** producer writes to and *to_fd the one the consumer reads from. Either
+** may already be a redirect file (is_file set), in which case the relay
+** uses it directly and leaves it alone.
+**
+** Returns 0 on success, -1 on error.
+*/
+int relay_insert(Relay *relay, int *from_fd, uint8_t from_is_file,
+                 int *to_fd, uint8_t to_is_file,
+                 const char *from, const char *to){
+    int fds[2];
+
+    relay->src = -1;
+    relay->dst = -1;
+    if (from_is_file){
+        relay->src = *from_fd;
+    }
+    else {
+        if (make_pipe(fds) < 0) return -1;
+        relay->src = fds[0];
+        *from_fd = fds[1];
+    }
+
+    if (to_is_file){
+        relay->dst = *to_fd;
+    }
+    else {
+        if (make_pipe(fds) < 0){
+            if (!from_is_file){
+                close(relay->src);
+                close(*from_fd);
+            }
+            return -1;
+        }
+        relay->dst = fds[1];
+        *to_fd = fds[0];
+    }
+
+    relay->from = from;
+    relay->to = to;
+    relay->bytes = 0;
+    relay->seconds = 0;
+    relay->copy = 0;
+    return 0;
+}
+
+
+// Closes both ends of a relay, marking it finished.
+static void relay_finish(Relay *relay, double start){
+    close(relay->src);
+    close(relay->dst);
+    relay->src = -1;
+    relay->dst = -1;
+    relay->seconds = now_seconds() - start;
+}
+
+
+/*
+** Moves what is waiting on relay's source to its destination. Where
+** splice can't be used (a destination opened for appending) the data is
+** copied through a buffer instead.
+**
+** Returns the bytes moved, 0 at end of input, or -1 with errno set
+** (EAGAIN if the destination is full).
+*/
+static ssize_t relay_step(Relay *relay){
+    if (!relay->copy){
+        ssize_t moved = splice(relay->src, NULL, relay->dst, NULL, RELAY_CHUNK,
+                               SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (moved >= 0 || errno != EINVAL) return moved;
+        relay->copy = 1;
+    }
+
+    char buf[65536];
+    ssize_t nread = read(relay->src, buf, sizeof(buf));
+    if (nread <= 0) return nread;
+    for (ssize_t done = 0; done < nread; ){
+        ssize_t n = write(relay->dst, buf + done, nread - done);
+        if (n < 0){
+            if (errno == EAGAIN){
+                struct pollfd pfd = {relay->dst, POLLOUT, 0};
+                poll(&pfd, 1, -1);
+                continue;
+            }
+            return -1;
+        }
+        done += n;
+    }
+    return nread;
+}
+
+
+/*
+** Runs every relay of a line until each has seen the end of its input
+** (or its consumer has gone away), closing their descriptors as they
+** finish.
+*/
+void relay_run(Relay *relays, size_t count){
+    struct pollfd *pfds = malloc(sizeof(struct pollfd) * (count ? count : 1));
+    uint8_t *blocked = calloc(count ? count : 1, 1);
+    if (pfds == NULL || blocked == NULL){
+        perror("relay");
+        free(pfds);
+        free(blocked);
+        relay_close(relays, count);
+        return;
+    }
+
+    // A consumer that exits early must not take the shell down with it
+    struct sigaction ignore = {0}, old;
+    ignore.sa_handler = SIG_IGN;
+    sigaction(SIGPIPE, &ignore, &old);
+
+    double start = now_seconds();
+    size_t active = count;
+    while (active > 0){
+        for (size_t i = 0; i < count; i++){
+            pfds[i].fd = relays[i].src < 0 ? -1 :
+                         blocked[i] ? relays[i].dst : relays[i].src;
+            pfds[i].events = blocked[i] ? POLLOUT : POLLIN;
+            pfds[i].revents = 0;
+        }
+        if (poll(pfds, count, -1) < 0){
+            if (errno == EINTR) continue;
+            perror("poll");
+            break;
+        }
+
+        for (size_t i = 0; i < count; i++){
+            if (relays[i].src < 0 || pfds[i].revents == 0) continue;
+            if (blocked[i]){
+                blocked[i] = 0;
+                continue;
+            }
+
+            ssize_t moved = relay_step(&relays[i]);
+            if (moved > 0){
+                relays[i].bytes += moved;
+            }
+            else if (moved < 0 && errno == EAGAIN){
+                blocked[i] = 1;
+            }
+            else {
+                // end of input, or the consumer is gone (EPIPE)
+                if (moved < 0 && errno != EPIPE) perror("splice");
+                relay_finish(&relays[i], start);
+                active--;
+            }
+        }
+    }
+
+    sigaction(SIGPIPE, &old, NULL);
+    relay_close(relays, count);
+    free(pfds);
+    free(blocked);
+}
+
+
+/*
+** Closes whatever descriptors the relays still hold.
+*/
+void relay_close(Relay *relays, size_t count){
+    for (size_t i = 0; i < count; i++){
+        if (relays[i].src >= 0) close(relays[i].src);
+        if (relays[i].dst >= 0) close(relays[i].dst);
+        relays[i].src = -1;
+        relays[i].dst = -1;
+    }
+}
+
+
+/*
+** Prints the bytes moved and the throughput of every relay.
+*/
+void relay_report(const Relay *relays, size_t count){
+    for (size_t i = 0; i < count; i++){
+        double seconds = relays[i].seconds > 0 ? relays[i].seconds : 1e-9;
+        fprintf(stderr, RELAY_REPORT, relays[i].from, relays[i].to,
+                (unsigned long long) relays[i].bytes, relays[i].seconds,
+                relays[i].bytes / seconds / (1024 * 1024));
+    }
+}
@@ -39,20 +39,119 @@ int count_commands(Command *head) {
     return count;
 }
 
+/*
+** Starts every stage of a line, connecting them with pipes (through the
+** relays, if relays is not NULL) and storing their pids in pids, which
+** has room for one per stage. The descriptors handed to the children are
+** closed in the shell as they are started.
+**
+** Returns the number of processes started, or -1 if any stage could not
+** be started. Processes already started by then are waited for, once
+** every descriptor of the line has been closed. A program that starts
+** but can't be executed is not an error here: its stage fails with 126
+** (127 if it doesn't exist), as it would in a shell.
+*/
+int start_pipeline(Command *head, VarTable *variables, pid_t *pids,
+                   Relay *relays, size_t *relay_count) {
+    int pipefd[2];
+    int pid_count = 0;
+
+    for (Command *current = head; current; current = current->next) {
+        // Setup pipe for command chaining
+        if (current->redir_out_path && current->next) {
+            ERR_PRINT(ERR_EXECUTE_LINE);
+            goto start_fail;
+        } else if (current->next) {
+            // The pipe replaces any input redirection of the next stage
+            if (current->next->stdin_fd != STDIN_FILENO) {
+                close(current->next->stdin_fd);
+                current->next->stdin_fd = STDIN_FILENO;
+            }
+
+            if (relays) {
+                if (relay_insert(&relays[*relay_count], &pipefd[1], 0,
+                                 &pipefd[0], 0, current->args[0],
+                                 current->next->args[0]) < 0) {
+                    goto start_fail;
+                }
+                (*relay_count)++;
+            } else if (make_pipe(pipefd) < 0) {
+                goto start_fail;
+            }
+            current->stdout_fd = pipefd[1];
+            current->next->stdin_fd = pipefd[0];
+        } else if (relays && current->redir_out_path) {
+            pipefd[0] = current->stdout_fd;
+            if (relay_insert(&relays[*relay_count], &pipefd[1], 0, &pipefd[0], 1,
+                             current->args[0], current->redir_out_path) < 0) {
+                goto start_fail;
+            }
+            (*relay_count)++;
+            current->stdout_fd = pipefd[1];
+        }
+
+        if (relays && current == head && current->redir_in_path) {
+            pipefd[1] = current->stdin_fd;
+            if (relay_insert(&relays[*relay_count], &pipefd[1], 1, &pipefd[0], 0,
+                             current->redir_in_path, current->args[0]) < 0) {
+                goto start_fail;
+            }
+            (*relay_count)++;
+            current->stdin_fd = pipefd[0];
+        }
+
+        uint64_t spawn_start = trace_now();
+        pid_t pid = current->builtin ? builtin_fork(current, variables)
+                                     : run_command(current);
+        if (pid < 0) {
+            // run_command or builtin_fork has said why
+            goto start_fail;
+        }
+        pids[pid_count++] = pid;
+        stats_record(STAT_SPAWN, spawn_start);
+        trace_child_start(pid, spawn_start, current->args[0]);
+        if (trace_on) {
+            trace_span("run_command", spawn_start, current->args[0], -1);
+        }
+
+        // The child has its own copies now
+        if (current->stdout_fd != STDOUT_FILENO) { 
+            close(current->stdout_fd);
+            current->stdout_fd = STDOUT_FILENO;
+        }
+
+        if (current->stdin_fd != STDIN_FILENO) {
+            close(current->stdin_fd);
+            current->stdin_fd = STDIN_FILENO;
+        }
+    }
+    return pid_count;
+
+start_fail:
+    // the stages already started see their pipes close, and are reaped
+    free_command(head);
+    if (relays) {
+        relay_close(relays, *relay_count);
+    }
+    if (pid_count > 0) {
+        wait_pipeline(pids, pid_count);
+    }
+    return -1;
+}
+
 /*
 ** Executes a single "line" of commands (through pipes)
 ** If a command fails, the rest of the line should not be executed.
 **
 ** The error code from the last command is returned through a pointer
-** to a heap integer on success. If the line is a `cd` command, the
-** return value of `cd_cscshell` is stored by the heap int.
+** to a heap integer on success. If the line is a single builtin
+** command (see builtins.c), it runs in the shell and its return
+** value is stored by the heap int.
 ** -- If there are no commands to execute, returns NULL
 ** -- If there were any errors starting any commands,
 **    returns (pointer value) -1
 */
-int *execute_line(Command *head) {
-    if (!head) return NULL;
-    Command *current = head;
+static int *run_line(Command *head, VarTable *variables) {
 
     int *status = malloc(sizeof(int));
     if (!status) {
@@ -61,14 +160,34 @@ int *execute_line(Command *head) {
         return (int *)(intptr_t)-1;
     }
 
-    // Handle built-in commands like 'cd' directly
-    if (strcmp(current->exec_path, "cd") == 0) {
-        *status = cd_cscshell(current->args[1]);
+    // A builtin on its own runs in the shell, so it can change its state
+    if (runs_in_shell(head)) {
+        uint64_t start = trace_on ? trace_now() : 0;
+        *status = pipeline_status_set(builtin_run(head, variables) & 0xff);
+        if (trace_on) {
+            trace_span("builtin", start, head->args[0], *status);
+        }
+        pipeline_status_export(variables);
         free_command(head);
         return status;
     }
 
-    int pipefd[2];
+    // So does a lone cat from files into a file (see copy.c), unless the
+    // relay is to report on it
+    if (!shell_options.relay) {
+        uint64_t start = trace_on ? trace_now() : 0;
+        int code = copy_line(head);
+        if (code >= 0) {
+            *status = pipeline_status_set(code);
+            if (trace_on) {
+                trace_span("copy", start, head->args[0], *status);
+            }
+            pipeline_status_export(variables);
+            free_command(head);
+            return status;
+        }
+    }
+
     int command_count = count_commands(head);
     pid_t *pids = malloc(sizeof(pid_t) * command_count);
     
@@ -78,61 +197,167 @@ int *execute_line(Command *head) {
         *status = -1;
         return status;
     }
-    int pid_count = 0;
 
-    while (current) {
-        // Setup pipe for command chaining
-        if (current->redir_out_path && current->next) {
-            free_command(head);
+    // With the relay on, the shell sits between every pair of stages and
+    // in front of the line's two redirect files. A background line can't
+    // have the shell in its way, so it never uses the relay, and nor does
+    // a line whose output the shell is capturing.
+    Relay *relays = NULL;
+    size_t relay_count = 0;
+    if (shell_options.relay && !head->background && !active_capture) {
+        relays = malloc(sizeof(Relay) * (command_count + 1));
+        if (!relays) {
+            perror("malloc");
             free(pids);
-            ERR_PRINT(ERR_EXECUTE_LINE);
-            *status = -1;
-            return status;
-            
-        } else if (current->next) {
-            if (pipe(pipefd) == -1) {
-                perror("pipe");
-                free_command(head);
-                free(pids);
-                *status = -1;
-                return status;
-            }
-            current->stdout_fd = pipefd[1];
-            current->next->stdin_fd = pipefd[0];
-        }
-
-        pid_t pid = run_command(current);
-        if (pid < 0) {
-            perror("run_command");
             free_command(head);
-            free(pids);
             *status = -1;
             return status;
-        } else {
-            pids[pid_count++] = pid;
         }
+    }
 
-        if (current->stdout_fd != STDOUT_FILENO) { 
-            close(current->stdout_fd);
+    int pid_count = start_pipeline(head, variables, pids, relays, &relay_count);
+    if (pid_count < 0) {
+        if (relays) {
+            relay_close(relays, relay_count);
+            free(relays);
         }
+        free(pids);
+        free_command(head);
+        *status = -1;
+        return status;
+    }
 
-        if (current != head && current->stdin_fd != STDIN_FILENO) {
-            close(current->stdin_fd);
-        }
-        current = current->next;
+    // A command substitution reads the output while the stages run
+    if (active_capture) {
+        capture_read(active_capture);
     }
 
-    // Wait for all commands to finish
-    for (int i = 0; i < pid_count; i++) {
-        waitpid(pids[i], status, 0);
+    // A background line becomes a job, which keeps the pids; $! names it
+    if (head->background) {
+        char last_pid[24];
+        snprintf(last_pid, sizeof(last_pid), "%d", (int) pids[pid_count - 1]);
+        job_add(head, pids, pid_count);
+        var_set(variables, LAST_JOB_VAR_NAME, strlen(LAST_JOB_VAR_NAME),
+                last_pid);
+        free_command(head);
+        *status = 0;
+        return status;
     }
 
+    if (relays) {
+        relay_run(relays, relay_count);
+    }
+
+    // Reap the stages as they exit; the line's status is its exit code
+    uint64_t wait_start = trace_on ? trace_now() : 0;
+    *status = wait_pipeline(pids, pid_count);
+    if (trace_on) {
+        trace_span("wait", wait_start, head->args[0], *status);
+    }
+    pipeline_status_export(variables);
+
+    if (relays) {
+        relay_report(relays, relay_count);
+        free(relays);
+    }
     free(pids);
     free_command(head);
     return status;
 }
 
 
+int runs_in_shell(const Command *head) {
+    return head->builtin != NULL && head->next == NULL && !head->background &&
+           !(active_capture && head->builtin->serial);
+}
+
+
+int *execute_line(Command *head, VarTable *variables) {
+    if (!head) return NULL;
+    executed_lines++;
+
+    uint64_t start = trace_now();
+    int *status = run_line(head, variables);
+    stats_record(STAT_LINE, start);
+    return status;
+}
+
+
+ShellOptions shell_options = {
+    .spawn_mode = SPAWN_FORK,
+    .pipe_size = 0,
+    .relay = 0,
+    .interactive = 0,
+    .serving = 0,
+    .max_jobs = 1,
+    .pipefail = 0,
+    .failfast = 0,
+};
+
+unsigned long executed_lines = 0;
+
+// The exit code of a child that could not exec, as other shells use
+static int exec_failure_code(int err) {
+    return err == ENOENT ? 127 : 126;
+}
+
+/*
+** Starts the command with posix_spawn, which (unlike fork) does not copy
+** the shell's page tables. The stdin/stdout redirections are applied by
+** spawn file actions, and the already-resolved exec_path is run directly.
+**
+** posix_spawn reports a failed exec itself, after its child has gone. So
+** that the stage fails just as it does with fork + exec, a stand-in child
+** is started that only exits with the code a failed exec gets.
+**
+** Returns the child's pid, or -1 on error.
+*/
+static pid_t spawn_command(Command *command) {
+    posix_spawn_file_actions_t actions;
+    int err = posix_spawn_file_actions_init(&actions);
+    if (err != 0) {
+        errno = err;
+        perror("posix_spawn_file_actions_init");
+        return -1;
+    }
+
+    if (command->stdin_fd != STDIN_FILENO) {
+        posix_spawn_file_actions_adddup2(&actions, command->stdin_fd, STDIN_FILENO);
+        posix_spawn_file_actions_addclose(&actions, command->stdin_fd);
+    }
+    if (command->stdout_fd != STDOUT_FILENO) {
+        posix_spawn_file_actions_adddup2(&actions, command->stdout_fd, STDOUT_FILENO);
+        posix_spawn_file_actions_addclose(&actions, command->stdout_fd);
+    }
+
+    pid_t pid;
+    err = posix_spawn(&pid, command->exec_path, &actions, NULL, command->args, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    if (err == ENOMEM || err == EAGAIN) {
+        errno = err;
+        perror("posix_spawn");
+        return -1;
+    }
+    if (err != 0) {
+        errno = err;
+        perror(command->exec_path);
+        // the stand-in does nothing but exit, which vfork allows
+        pid = vfork();
+        if (pid < 0) {
+            perror("vfork");
+            return -1;
+        }
+        if (pid == 0) {
+            _exit(exec_failure_code(err));
+        }
+    }
+
+    #ifdef DEBUG
+    printf("Parent process spawned child PID [%d] for %s\n", pid, command->exec_path);
+    #endif
+    return pid;
+}
+
 /*
 ** Forks a new process and execs the command
 ** making sure all file descriptors are set up correctly.
@@ -162,6 +387,10 @@ pid_t run_command(Command *command){
            command->stdin_fd, command->stdout_fd);
     #endif
     
+    if (shell_options.spawn_mode == SPAWN_POSIX) {
+        return spawn_command(command);
+    }
+
     pid_t pid = fork();
     if (pid < 0) {
         perror("fork");
@@ -175,18 +404,14 @@ pid_t run_command(Command *command){
         if (command->stdout_fd != STDOUT_FILENO) {
             dup2(command->stdout_fd, STDOUT_FILENO);
             close(command->stdout_fd);
-        } else if (command->redir_out_path) {
-            // Handle redirection of stdout
-            int fd = open(command->redir_out_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-            dup2(fd, STDOUT_FILENO);
-            close(fd); // Close the original file descriptor as it's no longer needed
         }
 
-        // Execute the command
-        execvp(command->exec_path, command->args);
-        // If execvp returns, it means an error occurred
-        perror("execvp");
-        return -1;
+        // Execute the command; its path was already resolved, so skip the PATH search
+        execv(command->exec_path, command->args);
+        // If execv returns, it means an error occurred
+        int err = errno;
+        perror(command->exec_path);
+        _exit(exec_failure_code(err));
     } else {
         #ifdef DEBUG
         printf("Parent process created child PID [%d] for %s\n", pid, command->exec_path);
@@ -201,100 +426,94 @@ pid_t run_command(Command *command){
 ** Returns 0 on success, -1 on error
 ** Arguments:
 **   file_path - a string representing the path to the script file.
-**   root - a pointer to the head of a list of variables that may be used or modified by the script.
+**   variables - the table of variables that may be used or modified by the script.
 ** Return values:
 **   0 on successful execution of the script,
-**  -1 if an error occurs (file opening failure, command execution failure).
+**  -1 if an error occurs (file opening failure, parse failure, command execution failure).
 */
-int run_script(char *file_path, Variable **root){
-    // Attempt to open the specified file for reading
-    FILE *file = fopen(file_path, "r");
-    if (file == NULL) {
-        perror("Error opening file");
-        return -1; // Indicate error opening the file
+int run_script(char *file_path, VarTable *variables){
+    // Load and check the whole script before running any of it
+    Script script;
+    if (script_load(file_path, &script) < 0) {
+        return -1;
     }
 
-    char *line = NULL; // Pointer to hold the current line read from the file
-    size_t len = 0; // Length of the line
-    ssize_t read; // Number of characters read
     int *status; // Pointer to hold the status returned by command execution
+    int ret = 0;
+
+    // One arena is reused by every line, so once it has grown to fit the
+    // largest line, building does no further allocation
+    Arena arena;
+    arena_init(&arena);
+
+    for (size_t i = 0; i < script.nlines; i++) {
+        jobs_reap();
+        uint64_t line_start = trace_now();
 
-    // Read the file line by line
-    while ((read = getline(&line, &len, file)) != -1) {
-        // Parse the current line into a command
-        Command *command = parse_line(line, root);
-        // If parsing returns NULL, skip execution and move to the next line
+        // Build the line's commands, expanding its variables now
+        Command *command = script_build_line(&script, i, variables, &arena);
+        if (command != NULL && command != (Command *) -1 &&
+            open_redirections(command) < 0) {
+            command = (Command *) -1;
+        }
+        stats_record(STAT_PARSE, line_start);
+        if (trace_on) {
+            trace_span("parse_line", line_start, script.lines[i].text, -1);
+        }
+        if (command == (Command *) -1) {
+            ERR_PRINT(ERR_PARSING_LINE);
+            ret = -1;
+            break;
+        }
+        // Nothing to run (an assignment), move to the next line
         if (command == NULL) {
+            arena_reset(&arena);
             continue;
         }
 
         // Execute the parsed command
-        status = execute_line(command);
+        status = execute_line(command, variables);
+        arena_reset(&arena);
+        if (trace_on) {
+            trace_span("line", line_start, script.lines[i].text,
+                       status != NULL && status != (int *) -1 ? *status : -1);
+        }
         // Check execution status; if NULL or indicates error, clean up and exit
-        if (status == NULL || *status != 0) {
-            free(status);
-            fclose(file);
-            if (line) {
-                free(line);
+        if (status == NULL || status == (int *) -1 || *status != 0) {
+            if (status != (int *) -1) {
+                free(status);
             }
-            return -1; 
+            ret = -1;
+            break;
         }
 
         // Clean up after successful command execution
         free(status);
     }
 
-    // Clean up and return success
-    fclose(file); // Close the file
-    if (line) {
-        free(line); // Free memory allocated for the last read line
-    }
-
-    return 0; // Indicate successful script execution
+    arena_free(&arena);
+    script_free(&script);
+    return ret;
 }
 
 /*
-** Implement the following function that frees all the
-** heap memory associated with a particular command.
+** Releases the resources a command chain still holds once it has been
+** executed (or abandoned): any redirection file descriptors that were
+** not handed to a child. The memory of the chain belongs to the line's
+** arena and is released when the arena is reset.
 ** Arguments:
-**   command - a pointer to the Command structure to be freed.
+**   command - a pointer to the first Command of the chain.
 ** Return value: None.
 */
 void free_command(Command *command) {
-    if (command == NULL) {
-        return; // If the command is NULL, there's nothing to free, so return immediately.
-    }
-
-    // Free the executable path string, if it's not NULL.
-    if (command->exec_path != NULL) {
-        free(command->exec_path);
-    }
-
-    // Free each argument string in the args array, then free the args array itself.
-    if (command->args != NULL) {
-        char **arg = command->args;
-        while (*arg != NULL) { // Iterate through each argument until the NULL sentinel is found.
-            free(*arg); 
-            arg++;
+    for (; command != NULL; command = command->next) {
+        if (command->stdin_fd != STDIN_FILENO) {
+            close(command->stdin_fd);
+            command->stdin_fd = STDIN_FILENO;
+        }
+        if (command->stdout_fd != STDOUT_FILENO) {
+            close(command->stdout_fd);
+            command->stdout_fd = STDOUT_FILENO;
         }
-        free(command->args); // Once all arguments are freed, free the array itself.
-    }
-
-    // Free the input redirection path string, if it's not NULL.
-    if (command->redir_in_path != NULL) {
-        free(command->redir_in_path);
-    }
-
-    // Free the output redirection path string, if it's not NULL.
-    if (command->redir_out_path != NULL) {
-        free(command->redir_out_path);
-    }
-
-    // If there's a next command linked, recursively call free_command to free it.
-    if (command->next != NULL) {
-        free_command(command->next);
     }
-
-    // After all associated data has been freed, free the command structure itself.
-    free(command);
-}
\ No newline at end of file
+}
@@ -0,0 +1,185 @@
+#include "cscshell.h"
+
+#if defined(__x86_64__)
+#define SCAN_X86 1
+#include <immintrin.h>
+#endif
+
+/*
+** Vectorized search for shell metacharacters.
+**
+** scan_until() finds the first byte of a span that belongs to any of the
+** requested classes (see SCAN_* in cscshell.h), so the lexer and variable
+** expansion can skip over literal runs a whole block at a time instead of
+** testing every byte. Each block is classified into a bitmask with one bit
+** per byte (16 bytes with SSE2, 32 with AVX2) and the first set bit is the
+** answer. The implementation is picked once at runtime from what the CPU
+** supports, with a table-driven scalar version as the fallback and for the
+** tail of a span shorter than a block.
+*/
+
+static uint8_t char_classes[256];
+
+typedef size_t (*scan_fn)(const char *p, size_t len, unsigned classes);
+static scan_fn scan_impl = NULL;
+
+
+static size_t scan_scalar(const char *p, size_t len, unsigned classes){
+    for (size_t i = 0; i < len; i++){
+        if (char_classes[(unsigned char) p[i]] & classes) return i;
+    }
+    return len;
+}
+
+
+#ifdef SCAN_X86
+/*
+** Classifies 16 bytes into a bitmask. Always inlined, so inside the AVX2
+** scanner it is VEX-encoded too and never mixes in legacy SSE code.
+*/
+static inline __attribute__((always_inline))
+unsigned classify16(__m128i block, unsigned classes){
+    __m128i hits = _mm_setzero_si128();
+
+    if (classes & SCAN_BLANK){
+        // '\t'..'\r' are contiguous: (c - '\t') <= 4 unsigned
+        __m128i shifted = _mm_sub_epi8(block, _mm_set1_epi8('\t'));
+        hits = _mm_or_si128(hits, _mm_cmpeq_epi8(
+            _mm_min_epu8(shifted, _mm_set1_epi8(4)), shifted));
+        hits = _mm_or_si128(hits,
+            _mm_cmpeq_epi8(block, _mm_set1_epi8(' ')));
+    }
+    if (classes & SCAN_OPERATOR){
+        hits = _mm_or_si128(hits,
+            _mm_cmpeq_epi8(block, _mm_set1_epi8('|')));
+        hits = _mm_or_si128(hits,
+            _mm_cmpeq_epi8(block, _mm_set1_epi8('<')));
+        hits = _mm_or_si128(hits,
+            _mm_cmpeq_epi8(block, _mm_set1_epi8('>')));
+        hits = _mm_or_si128(hits,
+            _mm_cmpeq_epi8(block, _mm_set1_epi8('&')));
+    }
+    if (classes & SCAN_QUOTE){
+        hits = _mm_or_si128(hits,
+            _mm_cmpeq_epi8(block, _mm_set1_epi8('\'')));
+        hits = _mm_or_si128(hits,
+            _mm_cmpeq_epi8(block, _mm_set1_epi8('"')));
+    }
+    if (classes & SCAN_DOLLAR){
+        hits = _mm_or_si128(hits, _mm_cmpeq_epi8(block,
+            _mm_set1_epi8(VARIABLE_PARSE_MARKER)));
+    }
+    return (unsigned) _mm_movemask_epi8(hits);
+}
+
+
+static size_t scan_sse2(const char *p, size_t len, unsigned classes){
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16){
+        unsigned mask = classify16(
+            _mm_loadu_si128((const __m128i *) (p + i)), classes);
+        if (mask != 0) return i + __builtin_ctz(mask);
+    }
+    return i + scan_scalar(p + i, len - i, classes);
+}
+
+
+__attribute__((target("avx2")))
+static size_t scan_avx2(const char *p, size_t len, unsigned classes){
+    size_t i = 0;
+
+    for (; i + 32 <= len; i += 32){
+        __m256i block = _mm256_loadu_si256((const __m256i *) (p + i));
+        __m256i hits = _mm256_setzero_si256();
+
+        if (classes & SCAN_BLANK){
+            __m256i shifted = _mm256_sub_epi8(block, _mm256_set1_epi8('\t'));
+            hits = _mm256_or_si256(hits, _mm256_cmpeq_epi8(
+                _mm256_min_epu8(shifted, _mm256_set1_epi8(4)), shifted));
+            hits = _mm256_or_si256(hits,
+                _mm256_cmpeq_epi8(block, _mm256_set1_epi8(' ')));
+        }
+        if (classes & SCAN_OPERATOR){
+            hits = _mm256_or_si256(hits,
+                _mm256_cmpeq_epi8(block, _mm256_set1_epi8('|')));
+            hits = _mm256_or_si256(hits,
+                _mm256_cmpeq_epi8(block, _mm256_set1_epi8('<')));
+            hits = _mm256_or_si256(hits,
+                _mm256_cmpeq_epi8(block, _mm256_set1_epi8('>')));
+            hits = _mm256_or_si256(hits,
+                _mm256_cmpeq_epi8(block, _mm256_set1_epi8('&')));
+        }
+        if (classes & SCAN_QUOTE){
+            hits = _mm256_or_si256(hits,
+                _mm256_cmpeq_epi8(block, _mm256_set1_epi8('\'')));
+            hits = _mm256_or_si256(hits,
+                _mm256_cmpeq_epi8(block, _mm256_set1_epi8('"')));
+        }
+        if (classes & SCAN_DOLLAR){
+            hits = _mm256_or_si256(hits, _mm256_cmpeq_epi8(block,
+                _mm256_set1_epi8(VARIABLE_PARSE_MARKER)));
+        }
+
+        unsigned mask = (unsigned) _mm256_movemask_epi8(hits);
+        if (mask != 0) return i + __builtin_ctz(mask);
+    }
+
+    // at most one 16 byte block, then a scalar tail
+    if (i + 16 <= len){
+        unsigned mask = classify16(
+            _mm_loadu_si128((const __m128i *) (p + i)), classes);
+        if (mask != 0) return i + __builtin_ctz(mask);
+        i += 16;
+    }
+    return i + scan_scalar(p + i, len - i, classes);
+}
+#endif
+
+
+static void scan_init(void){
+    for (const char *c = " \t\n\r\v\f"; *c; c++){
+        char_classes[(unsigned char) *c] |= SCAN_BLANK;
+    }
+    for (const char *c = "|<>&"; *c; c++){
+        char_classes[(unsigned char) *c] |= SCAN_OPERATOR;
+    }
+    char_classes['\''] |= SCAN_QUOTE;
+    char_classes['"'] |= SCAN_QUOTE;
+    char_classes[VARIABLE_PARSE_MARKER] |= SCAN_DOLLAR;
+
+    scan_impl = scan_scalar;
+    const char *forced = getenv(SCAN_ENV_VAR);
+    if (forced != NULL && strcmp(forced, "scalar") == 0) return;
+
+#ifdef SCAN_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2")){
+        scan_impl = scan_sse2;
+    }
+    if (__builtin_cpu_supports("avx2") &&
+        (forced == NULL || strcmp(forced, "sse2") != 0)){
+        scan_impl = scan_avx2;
+    }
+#endif
+}
+
+
+/*
+** Returns the offset of the first of the len bytes at p whose class is in
+** classes, or len if there is none.
+*/
+size_t scan_until(const char *p, size_t len, unsigned classes){
+    if (scan_impl == NULL) scan_init();
+    // spans shorter than a block aren't worth the indirect call
+    if (len < 16) return scan_scalar(p, len, classes);
+    return scan_impl(p, len, classes);
+}
+
+
+/*
+** Returns the SCAN_* classes of a single character.
+*/
+unsigned char_class(char c){
+    if (scan_impl == NULL) scan_init();
+    return char_classes[(unsigned char) c];
+}
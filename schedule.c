@@ -0,0 +1,656 @@
+#include "cscshell.h"
+#include <signal.h>
+#include <sys/mman.h>
+
+/*
+** Parallel script execution (-j N).
+**
+** The script is still read and built line by line, in order, so every
+** assignment and expansion happens exactly as it would in run_script():
+** a line captures the values of the variables it uses when it is built,
+** and assignments never have to be ordered at run time. What changes is
+** that a built line is not run straight away but added to a dependency
+** graph, and up to N lines whose dependencies have finished run at once.
+**
+** Dependencies come from the files lines touch. Each line reads its
+** input redirection and (conservatively) every one of its arguments but
+** options, as any of them may name a file, and writes its output
+** redirection. Since a program may also write a file it is only handed
+** as an argument (cp src out, sort -o out), the arguments of any command
+** not known to only read its operands count as written too. Names are
+** compared with their directory resolved (see path_key), so ./out and
+** /full/path/out are the same file. A line then waits for the last
+** earlier writer of anything it reads or writes, and a writer also waits
+** for every earlier reader of what it overwrites.
+**
+** The stdout of a line without an output redirection is collected in a
+** memfd and written out once it and every line before it have finished,
+** so lines printing to the terminal can run at once and their output
+** still comes out in script order. stderr is not collected.
+**
+** A line that is a builtin changing the shell itself (cd, export, exit,
+** ...) is a barrier: everything before it finishes, it runs in the shell,
+** and only then is the rest of the script read. A line with a command
+** substitution runs commands while it is built, so everything before it
+** finishes first too, as does one expanding $PIPESTATUS.
+**
+** A line's stages are collected with line_reap_poll (see reap.c), so
+** pipefail and failfast decide its status as they would in a serial run,
+** and PIPESTATUS is that of the last line once everything has finished.
+**
+** As in run_script(), the first failure stops the script: no new line is
+** started once a line has failed, and the ones still running are waited
+** for before returning. Unlike a serial run, lines after the failed one
+** that had already started by then still run to the end.
+*/
+
+#define SCHED_INIT_LINES 64
+#define SCHED_INIT_PATHS 64
+
+typedef struct ScriptLine {
+    Command *commands;
+    pid_t *pids;
+    LineReap reap;
+    int status;
+    size_t waiting;
+    size_t *dependents;
+    size_t ndependents;
+    size_t dependents_cap;
+    int output_fd;
+    uint8_t done;
+} ScriptLine;
+
+/*
+** The lines that last touched a path: the last one to write it, and
+** those that have read it since.
+*/
+typedef struct PathUse {
+    const char *path;
+    uint32_t hash;
+    long writer;
+    size_t *readers;
+    size_t nreaders;
+    size_t readers_cap;
+} PathUse;
+
+typedef struct Schedule {
+    Arena *arena;
+    ScriptLine *lines;
+    size_t count;
+    size_t cap;
+    size_t *ready;
+    size_t ready_head;
+    size_t ready_tail;
+    PathUse *paths;
+    size_t paths_count;
+    size_t paths_cap;
+    char cwd[PATH_MAX];
+    size_t flushed;
+    int max_running;
+    int running;
+    uint8_t failed;
+} Schedule;
+
+// programs that never write a file named by one of their arguments
+static const char *const READ_ONLY_COMMANDS[] = {
+    "[", "basename", "cat", "cmp", "cut", "diff", "dirname", "du", "echo",
+    "false", "grep", "head", "ls", "md5sum", "printf", "pwd",
+    "sha1sum", "sha256sum", "stat", "tail", "test", "tr", "true", "wc",
+    NULL
+};
+
+
+// Remembers the cwd that relative names are taken from (see path_key).
+static void schedule_cwd(Schedule *sched){
+    if (getcwd(sched->cwd, sizeof(sched->cwd)) == NULL){
+        sched->cwd[0] = '\0';
+    }
+}
+
+
+static void schedule_init(Schedule *sched, Arena *arena, int max_running){
+    memset(sched, 0, sizeof(Schedule));
+    sched->arena = arena;
+    sched->max_running = max_running;
+    schedule_cwd(sched);
+}
+
+
+/*
+** Writes out the collected output of the finished lines in script order,
+** stopping at the first line still to finish unless all is set.
+*/
+static void flush_outputs(Schedule *sched, uint8_t all){
+    for (; sched->flushed < sched->count; sched->flushed++){
+        ScriptLine *entry = &sched->lines[sched->flushed];
+        if (!entry->done && !all) return;
+        if (entry->output_fd >= 0){
+            output_write(entry->output_fd);
+            entry->output_fd = -1;
+        }
+    }
+}
+
+
+// Forgets every line (all of which have finished) and path.
+static void schedule_clear(Schedule *sched){
+    flush_outputs(sched, 1);
+    for (size_t i = 0; i < sched->count; i++){
+        free(sched->lines[i].pids);
+        line_reap_free(&sched->lines[i].reap);
+    }
+    sched->count = 0;
+    sched->flushed = 0;
+    sched->ready_head = 0;
+    sched->ready_tail = 0;
+    memset(sched->paths, 0, sched->paths_cap * sizeof(PathUse));
+    sched->paths_count = 0;
+    // a barrier may have changed directory
+    schedule_cwd(sched);
+}
+
+
+static void schedule_free(Schedule *sched){
+    schedule_clear(sched);
+    free(sched->lines);
+    free(sched->ready);
+    free(sched->paths);
+}
+
+
+// Appends value to an arena-backed array that doubles when full.
+static int push_index(Arena *arena, size_t **array, size_t *count,
+                      size_t *cap, size_t value){
+    if (*count == *cap){
+        size_t new_cap = *cap ? *cap * 2 : 4;
+        size_t *grown = arena_alloc(arena, new_cap * sizeof(size_t));
+        if (grown == NULL) return -1;
+        if (*count > 0) memcpy(grown, *array, *count * sizeof(size_t));
+        *array = grown;
+        *cap = new_cap;
+    }
+    (*array)[(*count)++] = value;
+    return 0;
+}
+
+
+static int paths_grow(Schedule *sched){
+    size_t new_cap = sched->paths_cap ? sched->paths_cap * 2 : SCHED_INIT_PATHS;
+    PathUse *grown = calloc(new_cap, sizeof(PathUse));
+    if (grown == NULL){
+        perror("schedule");
+        return -1;
+    }
+    for (size_t i = 0; i < sched->paths_cap; i++){
+        if (sched->paths[i].path == NULL) continue;
+        size_t j = sched->paths[i].hash & (new_cap - 1);
+        while (grown[j].path != NULL) j = (j + 1) & (new_cap - 1);
+        grown[j] = sched->paths[i];
+    }
+    free(sched->paths);
+    sched->paths = grown;
+    sched->paths_cap = new_cap;
+    return 0;
+}
+
+
+/*
+** Finds the uses of path, adding an empty entry for it if there are none.
+** Returns NULL if memory could not be allocated.
+*/
+static PathUse *path_use(Schedule *sched, const char *path){
+    uint32_t hash = fnv1a_hash(path, strlen(path));
+    if (sched->paths_cap > 0){
+        size_t i = hash & (sched->paths_cap - 1);
+        while (sched->paths[i].path != NULL){
+            if (sched->paths[i].hash == hash &&
+                strcmp(sched->paths[i].path, path) == 0){
+                return &sched->paths[i];
+            }
+            i = (i + 1) & (sched->paths_cap - 1);
+        }
+    }
+
+    // keep the load factor under 3/4
+    if ((sched->paths_count + 1) * 4 > sched->paths_cap * 3 &&
+        paths_grow(sched) < 0){
+        return NULL;
+    }
+    size_t i = hash & (sched->paths_cap - 1);
+    while (sched->paths[i].path != NULL) i = (i + 1) & (sched->paths_cap - 1);
+    sched->paths[i].path = path;
+    sched->paths[i].hash = hash;
+    sched->paths[i].writer = -1;
+    sched->paths_count++;
+    return &sched->paths[i];
+}
+
+
+// Makes line wait for the earlier line dep, unless dep already finished.
+static int add_dependency(Schedule *sched, size_t line, long dep){
+    if (dep < 0 || (size_t) dep == line || sched->lines[dep].done) return 0;
+    ScriptLine *before = &sched->lines[dep];
+    if (push_index(sched->arena, &before->dependents, &before->ndependents,
+                   &before->dependents_cap, line) < 0){
+        return -1;
+    }
+    sched->lines[line].waiting++;
+    return 0;
+}
+
+
+// Returns dir/name allocated from arena, or NULL.
+static char *path_join(Arena *arena, const char *dir, const char *name){
+    size_t dir_len = strlen(dir);
+    uint8_t slash = dir_len == 0 || dir[dir_len - 1] != '/';
+    char *joined = arena_alloc(arena, dir_len + slash + strlen(name) + 1);
+    if (joined == NULL) return NULL;
+    sprintf(joined, "%s%s%s", dir, slash ? "/" : "", name);
+    return joined;
+}
+
+
+/*
+** Returns the name lines agree on for the file word names, allocated from
+** the schedule's arena (NULL if it can't be): its directory is resolved
+** with realpath, so out, ./out and /full/path/out are all the same file.
+** A directory that doesn't exist yet (an earlier line may make it) is
+** taken as written, relative to the cwd.
+*/
+static const char *path_key(Schedule *sched, const char *word){
+    char name[PATH_MAX];
+    char dir[PATH_MAX];
+    size_t len = strlen(word);
+    // "dir/" is dir
+    while (len > 1 && word[len - 1] == '/') len--;
+    if (len >= sizeof(name)) return word;
+    memcpy(name, word, len);
+    name[len] = '\0';
+
+    char *slash = strrchr(name, '/');
+    const char *base = slash ? slash + 1 : name;
+    uint8_t resolved;
+    if (*base == '\0' || strcmp(base, ".") == 0 || strcmp(base, "..") == 0){
+        resolved = realpath(name, dir) != NULL;
+        base = "";
+    }
+    else if (slash == NULL){
+        resolved = sched->cwd[0] != '\0';
+        strcpy(dir, sched->cwd);
+    }
+    else {
+        *slash = '\0';
+        resolved = realpath(slash == name ? "/" : name, dir) != NULL;
+        *slash = '/';
+    }
+
+    if (!resolved){
+        if (name[0] == '/' || sched->cwd[0] == '\0'){
+            return arena_strdup(sched->arena, name);
+        }
+        return path_join(sched->arena, sched->cwd, name);
+    }
+    if (*base == '\0') return arena_strdup(sched->arena, dir);
+    return path_join(sched->arena, dir, base);
+}
+
+
+static int line_reads(Schedule *sched, size_t line, const char *word){
+    const char *path = path_key(sched, word);
+    if (path == NULL) return -1;
+    PathUse *use = path_use(sched, path);
+    if (use == NULL) return -1;
+    if (add_dependency(sched, line, use->writer) < 0) return -1;
+    return push_index(sched->arena, &use->readers, &use->nreaders,
+                      &use->readers_cap, line);
+}
+
+
+static int line_writes(Schedule *sched, size_t line, const char *word){
+    const char *path = path_key(sched, word);
+    if (path == NULL) return -1;
+    PathUse *use = path_use(sched, path);
+    if (use == NULL) return -1;
+    if (add_dependency(sched, line, use->writer) < 0) return -1;
+    for (size_t i = 0; i < use->nreaders; i++){
+        if (add_dependency(sched, line, use->readers[i]) < 0) return -1;
+    }
+    use->writer = line;
+    use->nreaders = 0;
+    return 0;
+}
+
+
+// Returns 1 if word is an option (-x, --name), which names no file
+static int is_option(const char *word){
+    return word[0] == '-' && word[1] != '\0';
+}
+
+
+// Returns 1 if command is known to only read the files its arguments name
+static int reads_only(const Command *command){
+    const char *slash = strrchr(command->args[0], '/');
+    const char *name = slash ? slash + 1 : command->args[0];
+    for (int i = 0; READ_ONLY_COMMANDS[i] != NULL; i++){
+        if (strcmp(name, READ_ONLY_COMMANDS[i]) == 0) return 1;
+    }
+    return 0;
+}
+
+
+/*
+** Records what line reads and writes, making it wait for the earlier
+** lines it conflicts with.
+*/
+static int line_dependencies(Schedule *sched, size_t line){
+    for (Command *command = sched->lines[line].commands; command != NULL;
+         command = command->next){
+        if (command->redir_in_path != NULL &&
+            line_reads(sched, line, command->redir_in_path) < 0){
+            return -1;
+        }
+        for (int i = 1; command->args[i] != NULL; i++){
+            if (is_option(command->args[i])) continue;
+            if (line_reads(sched, line, command->args[i]) < 0) return -1;
+        }
+    }
+
+    for (Command *command = sched->lines[line].commands; command != NULL;
+         command = command->next){
+        if (command->redir_out_path != NULL &&
+            line_writes(sched, line, command->redir_out_path) < 0){
+            return -1;
+        }
+        if (reads_only(command)) continue;
+        for (int i = 1; command->args[i] != NULL; i++){
+            if (is_option(command->args[i])) continue;
+            if (line_writes(sched, line, command->args[i]) < 0) return -1;
+        }
+    }
+    return 0;
+}
+
+
+static void push_ready(Schedule *sched, size_t line){
+    sched->ready[sched->ready_tail++] = line;
+}
+
+
+/*
+** Adds a built line to the schedule. Returns 0 on success, -1 on error.
+*/
+static int schedule_add(Schedule *sched, Command *commands){
+    if (sched->count == sched->cap){
+        size_t new_cap = sched->cap ? sched->cap * 2 : SCHED_INIT_LINES;
+        ScriptLine *lines = realloc(sched->lines, new_cap * sizeof(ScriptLine));
+        size_t *ready = lines ? realloc(sched->ready, new_cap * sizeof(size_t)) : NULL;
+        if (lines) sched->lines = lines;
+        if (ready == NULL){
+            perror("schedule");
+            return -1;
+        }
+        sched->ready = ready;
+        sched->cap = new_cap;
+    }
+
+    size_t line = sched->count++;
+    ScriptLine *entry = &sched->lines[line];
+    memset(entry, 0, sizeof(ScriptLine));
+    entry->commands = commands;
+    entry->output_fd = -1;
+    // lines are already concurrent here; '&' adds nothing
+    commands->background = 0;
+
+    if (line_dependencies(sched, line) < 0){
+        sched->count--;
+        return -1;
+    }
+    if (entry->waiting == 0){
+        push_ready(sched, line);
+    }
+    return 0;
+}
+
+
+// Marks line finished and releases the lines waiting for it.
+static void line_finished(Schedule *sched, size_t line){
+    ScriptLine *entry = &sched->lines[line];
+    entry->done = 1;
+    sched->running--;
+    free_command(entry->commands);
+    if (entry->status != 0){
+        sched->failed = 1;
+    }
+
+    for (size_t i = 0; i < entry->ndependents; i++){
+        ScriptLine *dependent = &sched->lines[entry->dependents[i]];
+        if (--dependent->waiting == 0){
+            push_ready(sched, entry->dependents[i]);
+        }
+    }
+    flush_outputs(sched, 0);
+}
+
+
+// Starts the next ready line. Returns 0 on success, -1 if it failed.
+static int launch_line(Schedule *sched, VarTable *variables){
+    size_t line = sched->ready[sched->ready_head++];
+    ScriptLine *entry = &sched->lines[line];
+    int count = count_commands(entry->commands);
+
+    entry->pids = malloc(sizeof(pid_t) * count);
+    if (entry->pids == NULL){
+        perror("malloc");
+        goto launch_fail;
+    }
+    if (open_redirections(entry->commands) < 0){
+        goto launch_fail;
+    }
+
+    // output for the terminal is collected, to be written out in order
+    Command *last = entry->commands;
+    while (last->next != NULL) last = last->next;
+    if (last->redir_out_path == NULL){
+        entry->output_fd = memfd_create("cscshell-line", MFD_CLOEXEC);
+        int stage_fd = entry->output_fd < 0 ? -1 :
+            fcntl(entry->output_fd, F_DUPFD_CLOEXEC, 0);
+        if (stage_fd < 0){
+            perror("schedule");
+            goto launch_fail;
+        }
+        last->stdout_fd = stage_fd;
+    }
+
+    int npids = start_pipeline(entry->commands, variables, entry->pids,
+                               NULL, NULL);
+    if (npids < 0){
+        goto launch_fail;
+    }
+    if (line_reap_start(&entry->reap, entry->pids, npids) < 0){
+        // the stages are running; wait for them the ordinary way
+        wait_pipeline(entry->pids, npids);
+        goto launch_fail;
+    }
+    sched->running++;
+    return 0;
+
+launch_fail:
+    // closes whatever descriptors the line had opened
+    free_command(entry->commands);
+    return -1;
+}
+
+
+/*
+** Collects finished processes of the running lines, sleeping until one
+** exits if block is set. Only the lines' own pids are waited on, so any
+** background jobs are left to the job table.
+*/
+static void reap_lines(Schedule *sched, uint8_t block){
+    sigset_t chld, old;
+    sigemptyset(&chld);
+    sigaddset(&chld, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &chld, &old);
+
+    for (;;){
+        uint8_t reaped = 0;
+        for (size_t line = 0; line < sched->count; line++){
+            ScriptLine *entry = &sched->lines[line];
+            if (entry->done || entry->reap.stages == NULL) continue;
+
+            if (line_reap_poll(&entry->reap) == 0){
+                entry->status = line_reap_code(&entry->reap);
+                line_finished(sched, line);
+                reaped = 1;
+            }
+        }
+        if (reaped || !block) break;
+        sigsuspend(&old);
+    }
+    sigprocmask(SIG_SETMASK, &old, NULL);
+}
+
+
+/*
+** Once everything has finished, makes the last line that ran the one
+** PIPESTATUS reports on, as it would be after a serial run.
+*/
+static void schedule_publish(Schedule *sched, VarTable *variables){
+    for (size_t line = sched->count; line-- > 0; ){
+        const LineReap *reap = &sched->lines[line].reap;
+        if (reap->stages == NULL) continue;
+        if (line_reap_publish(reap) == 0){
+            pipeline_status_export(variables);
+        }
+        return;
+    }
+}
+
+
+/*
+** Starts ready lines while there is room, and collects finished ones.
+** If drain is set, returns only once nothing is running or ready (or a
+** line failed and nothing is running).
+*/
+static void schedule_pump(Schedule *sched, VarTable *variables, uint8_t drain){
+    for (;;){
+        while (!sched->failed && sched->running < sched->max_running &&
+               sched->ready_head < sched->ready_tail){
+            if (launch_line(sched, variables) < 0){
+                sched->failed = 1;
+            }
+        }
+
+        uint8_t pending = sched->running > 0 ||
+            (!sched->failed && sched->ready_head < sched->ready_tail);
+        if (!pending){
+            if (drain) schedule_publish(sched, variables);
+            return;
+        }
+        // stay under the limit while reading on, but finish for a drain
+        if (!drain && sched->running < sched->max_running) {
+            reap_lines(sched, 0);
+            return;
+        }
+        reap_lines(sched, 1);
+    }
+}
+
+
+// Returns non-zero if the line must run in the shell, on its own.
+static int is_barrier(const Command *commands){
+    return commands->next == NULL && commands->builtin != NULL &&
+           commands->builtin->serial;
+}
+
+
+// Returns non-zero if building line runs commands ($(...))
+static int substitutes(const LexedLine *line){
+    for (int t = 0; t < line->count; t++) {
+        if (line->tokens[t].flags & TOKEN_HAS_SUBST) return 1;
+    }
+    return 0;
+}
+
+
+// Returns non-zero if line expands $PIPESTATUS, which the line before sets
+static int reads_pipestatus(const LexedLine *line){
+    for (int t = 0; t < line->count; t++) {
+        const Token *token = &line->tokens[t];
+        if ((token->flags & TOKEN_HAS_VAR) &&
+            memmem(line->lexed + token->start, token->len, PIPESTATUS_VAR_NAME,
+                   strlen(PIPESTATUS_VAR_NAME)) != NULL) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+
+/*
+** Executes an entire script with up to max_running lines at once (see
+** above). Returns 0 on success, -1 on error, like run_script().
+*/
+int run_script_parallel(char *file_path, VarTable *variables, int max_running){
+    Script script;
+    if (script_load(file_path, &script) < 0) {
+        return -1;
+    }
+    int ret = 0;
+
+    // Lines stay built until they have run, so the arena is only reset
+    // once everything read so far has finished (at a barrier)
+    Arena arena;
+    arena_init(&arena);
+    Schedule sched;
+    schedule_init(&sched, &arena, max_running);
+
+    for (size_t i = 0; !sched.failed && i < script.nlines; i++) {
+        if (substitutes(&script.lines[i]) ||
+            reads_pipestatus(&script.lines[i])) {
+            schedule_pump(&sched, variables, 1);
+            if (sched.failed) break;
+        }
+        Command *commands = script_build_line(&script, i, variables, &arena);
+        if (commands == (Command *) -1) {
+            ERR_PRINT(ERR_PARSING_LINE);
+            ret = -1;
+            break;
+        }
+        if (commands == NULL) {
+            continue;
+        }
+
+        if (is_barrier(commands)) {
+            schedule_pump(&sched, variables, 1);
+            if (sched.failed) break;
+
+            int *status = open_redirections(commands) < 0 ?
+                (int *) -1 : execute_line(commands, variables);
+            uint8_t ok = status != NULL && status != (int *) -1 && *status == 0;
+            if (status != (int *) -1) free(status);
+            if (!ok) {
+                ret = -1;
+                break;
+            }
+            schedule_clear(&sched);
+            arena_reset(&arena);
+            continue;
+        }
+
+        if (schedule_add(&sched, commands) < 0) {
+            free_command(commands);
+            ret = -1;
+            break;
+        }
+        schedule_pump(&sched, variables, 0);
+    }
+
+    schedule_pump(&sched, variables, 1);
+    if (sched.failed) ret = -1;
+
+    schedule_free(&sched);
+    arena_free(&arena);
+    script_free(&script);
+    return ret;
+}
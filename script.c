@@ -0,0 +1,229 @@
+#include "cscshell.h"
+#include <sys/mman.h>
+
+/*
+** Script files, loaded whole before they run.
+**
+** The file is mapped privately and writable, so splitting it into lines
+** is a single pass that overwrites each newline with a NUL in place; only
+** a last line with no newline after it is copied out. Every line is then
+** lexed into a copy in the script's arena and its shape checked with
+** check_tokens, so a syntax error anywhere in the file is reported before
+** the first line runs. Blank and comment-only lines are dropped. A line
+** that opens here-documents keeps the lines of their bodies (and their
+** delimiters), newlines and all, as part of its text.
+**
+** Nothing is expanded or resolved while loading: script_build_line does
+** that when the line's turn comes, through the line cache exactly as
+** build_line would, so variables assigned by earlier lines are seen just
+** as they were when scripts were read line by line.
+**
+** Files that can't be mapped (pipes, terminals) are read into memory.
+**
+** The lexed lines are also compiled into the cache (see bytecode.c),
+** keyed by a hash of the file's contents; a later load of the same
+** contents adopts the compiled lines instead of splitting and lexing.
+*/
+
+#define SCRIPT_INIT_LINES 64
+#define SCRIPT_READ_CHUNK 65536
+
+
+// Reads all of fd into a heap buffer, for files that can't be mapped.
+static char *script_read(int fd, size_t *len){
+    size_t cap = SCRIPT_READ_CHUNK;
+    char *buf = malloc(cap);
+    *len = 0;
+    while (buf != NULL){
+        if (*len == cap){
+            char *grown = realloc(buf, cap * 2);
+            if (grown == NULL) break;
+            buf = grown;
+            cap *= 2;
+        }
+        ssize_t n = read(fd, buf + *len, cap - *len);
+        if (n == 0) return buf;
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) break;
+        *len += n;
+    }
+    perror("script");
+    free(buf);
+    return NULL;
+}
+
+
+/*
+** Hashes a script's contents eight bytes at a time; this runs over every
+** script before it is used, so it has to be cheaper than lexing it.
+*/
+static uint64_t content_hash(const char *data, size_t len){
+    uint64_t hash = 0xcbf29ce484222325ull ^ len;
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8){
+        uint64_t word;
+        memcpy(&word, data + i, 8);
+        hash = (hash ^ word) * 0x9e3779b97f4a7c15ull;
+        hash ^= hash >> 29;
+    }
+    for (; i < len; i++){
+        hash = (hash ^ (unsigned char) data[i]) * 0x100000001b3ull;
+    }
+    return hash ^ (hash >> 32);
+}
+
+
+static int script_add_line(Script *script, size_t *cap, const char *text,
+                           const char *file_path, size_t number){
+    LexedLine line;
+    line.text = text;
+    line.number = number;
+    line.lexed = arena_strdup(&script->arena, text);
+    if (line.lexed == NULL) return -1;
+
+    line.count = lex_line(line.lexed, &script->arena, &line.tokens);
+    if (line.count < 0 ||
+        check_tokens(line.lexed, line.tokens, line.count) < 0){
+        ERR_PRINT(ERR_SCRIPT_SYNTAX, file_path, number);
+        return -1;
+    }
+    if (line.count == 0) return 0;
+
+    if (script->nlines == *cap){
+        size_t new_cap = *cap ? *cap * 2 : SCRIPT_INIT_LINES;
+        LexedLine *grown = realloc(script->lines, new_cap * sizeof(LexedLine));
+        if (grown == NULL){
+            perror("script");
+            return -1;
+        }
+        script->lines = grown;
+        *cap = new_cap;
+    }
+    script->lines[script->nlines++] = line;
+    return 0;
+}
+
+
+/*
+** Loads the script at file_path, splitting, lexing and checking every
+** line (see above).
+**
+** Returns 0 on success, -1 if the file can't be read or has a syntax
+** error; nothing needs freeing after a failure.
+*/
+int script_load(const char *file_path, Script *script){
+    script->data = NULL;
+    script->data_len = 0;
+    script->mapped = 0;
+    script->code = NULL;
+    script->code_len = 0;
+    script->hash = 0;
+    script->lines = NULL;
+    script->nlines = 0;
+    arena_init(&script->arena);
+
+    int fd = open(file_path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0){
+        perror("Error opening file");
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)){
+        if (st.st_size == 0){
+            close(fd);
+            return 0;
+        }
+        void *map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED){
+            script->data = map;
+            script->data_len = st.st_size;
+            script->mapped = 1;
+        }
+    }
+    if (!script->mapped){
+        script->data = script_read(fd, &script->data_len);
+    }
+    close(fd);
+    if (script->data == NULL) return -1;
+
+    script->hash = content_hash(script->data, script->data_len);
+    if (bytecode_load(script) == 0) return 0;
+
+    size_t cap = 0;
+    size_t number = 0;
+    char *p = script->data;
+    char *end = script->data + script->data_len;
+    while (p < end){
+        long extent = heredoc_extent(p, end - p, &script->arena);
+        number++;
+        if (extent < 0){
+            ERR_PRINT(ERR_SCRIPT_SYNTAX, file_path, number);
+            script_free(script);
+            return -1;
+        }
+
+        const char *text = p;
+        size_t first = number;
+        for (char *q = memchr(p, '\n', extent); q != NULL;
+             q = memchr(q + 1, '\n', p + extent - q - 1)){
+            number++;
+        }
+        if (p + extent < end){
+            p[extent] = '\0';
+            p += extent + 1;
+        }
+        else {
+            text = arena_strndup(&script->arena, p, end - p);
+            p = end;
+        }
+
+        if (text == NULL ||
+            script_add_line(script, &cap, text, file_path, first) < 0){
+            script_free(script);
+            return -1;
+        }
+    }
+    bytecode_save(script);
+    return 0;
+}
+
+
+/*
+** Returns the commands for line i of script, from the line cache or
+** built afresh in arena (the script must outlive them). No redirections
+** are opened.
+**
+** Returns the same values as build_line.
+*/
+Command *script_build_line(Script *script, size_t i, VarTable *variables,
+                           Arena *arena){
+    LexedLine *line = &script->lines[i];
+    Command *commands = line_cache_get(line->text, arena);
+    if (commands != NULL) return commands;
+
+    // plain words are used straight from the lexed copy, which lives as
+    // long as the script
+    return line_cache_build_lexed(line->text, line->lexed, line->tokens,
+                                  line->count, variables, arena);
+}
+
+
+void script_free(Script *script){
+    if (script->mapped){
+        munmap(script->data, script->data_len);
+    }
+    else {
+        free(script->data);
+    }
+    if (script->code != NULL){
+        munmap(script->code, script->code_len);
+    }
+    free(script->lines);
+    arena_free(&script->arena);
+    script->data = NULL;
+    script->code = NULL;
+    script->lines = NULL;
+    script->nlines = 0;
+}
@@ -0,0 +1,205 @@
+#include "cscshell.h"
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/*
+** Resident server mode (--serve SOCKET).
+**
+** After the init script has run, the shell listens on a Unix domain
+** socket instead of reading a script, so clients get a warm shell:
+** variables, the executable hash table and the line cache all persist
+** from one request to the next.
+**
+** A request is a uint32 line length followed by the line itself; the
+** client's stdin, stdout and stderr travel with the length as SCM_RIGHTS
+** ancillary data. The server puts those descriptors in place of its own
+** for the duration of the line, so builtins and children read and write
+** the client's stdio directly, runs the line with execute_line() and
+** answers with an int32 exit status (see serve_exit_code). A connection
+** may carry any number of requests; they are served one at a time. An
+** `exit` ends its request rather than the server.
+*/
+
+static int serve_exit_code(const int *status){
+    if (status == NULL) return 0;
+    if (status == (int *) -1 || *status == -1) return SERVE_STATUS_ERROR;
+    return *status & 0xff;
+}
+
+
+// Closes every descriptor that arrived with msg, whatever its shape
+static void close_received(struct msghdr *msg){
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(msg); cmsg != NULL;
+         cmsg = CMSG_NXTHDR(msg, cmsg)){
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS){
+            continue;
+        }
+        size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for (size_t i = 0; i < count; i++){
+            int fd;
+            memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+            close(fd);
+        }
+    }
+}
+
+
+/*
+** Reads the next request from client: its line (into *line, grown as
+** needed) and its three stdio descriptors.
+**
+** Returns 1 on success, 0 when the client has hung up, -1 on a malformed
+** request.
+*/
+static int serve_read_request(int client, char **line, size_t *cap, int fds[3]){
+    uint32_t len;
+    char control[CMSG_SPACE(3 * sizeof(int))];
+    struct iovec iov = {&len, sizeof(len)};
+    struct msghdr msg = {0};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    ssize_t got = recvmsg(client, &msg, MSG_CMSG_CLOEXEC | MSG_WAITALL);
+    if (got < 0) return -1;
+    if (got == 0 && msg.msg_controllen == 0) return 0;
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (got != sizeof(len) || (msg.msg_flags & MSG_CTRUNC) || cmsg == NULL ||
+        cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS ||
+        cmsg->cmsg_len != CMSG_LEN(3 * sizeof(int)) ||
+        CMSG_NXTHDR(&msg, cmsg) != NULL){
+        close_received(&msg);
+        return -1;
+    }
+    memcpy(fds, CMSG_DATA(cmsg), 3 * sizeof(int));
+
+    if (len > SERVE_MAX_LINE) goto bad_request;
+    if (len + 1 > *cap){
+        char *grown = realloc(*line, len + 1);
+        if (grown == NULL) goto bad_request;
+        *line = grown;
+        *cap = len + 1;
+    }
+    if (len > 0 && recv(client, *line, len, MSG_WAITALL) != (ssize_t) len){
+        goto bad_request;
+    }
+    (*line)[len] = '\0';
+    return 1;
+
+bad_request:
+    for (int i = 0; i < 3; i++) close(fds[i]);
+    return -1;
+}
+
+
+// Runs one line with the client's stdio in place of the shell's own.
+static int serve_line(char *line, int fds[3], const int saved[3],
+                      VarTable *variables, Arena *arena){
+    fflush(stdout);
+    fflush(stderr);
+    for (int i = 0; i < 3; i++){
+        dup2(fds[i], i);
+        close(fds[i]);
+    }
+
+    int code;
+    Command *commands = parse_line(line, variables, arena);
+    if (commands == (Command *) -1){
+        ERR_PRINT(ERR_PARSING_LINE);
+        code = SERVE_STATUS_ERROR;
+    }
+    else if (commands == NULL){
+        code = 0;
+    }
+    else {
+        int *status = execute_line(commands, variables);
+        code = serve_exit_code(status);
+        if (status != NULL && status != (int *) -1) free(status);
+    }
+
+    fflush(stdout);
+    fflush(stderr);
+    clearerr(stdin);
+    for (int i = 0; i < 3; i++){
+        dup2(saved[i], i);
+    }
+    arena_reset(arena);
+    return code;
+}
+
+
+/*
+** Serves command lines on the Unix socket at socket_path until the
+** shell is killed (see above).
+**
+** Returns -1 if the socket could not be set up.
+*/
+int run_server(const char *socket_path, VarTable *variables){
+    struct sockaddr_un addr = {0};
+    addr.sun_family = AF_UNIX;
+    if (strlen(socket_path) >= sizeof(addr.sun_path)){
+        ERR_PRINT(ERR_SERVE_PATH, socket_path);
+        return -1;
+    }
+    strcpy(addr.sun_path, socket_path);
+
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock < 0){
+        perror("socket");
+        return -1;
+    }
+    unlink(socket_path);
+    if (bind(sock, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+        listen(sock, SOMAXCONN) < 0){
+        perror(socket_path);
+        close(sock);
+        return -1;
+    }
+
+    // the shell's own stdio, put back after every line
+    int saved[3];
+    for (int i = 0; i < 3; i++){
+        saved[i] = fcntl(i, F_DUPFD_CLOEXEC, 3);
+        if (saved[i] < 0){
+            perror("serve");
+            close(sock);
+            return -1;
+        }
+    }
+
+    Arena arena;
+    arena_init(&arena);
+    char *line = NULL;
+    size_t cap = 0;
+
+    for (;;){
+        int client = accept4(sock, NULL, NULL, SOCK_CLOEXEC);
+        if (client < 0){
+            if (errno == EINTR) continue;
+            perror("accept");
+            break;
+        }
+
+        int fds[3];
+        int got;
+        while ((got = serve_read_request(client, &line, &cap, fds)) > 0){
+            jobs_reap();
+            int32_t code = serve_line(line, fds, saved, variables, &arena);
+            if (send(client, &code, sizeof(code), MSG_NOSIGNAL) != sizeof(code)){
+                break;
+            }
+        }
+        if (got < 0){
+            ERR_PRINT(ERR_SERVE_REQUEST);
+        }
+        close(client);
+    }
+
+    free(line);
+    arena_free(&arena);
+    for (int i = 0; i < 3; i++) close(saved[i]);
+    close(sock);
+    return -1;
+}
@@ -0,0 +1,216 @@
+#include "cscshell.h"
+#include <sys/mman.h>
+#include <limits.h>
+
+/*
+** Startup snapshot of the init file.
+**
+** Running the init file means reading, lexing and expanding it line by
+** line on every start. When it only assigns variables (so running it has
+** no effect besides the variables it leaves behind), the resulting table
+** is written to $XDG_CACHE_HOME/cscshell (or ~/.cache/cscshell) and later
+** shells mmap that file and adopt the variables straight from it.
+**
+** A snapshot is keyed on the init file's absolute path, device, inode,
+** size and mtime; if any of them no longer match, or the format version
+** has changed, the init file is run in full and the snapshot rewritten.
+** An init file that runs commands is never snapshotted, since what the
+** commands did can't be replayed from the variables alone. Executable
+** locations aren't part of the snapshot: the exec index (exec_index.c)
+** already shares those between shells, stamped with the PATH directories.
+**
+** Layout (native endian, all offsets from the start of the file):
+**
+**   SnapshotHeader | SnapshotVar[nvars] | strings...
+*/
+
+#define SNAPSHOT_MAGIC "CSCS"
+#define SNAPSHOT_VERSION 1
+
+typedef struct SnapshotHeader {
+    char magic[4];
+    uint32_t version;
+    uint32_t size;
+    uint32_t path_off;
+    uint32_t nvars;
+    uint32_t pad;
+    uint64_t init_dev;
+    uint64_t init_ino;
+    int64_t init_size;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+} SnapshotHeader;
+
+typedef struct SnapshotVar {
+    uint32_t name_off;
+    uint32_t value_off;
+} SnapshotVar;
+
+typedef struct SnapshotBuild {
+    char *buf;
+    size_t len;
+    size_t cap;
+} SnapshotBuild;
+
+
+/*
+** Resolves init_file to an absolute path (into real) and the snapshot
+** file for it (into file_path), and stats it. Returns 0 on success, -1 if
+** the init file or the cache directory can't be used.
+*/
+static int snapshot_locate(const char *init_file, char *real, char *file_path,
+                           size_t buflen, struct stat *st){
+    char dir[MAX_PATH_STR];
+    if (realpath(init_file, real) == NULL || stat(real, st) < 0 ||
+        cache_dir_path(dir, sizeof(dir)) < 0){
+        return -1;
+    }
+
+    uint32_t hash = fnv1a_hash(real, strlen(real));
+    if (snprintf(file_path, buflen, "%s/init-%08x.snap", dir, hash) >=
+        (int) buflen){
+        return -1;
+    }
+    return 0;
+}
+
+
+static int snapshot_matches(const SnapshotHeader *header, size_t len,
+                            const char *real, const struct stat *st){
+    const char *base = (const char *) header;
+    return len >= sizeof(SnapshotHeader) &&
+        memcmp(header->magic, SNAPSHOT_MAGIC, 4) == 0 &&
+        header->version == SNAPSHOT_VERSION &&
+        header->size == len && base[len - 1] == '\0' &&
+        header->path_off < len &&
+        sizeof(SnapshotHeader) + (size_t) header->nvars * sizeof(SnapshotVar)
+            <= len &&
+        header->init_dev == (uint64_t) st->st_dev &&
+        header->init_ino == (uint64_t) st->st_ino &&
+        header->init_size == (int64_t) st->st_size &&
+        header->mtime_sec == (int64_t) st->st_mtim.tv_sec &&
+        header->mtime_nsec == (int64_t) st->st_mtim.tv_nsec &&
+        strcmp(base + header->path_off, real) == 0;
+}
+
+
+/*
+** Adopts the snapshot of init_file into variables (which should be
+** empty). Returns 0 if the snapshot was fresh and adopted, -1 if the init
+** file has to be run instead.
+*/
+int snapshot_load(const char *init_file, VarTable *variables){
+    char real[PATH_MAX];
+    char file_path[MAX_PATH_STR];
+    struct stat init_st;
+    if (snapshot_locate(init_file, real, file_path, sizeof(file_path),
+                        &init_st) < 0){
+        return -1;
+    }
+
+    int fd = open(file_path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t) st.st_size < sizeof(SnapshotHeader)){
+        close(fd);
+        return -1;
+    }
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return -1;
+
+    const SnapshotHeader *header = map;
+    int ret = -1;
+    if (snapshot_matches(header, st.st_size, real, &init_st)){
+        const char *base = map;
+        const SnapshotVar *vars = (const SnapshotVar *) (header + 1);
+        ret = 0;
+        for (uint32_t i = 0; i < header->nvars; i++){
+            if (vars[i].name_off >= header->size ||
+                vars[i].value_off >= header->size){
+                ret = -1;
+                break;
+            }
+            const char *name = base + vars[i].name_off;
+            if (var_set(variables, name, strlen(name),
+                        base + vars[i].value_off) == NULL){
+                ret = -1;
+                break;
+            }
+        }
+        // a damaged snapshot must not leave half a table behind
+        if (ret < 0) var_table_free(variables);
+    }
+    munmap(map, st.st_size);
+    return ret;
+}
+
+
+static uint32_t snapshot_string(SnapshotBuild *build, const char *str){
+    size_t len = strlen(str) + 1;
+    if (build->len + len > build->cap){
+        size_t new_cap = build->cap ? build->cap : 4096;
+        while (build->len + len > new_cap) new_cap *= 2;
+        char *new_buf = realloc(build->buf, new_cap);
+        if (new_buf == NULL) return 0;
+        build->buf = new_buf;
+        build->cap = new_cap;
+    }
+    uint32_t off = build->len;
+    memcpy(build->buf + off, str, len);
+    build->len += len;
+    return off;
+}
+
+
+/*
+** Writes variables out as the snapshot of init_file. Failure is not an
+** error: the next shell just runs the init file again.
+*/
+void snapshot_save(const char *init_file, VarTable *variables){
+    char real[PATH_MAX];
+    char file_path[MAX_PATH_STR];
+    struct stat st;
+    if (snapshot_locate(init_file, real, file_path, sizeof(file_path),
+                        &st) < 0){
+        return;
+    }
+
+    size_t fixed = sizeof(SnapshotHeader) + variables->count * sizeof(SnapshotVar);
+    SnapshotBuild build = {calloc(1, fixed), fixed, fixed};
+    if (build.buf == NULL) return;
+
+    uint32_t path_off = snapshot_string(&build, real);
+    uint32_t i = 0;
+    for (Variable *var = variables->head; var != NULL && path_off != 0;
+         var = var->next, i++){
+        SnapshotVar entry;
+        entry.name_off = snapshot_string(&build, var->name);
+        entry.value_off = snapshot_string(&build, var->value);
+        if (entry.name_off == 0 || entry.value_off == 0){
+            path_off = 0;
+            break;
+        }
+        memcpy(build.buf + sizeof(SnapshotHeader) + i * sizeof(SnapshotVar),
+               &entry, sizeof(entry));
+    }
+    if (path_off == 0 || build.len > UINT32_MAX){
+        free(build.buf);
+        return;
+    }
+
+    SnapshotHeader *header = (SnapshotHeader *) build.buf;
+    memcpy(header->magic, SNAPSHOT_MAGIC, 4);
+    header->version = SNAPSHOT_VERSION;
+    header->size = build.len;
+    header->path_off = path_off;
+    header->nvars = i;
+    header->init_dev = st.st_dev;
+    header->init_ino = st.st_ino;
+    header->init_size = st.st_size;
+    header->mtime_sec = st.st_mtim.tv_sec;
+    header->mtime_nsec = st.st_mtim.tv_nsec;
+
+    cache_file_write(file_path, build.buf, build.len);
+    free(build.buf);
+}
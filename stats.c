@@ -0,0 +1,161 @@
+#include "cscshell.h"
+
+/*
+** Aggregate statistics (the `stats` builtin and --stats).
+**
+** Unlike the timeline (trace.c), these are always kept: a count and a
+** latency histogram for each phase of running a line, plus the cache and
+** arena counters kept elsewhere. Recording a sample is two clock reads
+** and a few increments, so nothing has to be switched on beforehand.
+**
+** The phases overlap: expansions and lookups happen while a line is
+** parsed, and a line's time includes starting and waiting for its
+** children. Child runtime covers every child the shell reaps, foreground
+** or not, from its start until it is collected.
+**
+** Histograms are log-linear, HdrHistogram style: values below 16 ns get a
+** bucket each, and every power of two above that is split into 16 equal
+** buckets, so any percentile is within 1/16 (6.25%) of the true value
+** whatever its magnitude, in a fixed 976 buckets per phase.
+*/
+
+#define HIST_SUB_BITS 4
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) * HIST_SUB)
+
+typedef struct Histogram {
+    uint64_t count;
+    uint64_t total;
+    uint64_t min;
+    uint64_t max;
+    uint64_t buckets[HIST_BUCKETS];
+} Histogram;
+
+static const char *const phase_names[STAT_PHASES] = {
+    [STAT_PARSE] = "parse_line",
+    [STAT_EXPAND] = "expand",
+    [STAT_RESOLVE] = "resolve",
+    [STAT_SPAWN] = "spawn",
+    [STAT_CHILD] = "child",
+    [STAT_LINE] = "execute_line",
+};
+
+static Histogram histograms[STAT_PHASES];
+static pid_t stats_pid = 0;
+
+
+static unsigned bucket_of(uint64_t value){
+    if (value < HIST_SUB) return value;
+    int exp = 63 - __builtin_clzll(value);
+    return (exp - HIST_SUB_BITS + 1) * HIST_SUB +
+        ((value >> (exp - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+
+// The highest value that falls in bucket
+static uint64_t bucket_top(unsigned bucket){
+    if (bucket < HIST_SUB) return bucket;
+    unsigned shift = bucket / HIST_SUB - 1;
+    uint64_t low = (uint64_t) (HIST_SUB + bucket % HIST_SUB) << shift;
+    return low + ((uint64_t) 1 << shift) - 1;
+}
+
+
+/*
+** Adds the time from start (a trace_now() timestamp) until now to
+** phase's histogram. Returns now.
+*/
+uint64_t stats_record(StatPhase phase, uint64_t start){
+    uint64_t now = trace_now();
+    uint64_t elapsed = now > start ? now - start : 0;
+    Histogram *hist = &histograms[phase];
+    if (hist->count == 0 || elapsed < hist->min) hist->min = elapsed;
+    if (elapsed > hist->max) hist->max = elapsed;
+    hist->count++;
+    hist->total += elapsed;
+    hist->buckets[bucket_of(elapsed)]++;
+    return now;
+}
+
+
+// The value below which fraction of the samples lie, capped at the max
+static uint64_t percentile(const Histogram *hist, double fraction){
+    uint64_t rank = (uint64_t) (fraction * hist->count + 0.5);
+    if (rank == 0) rank = 1;
+    uint64_t seen = 0;
+    for (unsigned i = 0; i < HIST_BUCKETS; i++){
+        seen += hist->buckets[i];
+        if (seen >= rank){
+            uint64_t top = bucket_top(i);
+            return top < hist->max ? top : hist->max;
+        }
+    }
+    return hist->max;
+}
+
+
+/*
+** Prints every phase's count and latencies (in microseconds), then the
+** cache and allocation counters, to out.
+*/
+void stats_print(FILE *out){
+    fprintf(out, "%-14s %9s %11s %9s %9s %9s %9s %9s\n", "phase", "count",
+            "total ms", "mean us", "p50 us", "p90 us", "p99 us", "max us");
+    for (int i = 0; i < STAT_PHASES; i++){
+        const Histogram *hist = &histograms[i];
+        if (hist->count == 0){
+            fprintf(out, "%-14s %9d\n", phase_names[i], 0);
+            continue;
+        }
+        fprintf(out, "%-14s %9llu %11.3f %9.1f %9.1f %9.1f %9.1f %9.1f\n",
+                phase_names[i], (unsigned long long) hist->count,
+                hist->total / 1e6, (double) hist->total / hist->count / 1e3,
+                percentile(hist, 0.5) / 1e3, percentile(hist, 0.9) / 1e3,
+                percentile(hist, 0.99) / 1e3, hist->max / 1e3);
+    }
+
+    unsigned long hits, misses;
+    exec_cache_counts(&hits, &misses);
+    fprintf(out, "resolve cache: %lu hits, %lu misses\n", hits, misses);
+    line_cache_counts(&hits, &misses);
+    fprintf(out, "line cache: %lu hits, %lu misses\n", hits, misses);
+    fprintf(out, "arena: %lu allocations, %lu bytes; %lu blocks, %lu bytes "
+            "malloc'd\n", arena_stats.allocs, arena_stats.bytes,
+            arena_stats.blocks, arena_stats.block_bytes);
+    fflush(out);
+}
+
+
+/*
+** Implements the `stats` builtin: prints the statistics so far, or
+** clears the histograms with `stats -r`. Returns 0, or 2 on a usage
+** error.
+*/
+int stats_cscshell(char **args){
+    if (args[1] == NULL){
+        stats_print(stdout);
+        return 0;
+    }
+    if (strcmp(args[1], "-r") == 0 && args[2] == NULL){
+        memset(histograms, 0, sizeof(histograms));
+        return 0;
+    }
+    ERR_PRINT(ERR_STATS_USAGE);
+    return 2;
+}
+
+
+// Prints the statistics on stderr as the shell (not a forked child) exits
+static void stats_exit(void){
+    if (getpid() == stats_pid) stats_print(stderr);
+}
+
+
+/*
+** Implements --stats: the statistics are printed on stderr when the
+** shell exits.
+*/
+void stats_at_exit(void){
+    stats_pid = getpid();
+    atexit(stats_exit);
+}
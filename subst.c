@@ -0,0 +1,231 @@
+#include "cscshell.h"
+#include <sys/mman.h>
+
+/*
+** Command substitution: $(LINE) in a word is replaced by what LINE
+** prints, with trailing newlines removed. Substitutions nest, since LINE
+** is parsed (and so expanded) like any other line before it runs, and the
+** output is kept as one word, as variable values are.
+**
+** LINE is run with execute_line, its last stage writing into a pipe.
+** The pipe is made the active capture, which run_line drains with large
+** reads into a growing buffer as soon as the stages have started, so
+** output of any size never stalls them. A lone builtin runs in the shell
+** without a fork, writing into a memfd that is read back afterwards,
+** since nothing could drain a pipe while it runs; builtins that change
+** the shell run in a child instead, as they would in a subshell. So does
+** a whole LINE that assigns variables, so they never reach the shell.
+**
+** Lines with a substitution are never line-cached, as their commands
+** have to run every time the line does.
+*/
+
+#define CAPTURE_CHUNK 65536
+
+Capture *active_capture = NULL;
+
+
+/*
+** Reads capture's descriptor to the end, into its buffer. Returns 0, or
+** -1 on a read or allocation error.
+*/
+int capture_read(Capture *capture){
+    for (;;){
+        if (capture->cap - capture->len < CAPTURE_CHUNK){
+            size_t new_cap = capture->cap ? capture->cap * 2 : CAPTURE_CHUNK;
+            while (new_cap - capture->len < CAPTURE_CHUNK) new_cap *= 2;
+            char *grown = realloc(capture->buf, new_cap);
+            if (grown == NULL){
+                perror("capture");
+                return -1;
+            }
+            capture->buf = grown;
+            capture->cap = new_cap;
+        }
+        ssize_t n = read(capture->fd, capture->buf + capture->len,
+                         capture->cap - capture->len);
+        if (n == 0) return 0;
+        if (n < 0){
+            if (errno == EINTR) continue;
+            perror("capture");
+            return -1;
+        }
+        capture->len += n;
+    }
+}
+
+
+/*
+** Points the last stage of commands at a new capture, returning the
+** descriptor to read it from, or -1 on error. in_shell picks a memfd
+** over a pipe.
+*/
+static int capture_open(Command *commands, uint8_t in_shell){
+    Command *last = commands;
+    while (last->next != NULL) last = last->next;
+
+    int fds[2];
+    if (in_shell && (fds[0] = memfd_create("cscshell-subst", MFD_CLOEXEC)) >= 0){
+        fds[1] = fcntl(fds[0], F_DUPFD_CLOEXEC, 0);
+        if (fds[1] < 0){
+            close(fds[0]);
+            return -1;
+        }
+    }
+    else if (make_pipe(fds) < 0){
+        return -1;
+    }
+
+    // a redirected stage keeps its file; there is nothing to capture
+    if (last->stdout_fd != STDOUT_FILENO){
+        close(fds[1]);
+    }
+    else {
+        last->stdout_fd = fds[1];
+    }
+    return fds[0];
+}
+
+
+/*
+** Runs commands with their output going into capture (see above),
+** setting *status to the line's exit code (-1 if it couldn't be run).
+** Returns 0, or -1 if the output could not be captured.
+*/
+static int run_captured(Command *commands, VarTable *variables,
+                        Capture *capture, int *status){
+    // decided as if captured, so a builtin changing the shell forks
+    Capture *outer = active_capture;
+    active_capture = capture;
+    uint8_t in_shell = runs_in_shell(commands);
+    capture->fd = capture_open(commands, in_shell);
+    if (capture->fd < 0){
+        perror("capture");
+        active_capture = outer;
+        free_command(commands);
+        return -1;
+    }
+    // only a pipe is drained as the line runs
+    if (in_shell) active_capture = NULL;
+
+    int *ret = execute_line(commands, variables);
+    active_capture = outer;
+    *status = ret != NULL && ret != (int *) -1 ? *ret : -1;
+    if (ret != (int *) -1) free(ret);
+
+    if (in_shell && (lseek(capture->fd, 0, SEEK_SET) < 0 ||
+                     capture_read(capture) < 0)){
+        return -1;
+    }
+    return 0;
+}
+
+
+/*
+** Runs line in a child of the shell, as a subshell would, so the
+** variables it assigns stay there; its output comes back on a pipe.
+** Sets *status to the line's exit code. Returns 0, or -1 if it could not
+** be run or its output could not be captured.
+*/
+static int run_forked(char *line, VarTable *variables, Capture *capture,
+                      int *status){
+    int fds[2];
+    if (make_pipe(fds) < 0) return -1;
+    // the child would otherwise flush the shell's pending output again
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0){
+        perror("fork");
+        close(fds[0]);
+        close(fds[1]);
+        return -1;
+    }
+    if (pid == 0){
+        builtin_child();
+        active_capture = NULL;
+        close(fds[0]);
+        dup2(fds[1], STDOUT_FILENO);
+        close(fds[1]);
+
+        Arena arena;
+        arena_init(&arena);
+        int code = 0;
+        Command *commands = parse_line(line, variables, &arena);
+        if (commands == (Command *) -1){
+            code = 1;
+        }
+        else if (commands != NULL){
+            int *ret = execute_line(commands, variables);
+            code = ret != NULL && ret != (int *) -1 ? *ret : 1;
+        }
+        fflush(stdout);
+        _exit(code & 0xff);
+    }
+
+    close(fds[1]);
+    capture->fd = fds[0];
+    int ret = capture_read(capture);
+    int wait_status;
+    while (waitpid(pid, &wait_status, 0) < 0){
+        if (errno != EINTR){
+            perror("waitpid");
+            return -1;
+        }
+    }
+    *status = exit_code(wait_status);
+    return ret;
+}
+
+
+/*
+** Runs the len bytes at text as a line and returns its output on the
+** heap, without trailing newlines, or NULL if it could not be run.
+*/
+char *command_output(const char *text, size_t len, VarTable *variables){
+    uint64_t start = trace_on ? trace_now() : 0;
+    char *line = strndup(text, len);
+    if (line == NULL){
+        perror("strndup");
+        return NULL;
+    }
+    Arena arena;
+    arena_init(&arena);
+    Capture capture = {-1, NULL, 0, 0};
+    int status = 0;
+    int ret = 0;
+
+    int assigns = line_assigns(line, &arena);
+    Command *commands = assigns == 0 ?
+        parse_line(line, variables, &arena) : NULL;
+    if (assigns < 0 || commands == (Command *) -1){
+        // lex_line or parse_line has said why; the enclosing line reports
+        // the failure
+        ret = -1;
+    }
+    else if (assigns > 0){
+        ret = run_forked(line, variables, &capture, &status);
+    }
+    else if (commands != NULL){
+        ret = run_captured(commands, variables, &capture, &status);
+    }
+    if (capture.fd >= 0) close(capture.fd);
+    if (trace_on){
+        trace_span("substitution", start, line, status);
+    }
+    free(line);
+    arena_free(&arena);
+
+    if (ret == 0 && capture.buf == NULL){
+        capture.buf = malloc(1);
+        if (capture.buf == NULL) perror("malloc");
+    }
+    if (ret < 0 || capture.buf == NULL){
+        free(capture.buf);
+        return NULL;
+    }
+    while (capture.len > 0 && capture.buf[capture.len - 1] == '\n'){
+        capture.len--;
+    }
+    capture.buf[capture.len] = '\0';
+    return capture.buf;
+}
@@ -0,0 +1,274 @@
+#include "cscshell.h"
+#include <time.h>
+
+/*
+** Execution timeline (--trace FILE).
+**
+** Spans are recorded as the shell works: each script line, its parse,
+** every executable lookup, every process start, the wait for a line's
+** stages, and the life of every child from its start until it is reaped
+** (with its exit status and resource usage). Events are appended to an
+** in-memory array, their text to a string pool, and nothing is formatted
+** until the shell exits, when the whole timeline is written out as
+** Chrome trace-event JSON (load it in Perfetto or chrome://tracing).
+**
+** The shell's own spans go on its own track; each child gets a track of
+** its own, named after its pid and argv[0]. Call sites test trace_on
+** before recording a span, so a shell without --trace pays one branch
+** per span. Children are followed from start to reap even then, since
+** their runtime is also a statistic (see stats.c).
+*/
+
+#define TRACE_INIT_EVENTS 1024
+#define TRACE_DETAIL_MAX 120
+#define TRACE_NO_STATUS INT32_MIN
+
+typedef struct TraceEvent {
+    const char *name;
+    uint64_t start;
+    uint64_t dur;
+    uint32_t detail_off;
+    pid_t track;
+    int status;
+    uint8_t has_usage;
+    struct rusage usage;
+} TraceEvent;
+
+// A child that has started but not yet been reaped
+typedef struct TraceChild {
+    pid_t pid;
+    uint64_t start;
+    uint32_t detail_off;
+} TraceChild;
+
+uint8_t trace_on = 0;
+
+static FILE *trace_file = NULL;
+static pid_t trace_pid = 0;
+static TraceEvent *events = NULL;
+static size_t events_count = 0;
+static size_t events_cap = 0;
+static char *pool = NULL;
+static size_t pool_len = 0;
+static size_t pool_cap = 0;
+static TraceChild *children = NULL;
+static size_t children_count = 0;
+static size_t children_cap = 0;
+
+
+uint64_t trace_now(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+
+/*
+** Copies at most TRACE_DETAIL_MAX bytes of detail into the string pool.
+** Returns its offset; offset 0 is the empty string.
+*/
+static uint32_t pool_add(const char *detail){
+    if (detail == NULL || *detail == '\0' || pool == NULL) return 0;
+    size_t len = strnlen(detail, TRACE_DETAIL_MAX);
+    if (pool_len + len + 1 > pool_cap){
+        size_t new_cap = pool_cap * 2;
+        while (pool_len + len + 1 > new_cap) new_cap *= 2;
+        char *grown = realloc(pool, new_cap);
+        if (grown == NULL) return 0;
+        pool = grown;
+        pool_cap = new_cap;
+    }
+    uint32_t off = pool_len;
+    memcpy(pool + off, detail, len);
+    pool[off + len] = '\0';
+    pool_len += len + 1;
+    return off;
+}
+
+
+static TraceEvent *event_add(const char *name, uint64_t start, uint64_t end){
+    if (events_count == events_cap){
+        size_t new_cap = events_cap ? events_cap * 2 : TRACE_INIT_EVENTS;
+        TraceEvent *grown = realloc(events, new_cap * sizeof(TraceEvent));
+        if (grown == NULL) return NULL;
+        events = grown;
+        events_cap = new_cap;
+    }
+    TraceEvent *event = &events[events_count++];
+    event->name = name;
+    event->start = start;
+    event->dur = end > start ? end - start : 0;
+    event->detail_off = 0;
+    event->track = trace_pid;
+    event->status = TRACE_NO_STATUS;
+    event->has_usage = 0;
+    return event;
+}
+
+
+/*
+** Records a span of the shell's own work that began at start (from
+** trace_now) and ends now. name must be a string constant; detail is
+** copied, and status is recorded with the span unless it is negative.
+*/
+void trace_span(const char *name, uint64_t start, const char *detail,
+                int status){
+    TraceEvent *event = event_add(name, start, trace_now());
+    if (event == NULL) return;
+    event->detail_off = pool_add(detail);
+    if (status >= 0) event->status = status;
+}
+
+
+/*
+** Records that child pid, running argv0, was started at start. argv0 is
+** only kept when tracing.
+*/
+void trace_child_start(pid_t pid, uint64_t start, const char *argv0){
+    if (children_count == children_cap){
+        size_t new_cap = children_cap ? children_cap * 2 : 16;
+        TraceChild *grown = realloc(children, new_cap * sizeof(TraceChild));
+        if (grown == NULL) return;
+        children = grown;
+        children_cap = new_cap;
+    }
+    TraceChild *child = &children[children_count++];
+    child->pid = pid;
+    child->start = start;
+    child->detail_off = trace_on ? pool_add(argv0) : 0;
+}
+
+
+/*
+** Records that child pid has been reaped with the raw wait status
+** status, and its resource usage if usage is not NULL.
+*/
+void trace_child_end(pid_t pid, int status, const struct rusage *usage){
+    for (size_t i = 0; i < children_count; i++){
+        if (children[i].pid != pid) continue;
+
+        uint64_t end = stats_record(STAT_CHILD, children[i].start);
+        TraceEvent *event = trace_on ?
+            event_add("process", children[i].start, end) : NULL;
+        if (event != NULL){
+            event->detail_off = children[i].detail_off;
+            event->track = pid;
+            event->status = exit_code(status);
+            if (usage != NULL){
+                event->has_usage = 1;
+                event->usage = *usage;
+            }
+        }
+        children[i] = children[--children_count];
+        return;
+    }
+}
+
+
+static void json_string(const char *str){
+    fputc('"', trace_file);
+    for (const unsigned char *p = (const unsigned char *) str; *p; p++){
+        if (*p == '"' || *p == '\\'){
+            fprintf(trace_file, "\\%c", *p);
+        }
+        else if (*p < 0x20){
+            fprintf(trace_file, "\\u%04x", *p);
+        }
+        else {
+            fputc(*p, trace_file);
+        }
+    }
+    fputc('"', trace_file);
+}
+
+
+static long timeval_us(struct timeval tv){
+    return tv.tv_sec * 1000000L + tv.tv_usec;
+}
+
+
+/*
+** Writes the timeline out as Chrome trace-event JSON. Registered with
+** atexit by trace_open, and only acts in the shell itself, not in a
+** forked child that exits.
+*/
+static void trace_flush(void){
+    if (trace_file == NULL || getpid() != trace_pid) return;
+
+    // children still running when the shell exits end here
+    while (children_count > 0){
+        trace_child_end(children[0].pid, 0, NULL);
+    }
+
+    fprintf(trace_file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    fprintf(trace_file, "{\"ph\":\"M\",\"name\":\"process_name\",\"pid\":%d,"
+            "\"tid\":%d,\"args\":{\"name\":\"cscshell\"}}", trace_pid,
+            trace_pid);
+
+    for (size_t i = 0; i < events_count; i++){
+        const TraceEvent *event = &events[i];
+        const char *detail = pool + event->detail_off;
+        if (event->track != trace_pid){
+            fprintf(trace_file, ",\n{\"ph\":\"M\",\"name\":\"thread_name\","
+                    "\"pid\":%d,\"tid\":%d,\"args\":{\"name\":", trace_pid,
+                    event->track);
+            char track_name[TRACE_DETAIL_MAX + 32];
+            snprintf(track_name, sizeof(track_name), "%d %s",
+                     (int) event->track, detail);
+            json_string(track_name);
+            fprintf(trace_file, "}}");
+        }
+
+        fprintf(trace_file, ",\n{\"ph\":\"X\",\"cat\":\"cscshell\",\"name\":");
+        json_string(event->name);
+        fprintf(trace_file, ",\"pid\":%d,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f,"
+                "\"args\":{", trace_pid, event->track, event->start / 1e3,
+                event->dur / 1e3);
+        fprintf(trace_file, "\"detail\":");
+        json_string(detail);
+        if (event->track != trace_pid){
+            fprintf(trace_file, ",\"pid\":%d", (int) event->track);
+        }
+        if (event->status != TRACE_NO_STATUS){
+            fprintf(trace_file, ",\"status\":%d", event->status);
+        }
+        if (event->has_usage){
+            fprintf(trace_file, ",\"utime_us\":%ld,\"stime_us\":%ld,"
+                    "\"maxrss_kb\":%ld", timeval_us(event->usage.ru_utime),
+                    timeval_us(event->usage.ru_stime),
+                    event->usage.ru_maxrss);
+        }
+        fprintf(trace_file, "}}");
+    }
+    fprintf(trace_file, "\n]}\n");
+    fclose(trace_file);
+    trace_file = NULL;
+}
+
+
+/*
+** Starts recording a timeline to be written to path when the shell
+** exits. Returns 0 on success, -1 if path can't be created.
+*/
+int trace_open(const char *path){
+    trace_file = fopen(path, "we");
+    if (trace_file == NULL){
+        perror(path);
+        return -1;
+    }
+    // the pool starts with the empty string, at offset 0
+    pool_cap = 65536;
+    pool = malloc(pool_cap);
+    if (pool == NULL){
+        perror("trace");
+        fclose(trace_file);
+        trace_file = NULL;
+        return -1;
+    }
+    pool[0] = '\0';
+    pool_len = 1;
+    trace_pid = getpid();
+    trace_on = 1;
+    atexit(trace_flush);
+    return 0;
+}
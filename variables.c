@@ -0,0 +1,182 @@
+#include "cscshell.h"
+
+/*
+** Shell variable store.
+**
+** Variables are kept in an open-addressing hash table (linear probing,
+** power-of-two capacity) for O(1) lookup by name, and are also threaded
+** through their `next` pointers in assignment order so that iteration
+** (the `set` builtin, snapshots) is stable. Each name is interned once in
+** its Variable together with its hash, so lookups can be done directly on
+** a (pointer, length) slice of a command line without copying the name.
+**
+** PATH additionally lives in a dedicated slot, since every executable
+** lookup needs it. Each assignment bumps the variable's generation, which
+** is how the line cache notices that a line it holds is out of date.
+*/
+
+#define VAR_TABLE_INIT_CAP 32
+
+
+void var_table_init(VarTable *table){
+    table->slots = NULL;
+    table->cap = 0;
+    table->count = 0;
+    table->head = NULL;
+    table->tail = NULL;
+    table->path = NULL;
+}
+
+
+static Variable **var_slot(Variable **slots, size_t cap, const char *name,
+                           size_t len, uint32_t hash){
+    size_t i = hash & (cap - 1);
+    while (slots[i] != NULL){
+        if (slots[i]->hash == hash && strncmp(slots[i]->name, name, len) == 0
+            && slots[i]->name[len] == '\0'){
+            break;
+        }
+        i = (i + 1) & (cap - 1);
+    }
+    return &slots[i];
+}
+
+
+static int var_table_grow(VarTable *table){
+    size_t new_cap = table->cap ? table->cap * 2 : VAR_TABLE_INIT_CAP;
+    Variable **new_slots = calloc(new_cap, sizeof(Variable *));
+    if (new_slots == NULL){
+        perror("var_table");
+        return -1;
+    }
+
+    // reinsert in assignment order; names are unique so no compare needed
+    for (Variable *var = table->head; var != NULL; var = var->next){
+        size_t i = var->hash & (new_cap - 1);
+        while (new_slots[i] != NULL){
+            i = (i + 1) & (new_cap - 1);
+        }
+        new_slots[i] = var;
+    }
+
+    free(table->slots);
+    table->slots = new_slots;
+    table->cap = new_cap;
+    return 0;
+}
+
+
+/*
+** Finds the variable whose name is the first len bytes of name.
+** Returns NULL if there is no such variable.
+*/
+Variable *var_lookup(VarTable *table, const char *name, size_t len){
+    if (table->cap == 0) return NULL;
+    return *var_slot(table->slots, table->cap, name, len,
+                     fnv1a_hash(name, len));
+}
+
+
+/*
+** Assigns value to the variable named by the first name_len bytes of
+** name, creating it at the end of the iteration order if needed.
+** Assigning PATH also forgets every remembered executable location, and
+** assigning an exported variable updates the environment.
+**
+** Returns the variable, or NULL if memory could not be allocated.
+*/
+Variable *var_set(VarTable *table, const char *name, size_t name_len,
+                  const char *value){
+    char *new_value = strdup(value);
+    if (new_value == NULL){
+        perror("var_set");
+        return NULL;
+    }
+
+    uint32_t hash = fnv1a_hash(name, name_len);
+    Variable *var = table->cap ?
+        *var_slot(table->slots, table->cap, name, name_len, hash) : NULL;
+
+    if (var == NULL){
+        // keep the load factor under 3/4
+        if ((table->count + 1) * 4 > table->cap * 3 &&
+            var_table_grow(table) < 0){
+            free(new_value);
+            return NULL;
+        }
+
+        var = malloc(sizeof(Variable));
+        if (var == NULL || (var->name = strndup(name, name_len)) == NULL){
+            perror("var_set");
+            free(var);
+            free(new_value);
+            return NULL;
+        }
+        var->value = NULL;
+        var->hash = hash;
+        var->generation = 0;
+        var->exported = 0;
+        var->next = NULL;
+
+        *var_slot(table->slots, table->cap, name, name_len, hash) = var;
+        if (table->tail == NULL){
+            table->head = var;
+        }
+        else {
+            table->tail->next = var;
+        }
+        table->tail = var;
+        table->count++;
+
+        if (strcmp(var->name, PATH_VAR_NAME) == 0){
+            table->path = var;
+        }
+    }
+
+    free(var->value);
+    var->value = new_value;
+    var->generation++;
+
+    if (var == table->path){
+        exec_cache_flush();
+    }
+    if (var->exported && var_export(var) < 0){
+        return NULL;
+    }
+    return var;
+}
+
+
+int var_export(Variable *var){
+    if (setenv(var->name, var->value, 1) < 0){
+        perror("export");
+        return -1;
+    }
+    var->exported = 1;
+    return 0;
+}
+
+
+/*
+** Frees every variable in the table and leaves it empty. Cached lines
+** refer to the variables they read, so they are dropped too.
+*/
+void var_table_free(VarTable *table){
+    line_cache_flush();
+    free_variable(table->head, NON_ZERO_BYTE);
+    free(table->slots);
+    var_table_init(table);
+}
+
+
+/*
+** Implements the `set` builtin: prints every variable as NAME=value in
+** the order they were first assigned.
+*/
+int set_cscshell(VarTable *table){
+    for (Variable *var = table->head; var != NULL; var = var->next){
+        printf("%s=%s\n", var->name, var->value);
+    }
+    fflush(stdout);
+    return 0;
+}